@@ -185,6 +185,8 @@ def parser_fit_add_arguments(args, func, parser):
 
 def parser_ld_add_arguments(args, func, parser):
     parser.add_argument("--plink-ld", type=str, default=None, help="Path to plink .ld.gz file to convert into BGMG binary format. ")
+    parser.add_argument("--plink-ld-version0", default=False, action="store_true", help="Convert --plink-ld into the old format (to be loaded with --plink-ld-bin0)")
+    parser.add_argument('--r2min', type=float, default=0.05, help="r2 values below this threshold only contribute to LD scores")
     parser.add_argument("--bim-file", type=str, default=None, help="Plink bim file. "
         "Defines the reference set of SNPs used for the analysis. "
         "Marker names must not have duplicated entries. "
@@ -606,7 +608,11 @@ def execute_ld_parser(args):
     fix_and_validate_args(args)
 
     libbgmg.init(args.bim_file, "", args.chr2use, "", "", "", "")
-    libbgmg.convert_plink_ld(args.plink_ld, args.out + '.bin')
+    if args.plink_ld_version0:
+        libbgmg.convert_plink_ld(args.plink_ld, args.out + '.bin')
+    else:
+        libbgmg.set_option('r2min', args.r2min)
+        libbgmg.convert_plink_ld_csr(args.plink_ld, args.out + '.bin')
     libbgmg.log_message('Done')
 
 def execute_fit_parser(args):
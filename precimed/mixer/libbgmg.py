@@ -113,12 +113,24 @@ class LibBgmg(object):
     def convert_plink_ld(self, plink_ld_gz, plink_ld_bin):
         return self._check_error(self.cdll.bgmg_convert_plink_ld(self._context_id, _p2n(plink_ld_gz), _p2n(plink_ld_bin)))
 
+    def convert_plink_ld_csr(self, plink_ld_gz, out_file):  # current LD matrix format, one file per chromosome (@ in out_file)
+        return self._check_error(self.cdll.bgmg_convert_plink_ld_csr(self._context_id, _p2n(plink_ld_gz), _p2n(out_file)))
+
+    def save_init_snapshot(self, filename):  # binary copy of the state produced by init()
+        return self._check_error(self.cdll.bgmg_save_init_snapshot(self._context_id, _p2n(filename)))
+
+    def load_init_snapshot(self, filename):  # alternative to init(), on a fresh context
+        return self._check_error(self.cdll.bgmg_load_init_snapshot(self._context_id, _p2n(filename)))
+
     def set_ld_r2_coo_from_file(self, chr_label, filename):
         return self._check_error(self.cdll.bgmg_set_ld_r2_coo_from_file(self._context_id, chr_label, _p2n(filename)))
 
     def set_ld_r2_csr(self, chr_label=-1):  # -1 means to finalize all chromosomes
         return self._check_error(self.cdll.bgmg_set_ld_r2_csr(self._context_id, chr_label))
 
+    def share_ld(self, src_context_id):  # re-use finalized LD structure of another context, instead of loading it again
+        return self._check_error(self.cdll.bgmg_share_ld(src_context_id, self._context_id))
+
     def set_weights_randprune(self, n, r2):
         return self._check_error(self.cdll.bgmg_set_weights_randprune(self._context_id, n, r2))
 
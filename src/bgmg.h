@@ -46,6 +46,16 @@ extern "C" {
   DLL_PUBLIC int64_t bgmg_init(int context_id, const char* bim_file, const char* frq_file, const char* chr_labels, const char* trait1_file, const char* trait2_file, const char* exclude, const char* extract);
   DLL_PUBLIC int64_t bgmg_convert_plink_ld(int context_id, const char* plink_ld_gz, const char* plink_ld_bin);
 
+  // Convert plink .ld.gz file into LD matrix files in the current format, one per chromosome (@ in out_file is replaced with chromosome label).
+  // Pairs with r2 below r2min option go to LD score sums; mafvec (if set) is used for the sums adjusted for heterozygosity.
+  // Unlike bgmg_convert_plink_ld the output is loaded by bgmg_set_ld_r2_coo_from_file without the ld_format_version=0 option.
+  DLL_PUBLIC int64_t bgmg_convert_plink_ld_csr(int context_id, const char* plink_ld_gz, const char* out_file);
+
+  // Save the state produced by bgmg_init (reference SNPs, tag indices, chrnumvec, mafvec, zvec and nvec) to a binary snapshot file.
+  // bgmg_load_init_snapshot restores it into a fresh context, instead of calling bgmg_init and parsing the input files again.
+  DLL_PUBLIC int64_t bgmg_save_init_snapshot(int context_id, const char* filename);
+  DLL_PUBLIC int64_t bgmg_load_init_snapshot(int context_id, const char* filename);
+
   // API to work with "defvec". Here 
   // - num_snp is how many SNPs there is in the reference (particularly, in LD files and mafvec)
   // - num_tag is how many SNPs there is in the GWAS (zvec, nvec, weights)
@@ -66,7 +76,12 @@ extern "C" {
   DLL_PUBLIC int64_t bgmg_retrieve_k_pdf(int context_id, int length, double* values);
 
   // Set variouns options:
-  // diag, kmax, r2min, max_causals, num_components, seed, fast_cost, threads, cache_tag_r2sum; refer to BgmgCalculator::set_option for a full list.
+  // diag, kmax, r2min, max_causals, num_components, seed, fast_cost, threads, cache_tag_r2sum, ld_r_codec; refer to BgmgCalculator::set_option for a full list.
+  // ld_r_codec selects how LD r values are stored after set_ld_r2_csr: 0 - 16-bit r (default), 1 - 8-bit r2 (loses the sign of r), 2 - fp16 r.
+  // ld_memory_budget_mb > 0 makes chromosomes from memory-mapped LD files (see bgmg_save_ld_r2_csr) load on first access,
+  // evicting least recently used chromosomes to stay within the budget.
+  // ld_symmetric = 1 keeps only the upper triangle of the LD matrix in memory; requires use_complete_tag_indices.
+  // ld_tag_major = 1 builds a transposed (tag to causal snps) LD index, used by the convolve cost calculator instead of use_complete_tag_indices.
   // NB. Most options reset LD structure, you'll have to bgmg_set_ld_r2_coo / bgmg_set_ld_r2_csr again.
   DLL_PUBLIC int64_t bgmg_set_option(int context_id, char* option, double value);
 
@@ -89,6 +104,14 @@ extern "C" {
   DLL_PUBLIC int64_t bgmg_set_ld_r2_coo(int context_id, int chr_label, int64_t length, int* snp_index, int* tag_index, float* r);
   DLL_PUBLIC int64_t bgmg_set_ld_r2_coo_from_file(int context_id, int chr_label, const char* filename);
   DLL_PUBLIC int64_t bgmg_set_ld_r2_csr(int context_id, int chr_label);
+  // Save finalized LD structure of a given chromosome (after bgmg_set_ld_r2_csr) in a memory-mapped format.
+  // bgmg_set_ld_r2_coo_from_file recognizes such files and maps them read-only, so that all processes share one copy via page cache.
+  // The file is only valid for the same reference, tag indices, mafvec and r2min.
+  DLL_PUBLIC int64_t bgmg_save_ld_r2_csr(int context_id, int chr_label, const char* filename);
+
+  // Attach dst_context_id to the finalized LD structure of src_context_id, so that both contexts use one copy in memory.
+  // Both contexts must have the same tag indices, chrnumvec, mafvec and r2min. Disposing src_context_id keeps the LD structure alive.
+  DLL_PUBLIC int64_t bgmg_share_ld(int src_context_id, int dst_context_id);
 
   // query LD structure of a given SNP or for a given chromosome
   DLL_PUBLIC int64_t bgmg_num_ld_r2_snp(int context_id, int snp_index);
@@ -132,6 +155,9 @@ extern "C" {
   DLL_PUBLIC int64_t bgmg_get_loglike_cache_bivariate_entry(int context_id, int entry_index, int pi_vec_len, float* pi_vec, int sig2_beta_len, float* sig2_beta, float* rho_beta, int sig2_zero_len, float* sig2_zero, float* rho_zero, double* cost);
 
   // estimate LD structure
-  DLL_PUBLIC int64_t bgmg_calc_ld_matrix(const char* bfile, const char* frqfile, const char* outfile, double r2min);
+  // ld_window (number of SNPs), ld_window_kb and ld_window_cm limit the distance between pairs of SNPs; use 0 to disable each limit.
+  DLL_PUBLIC int64_t bgmg_calc_ld_matrix(const char* bfile, const char* frqfile, const char* outfile, double r2min, int ld_window, double ld_window_kb, double ld_window_cm);
+  // one output file per chromosome: outfile must contain @ (replaced with chromosome label); bfile and frqfile are either genome-wide, or contain @.
+  DLL_PUBLIC int64_t bgmg_calc_ld_matrix_per_chr(const char* bfile, const char* frqfile, const char* chr_labels, const char* outfile, double r2min, int ld_window, double ld_window_kb, double ld_window_cm);
 }
 
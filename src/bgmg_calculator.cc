@@ -53,13 +53,18 @@
 
 #include "bgmg_log.h"
 #include "bgmg_parse.h"
+#include "ld_matrix.h"
 #include "bgmg_math.h"
+#include "mapped_file.h"
 #include "fmath.hpp"
 
 #include <immintrin.h>  // _mm_setcsr, _mm_getcsr
 
 #define FLOAT_TYPE float
 
+#define INIT_SNAPSHOT_MAGIC 0x50414e53474d4742ull  // "BGMGSNAP"
+#define INIT_SNAPSHOT_FORMAT_VERSION 2  // 2: bim columns stored as StringColumn / AlleleColumn
+
 std::vector<float>* BgmgCalculator::get_zvec(int trait_index) {
   if ((trait_index != 1) && (trait_index != 2)) BGMG_THROW_EXCEPTION(::std::runtime_error("trait must be 1 or 2"));
   return (trait_index == 1) ? &zvec1_ : &zvec2_;
@@ -76,8 +81,8 @@ std::vector<float>* BgmgCalculator::get_causalbetavec(int trait_index) {
 }
 
 BgmgCalculator::BgmgCalculator() : num_snp_(-1), num_tag_(-1), k_max_(100), seed_(0), 
-    use_complete_tag_indices_(false), r2_min_(0.0), z1max_(1e10), z2max_(1e10), ld_format_version_(-1), num_components_(1), 
-    max_causals_(100000), cost_calculator_(CostCalculator_Sampling), cache_tag_r2sum_(false), ld_matrix_csr_(*this),
+    use_complete_tag_indices_(false), r2_min_(0.0), z1max_(1e10), z2max_(1e10), ld_r_codec_(LdRCodec_Uint16_R), ld_memory_budget_mb_(0), ld_symmetric_(false), ld_tag_major_(false), ld_format_version_(-1), num_components_(1), 
+    max_causals_(100000), cost_calculator_(CostCalculator_Sampling), cache_tag_r2sum_(false), ld_matrix_csr_(std::make_shared<LdMatrixCsr>(*this)), ld_matrix_csr_borrowed_(false),
     cubature_abs_error_(0), cubature_rel_error_(1e-4), cubature_max_evals_(0), calc_k_pdf_(false) {
   boost::posix_time::ptime const time_epoch(boost::gregorian::date(1970, 1, 1));
   seed_ = (boost::posix_time::microsec_clock::local_time() - time_epoch).ticks();
@@ -190,6 +195,17 @@ int64_t BgmgCalculator::set_option(char* option, double value) {
   } else if (!strcmp(option, "z2max")) {
     if (value <= 0) BGMG_THROW_EXCEPTION(::std::runtime_error("zmax must be positive"));
     z2max_ = value; return 0;
+  } else if (!strcmp(option, "ld_r_codec")) {
+    int int_value = (int)value;
+    if (int_value < 0 || int_value > 2) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_r_codec value must be 0 (uint16 r), 1 (uint8 r2) or 2 (fp16 r)"));
+    ld_r_codec_ = (LdRCodec)int_value; clear_state(); return 0;
+  } else if (!strcmp(option, "ld_memory_budget_mb")) {
+    if (value < 0) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_memory_budget_mb must be non-negative"));
+    ld_memory_budget_mb_ = value; clear_state(); return 0;
+  } else if (!strcmp(option, "ld_symmetric")) {
+    ld_symmetric_ = (value != 0); clear_state(); return 0;
+  } else if (!strcmp(option, "ld_tag_major")) {
+    ld_tag_major_ = (value != 0); clear_state(); return 0;
   } else if (!strcmp(option, "ld_format_version")) {
     ld_format_version_ = int(value); return 0;
   } else if (!strcmp(option, "use_complete_tag_indices")) {
@@ -229,22 +245,47 @@ int64_t BgmgCalculator::set_tag_indices(int num_snp, int num_tag, int* tag_indic
   return 0;
 }
 
+void BgmgCalculator::check_ld_not_shared() {
+  if (ld_matrix_csr_.use_count() > 1 || ld_matrix_csr_borrowed_) BGMG_THROW_EXCEPTION(::std::runtime_error("LD structure is shared with another context (see share_ld), and can not be modified"));
+}
+
 int64_t BgmgCalculator::set_ld_r2_coo(int chr_label, int64_t length, int* snp_index, int* tag_index, float* r) {
-  return ld_matrix_csr_.set_ld_r2_coo(chr_label, length, snp_index, tag_index, r, r2_min_);
+  check_ld_not_shared();
+  return ld_matrix_csr_->set_ld_r2_coo(chr_label, length, snp_index, tag_index, r, r2_min_);
 }
 
 int64_t BgmgCalculator::set_ld_r2_coo(int chr_label, const std::string& filename) {
+  check_ld_not_shared();
   if (ld_format_version_ == 0)
-    return ld_matrix_csr_.set_ld_r2_coo_version0(chr_label, filename, r2_min_);
+    return ld_matrix_csr_->set_ld_r2_coo_version0(chr_label, filename, r2_min_);
 
-  return ld_matrix_csr_.set_ld_r2_coo(chr_label, filename, r2_min_);
+  return ld_matrix_csr_->set_ld_r2_coo(chr_label, filename, r2_min_);
 }
 
 int64_t BgmgCalculator::set_ld_r2_csr(int chr_label) {
-  int64_t retval = ld_matrix_csr_.set_ld_r2_csr(r2_min_, chr_label);
+  int64_t retval = ld_matrix_csr_->set_ld_r2_csr(r2_min_, chr_label);
   return retval;
 }
 
+int64_t BgmgCalculator::save_ld_r2_csr(int chr_label, const std::string& filename) {
+  return ld_matrix_csr_->save_ld_r2_csr(chr_label, filename, r2_min_, *this);
+}
+
+int64_t BgmgCalculator::share_ld(BgmgCalculator& src) {
+  LOG << ">share_ld()";
+  if (!src.ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call share_ld before set_ld_r2_csr in the source context"));
+  if (num_snp_ != src.num_snp_ || tag_to_snp_ != src.tag_to_snp_) BGMG_THROW_EXCEPTION(::std::runtime_error("share_ld requires the same set_tag_indices in both contexts"));
+  if (chrnumvec_ != src.chrnumvec_) BGMG_THROW_EXCEPTION(::std::runtime_error("share_ld requires the same chrnumvec in both contexts"));
+  if (mafvec_ != src.mafvec_) BGMG_THROW_EXCEPTION(::std::runtime_error("share_ld requires the same mafvec in both contexts"));
+  if (r2_min_ != src.r2_min_) BGMG_THROW_EXCEPTION(::std::runtime_error("share_ld requires the same r2min option in both contexts"));
+
+  clear_state();
+  ld_matrix_csr_ = src.ld_matrix_csr_;
+  ld_matrix_csr_borrowed_ = true;
+  LOG << "<share_ld(), LD structure is now used by " << ld_matrix_csr_.use_count() << " contexts";
+  return 0;
+}
+
 
 /*
 // Nice trick, but not so important for performance.
@@ -400,7 +441,7 @@ int64_t BgmgCalculator::find_tag_r2sum(int component_id, float num_causals) {
   }
 
   // apply infinitesimal model to adjust tag_r2sum for all r2 that are below r2min (and thus do not contribute via resampling)
-  const std::vector<float>& tag_sum_r2_below_r2min = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
+  const std::vector<float>& tag_sum_r2_below_r2min = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
   const float pival_delta = (num_causals_original - last_num_causals_original) / static_cast<float>(num_snp_);
 
   std::vector<float> hvec;
@@ -409,17 +450,19 @@ int64_t BgmgCalculator::find_tag_r2sum(int component_id, float num_causals) {
   // it is OK to parallelize the following loop on k_index, because:
   // - all structures here are readonly, except tag_r2sum_ that we are accumulating
   // - two threads will never touch the same memory location (that's why we choose k_index as an outer loop)
+  // - chunks of k_index are whole column tiles of tag_r2sum_, so two threads will not even share a cache line
+  const int k_chunk = TiledMatrix<float>::tile_cols;
 #pragma omp parallel
 {
   LdMatrixRow ld_matrix_row;
 
-#pragma omp for schedule(static)
+#pragma omp for schedule(static, k_chunk)
   for (int k_index = 0; k_index < k_max_; k_index++) {
     for (auto change : changeset) {
       int scan_index = change.first;
       float scan_weight = change.second;
       int snp_index = (*snp_order_[component_id])(scan_index, k_index);  // index of a causal snp
-      ld_matrix_csr_.extract_row(snp_index, &ld_matrix_row);
+      ld_matrix_csr_->extract_row(snp_index, &ld_matrix_row);
       auto iter_end = ld_matrix_row.end();
       for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
         int tag_index = iter.tag_index();
@@ -472,7 +515,7 @@ int64_t BgmgCalculator::retrieve_ld_tag_r2_sum(int length, float* buffer) {
   check_num_tag(length);
   LOG << " retrieve_ld_tag_r2_sum()";
   for (int tag_index = 0; tag_index < num_tag_; tag_index++) {
-    buffer[tag_index] = ld_matrix_csr_.ld_tag_sum()->ld_tag_sum_r2()[tag_index];
+    buffer[tag_index] = ld_matrix_csr_->ld_tag_sum()->ld_tag_sum_r2()[tag_index];
   }
   return 0;
 }
@@ -481,7 +524,7 @@ int64_t BgmgCalculator::retrieve_ld_tag_r4_sum(int length, float* buffer) {
   check_num_tag(length);
   LOG << " retrieve_ld_tag_r4_sum()";
   for (int tag_index = 0; tag_index < num_tag_; tag_index++) {
-    buffer[tag_index] = ld_matrix_csr_.ld_tag_sum()->ld_tag_sum_r4()[tag_index];
+    buffer[tag_index] = ld_matrix_csr_->ld_tag_sum()->ld_tag_sum_r4()[tag_index];
   }
   return 0;
 }
@@ -543,6 +586,51 @@ inline T censored_cdf(const T z, const T s) {
   return std::erfc((z / s) * inv_sqrt_2) + std::numeric_limits<T>::min();
 }
 
+// Sum over k of gaussian_pdf<float>(z, sqrt(r2sum(tag_index, k) * n_sig2_beta + sig2_zero)), k = 0..r2sum.no_columns()-1.
+// This is the mixture over sampled causal configurations in calc_univariate_cost_cache.
+// The row is read segment by segment (see TiledMatrix); with AVX2, 8 values of k are evaluated at once using fmath::exp_ps256.
+inline double gaussian_pdf_sum(const TiledMatrix<float>& r2sum, int tag_index, float z, float n_sig2_beta, float sig2_zero) {
+  static const float inv_sqrt_2pi = static_cast<float>(0.3989422804014327);
+  const float minus_half_z2 = -0.5f * z * z;
+  const int k_max = r2sum.no_columns();
+  const int tile_cols = TiledMatrix<float>::tile_cols;
+  double pdf_sum = 0.0;
+#ifdef __AVX2__
+  const __m256 n_sig2_beta8 = _mm256_set1_ps(n_sig2_beta);
+  const __m256 sig2_zero8 = _mm256_set1_ps(sig2_zero);
+  const __m256 minus_half_z2_8 = _mm256_set1_ps(minus_half_z2);
+  const __m256 inv_sqrt_2pi8 = _mm256_set1_ps(inv_sqrt_2pi);
+  const __m256 one8 = _mm256_set1_ps(1.0f);
+  __m256d pdf_sum_lo = _mm256_setzero_pd();
+  __m256d pdf_sum_hi = _mm256_setzero_pd();
+#endif
+  for (int k_tile = 0; k_tile < r2sum.no_col_tiles(); k_tile++) {
+    const float* segment = r2sum.row_segment(tag_index, k_tile);
+    const int segment_size = std::min(tile_cols, k_max - k_tile * tile_cols);
+    int k_index = 0;
+#ifdef __AVX2__
+    for (; k_index + 8 <= segment_size; k_index += 8) {
+      const __m256 sig2eff = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(&segment[k_index]), n_sig2_beta8), sig2_zero8);
+      const __m256 inv_sig2eff = _mm256_div_ps(one8, sig2eff);
+      const __m256 pdf = _mm256_mul_ps(_mm256_mul_ps(inv_sqrt_2pi8, _mm256_sqrt_ps(inv_sig2eff)),
+                                       fmath::exp_ps256(_mm256_mul_ps(minus_half_z2_8, inv_sig2eff)));
+      pdf_sum_lo = _mm256_add_pd(pdf_sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(pdf)));
+      pdf_sum_hi = _mm256_add_pd(pdf_sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(pdf, 1)));
+    }
+#endif
+    for (; k_index < segment_size; k_index++) {
+      const float sig2eff = segment[k_index] * n_sig2_beta + sig2_zero;
+      pdf_sum += static_cast<double>(inv_sqrt_2pi / std::sqrt(sig2eff) * std::exp(minus_half_z2 / sig2eff));
+    }
+  }
+#ifdef __AVX2__
+  double pdf_sum4[4];
+  _mm256_storeu_pd(pdf_sum4, _mm256_add_pd(pdf_sum_lo, pdf_sum_hi));
+  pdf_sum += (pdf_sum4[0] + pdf_sum4[1]) + (pdf_sum4[2] + pdf_sum4[3]);
+#endif
+  return pdf_sum + static_cast<double>(k_max) * std::numeric_limits<float>::min();
+}
+
 
 /*
 // partial specification for float, to use fmath::exp instead of std::exp
@@ -873,17 +961,19 @@ double BgmgCalculator::calc_univariate_cost_cache(int trait_index, float pi_vec,
     if (weights_[tag_index] == 0) continue;
     if (!std::isfinite(zvec[tag_index]) || !std::isfinite(nvec[tag_index])) continue;
 
-    double pdf_tag = 0.0f;
-    for (int k_index = 0; k_index < k_max_; k_index++) {
-      float tag_r2sum = (*tag_r2sum_[component_id])(tag_index, k_index);
-      float sig2eff = tag_r2sum * nvec[tag_index] * sig2_beta + sig2_zero;
-
-      const float tag_z = zvec[tag_index] - fixed_effect_delta[tag_index];  // apply causalbetavec;
-      float s = sqrt(sig2eff);
-      const bool censoring = std::abs(tag_z) > z1max_;
+    const float tag_z = zvec[tag_index] - fixed_effect_delta[tag_index];  // apply causalbetavec;
+    const float n_sig2_beta = nvec[tag_index] * sig2_beta;
+    const TiledMatrix<float>& tag_r2sum = *tag_r2sum_[component_id];
+    const bool censoring = std::abs(tag_z) > z1max_;
 
-      double pdf = static_cast<double>(censoring ? censored_cdf<FLOAT_TYPE>(z1max_, s) : gaussian_pdf<FLOAT_TYPE>(tag_z, s));
-      pdf_tag += pi_k * pdf;
+    double pdf_tag = 0.0;
+    if (censoring) {
+      for (int k_index = 0; k_index < k_max_; k_index++) {
+        const float s = sqrt(tag_r2sum(tag_index, k_index) * n_sig2_beta + sig2_zero);
+        pdf_tag += pi_k * static_cast<double>(censored_cdf<FLOAT_TYPE>(z1max_, s));
+      }
+    } else {
+      pdf_tag = pi_k * gaussian_pdf_sum(tag_r2sum, tag_index, tag_z, n_sig2_beta, sig2_zero);
     }
     double increment = -std::log(pdf_tag) * static_cast<double>(weights_[tag_index]);
     if (!std::isfinite(increment)) num_infinite++;
@@ -1603,7 +1693,7 @@ void BgmgCalculator::log_diagnostics() {
   size_t mem_bytes = 0, mem_bytes_total = 0;
   LOG << " diag: num_snp_=" << num_snp_;
   LOG << " diag: num_tag_=" << num_tag_;
-  mem_bytes_total += ld_matrix_csr_.log_diagnostics();
+  mem_bytes_total += ld_matrix_csr_->log_diagnostics();
   LOG << " diag: zvec1_.size()=" << zvec1_.size();
   LOG << " diag: zvec1_=" << std_vector_to_str(zvec1_);
   LOG << " diag: nvec1_.size()=" << nvec1_.size();
@@ -1626,7 +1716,7 @@ void BgmgCalculator::log_diagnostics() {
     LOG << " diag: snp_order_[" << i << "]=" << snp_order_[i]->to_str();
   }
   for (int i = 0; i < tag_r2sum_.size(); i++) {
-    mem_bytes = tag_r2sum_[i]->size() * sizeof(float); mem_bytes_total += mem_bytes;
+    mem_bytes = tag_r2sum_[i]->mem_bytes(); mem_bytes_total += mem_bytes;
     LOG << " diag: tag_r2sum_[" << i << "].shape=[" << tag_r2sum_[i]->no_rows() << ", " << tag_r2sum_[i]->no_columns() << "]" << " (mem usage = " << mem_bytes << " bytes)";
     LOG << " diag: tag_r2sum_[" << i << "]=" << tag_r2sum_[i]->to_str();
   }
@@ -1650,6 +1740,9 @@ void BgmgCalculator::log_diagnostics() {
   LOG << " diag: options.cubature_max_evals_=" << (cubature_max_evals_);
   LOG << " diag: options.calc_k_pdf_=" << (calc_k_pdf_);
   LOG << " diag: options.ld_format_version_=" << (ld_format_version_);
+  LOG << " diag: options.ld_memory_budget_mb_=" << (ld_memory_budget_mb_);
+  LOG << " diag: options.ld_symmetric_=" << (ld_symmetric_ ? "yes" : "no");
+  LOG << " diag: options.ld_tag_major_=" << (ld_tag_major_ ? "yes" : "no");
   LOG << " diag: Estimated memory usage (total): " << mem_bytes_total << " bytes";
 }
 
@@ -1679,8 +1772,8 @@ double BgmgCalculator::calc_univariate_cost_fast(int trait_index, float pi_vec,
     if (!std::isfinite(zvec[tag_index]) || !std::isfinite(nvec[tag_index])) continue;
     double tag_weight = static_cast<double>(weights_[tag_index]);
     
-    const float tag_r2 = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2()[tag_index];
-    const float tag_r4 = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r4()[tag_index];
+    const float tag_r2 = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2()[tag_index];
+    const float tag_r4 = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r4()[tag_index];
 
     if (tag_r2 == 0 || tag_r4 == 0) {
       num_zero_tag_r2++; continue;
@@ -1746,8 +1839,8 @@ double BgmgCalculator::calc_bivariate_cost_fast(int pi_vec_len, float* pi_vec, i
     const float z2 = zvec2_[tag_index] - fixed_effect_delta2[tag_index];
     const float n2 = nvec2_[tag_index];
 
-    const float tag_r2 = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2()[tag_index];
-    const float tag_r4 = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r4()[tag_index];
+    const float tag_r2 = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2()[tag_index];
+    const float tag_r4 = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r4()[tag_index];
 
     if (tag_r2 == 0 || tag_r4 == 0) {
       num_zero_tag_r2++; continue;
@@ -1817,8 +1910,7 @@ class UnivariateCharacteristicFunctionData {
   float sig2_zero;
   float sig2_beta;
   int tag_index;  // for which SNP to calculate the characteristic function
-                  // note that use_complete_tag_indices_ must be enabled for "convolve" calculator, 
-                  // so "tag" and "snp" are in the same indexing
+                  // ld_matrix_row holds all causal SNPs in LD with this tag (see extract_convolve_row)
   LdMatrixRow* ld_matrix_row;
   const std::vector<float>* hvec;
   const std::vector<float>* zvec;
@@ -1851,8 +1943,8 @@ int calc_univariate_characteristic_function_times_cosinus(unsigned ndim, const d
                                        // ld_matrix was designed to work with "sampling" calculator which require 
                                        // a mapping from a causal SNP "i" to all tag SNPs "j" that are in LD with "i".
                                        // however, for for "convolve" we are interested in mapping from a tag SNP "j"
-                                       // to all causal SNPs "i" in LD with "j". To make this work we store a complete
-                                       // LD matrix (e.g. _num_snp == _num_tag), and explore symmetry of the matrix. 
+                                       // to all causal SNPs "i" in LD with "j". This is either the tag-major index,
+                                       // or, with a complete LD matrix (e.g. _num_snp == _num_tag), a row of the matrix (by symmetry).
     float r2 = iter.r2();
     float hval = (*data->hvec)[snp_index];
     result *= (double)(pi0 + pi1 * std::exp(minus_tsqr_half * sig2beta_times_nval * r2 * hval));
@@ -1873,8 +1965,19 @@ int calc_univariate_characteristic_function_for_integration(unsigned ndim, const
   return retval;
 }
 
+void BgmgCalculator::check_convolve_ld() {
+  if (!use_complete_tag_indices_ && !ld_matrix_csr_->is_tag_major())
+    BGMG_THROW_EXCEPTION(::std::runtime_error("Convolve calculator require 'use_complete_tag_indices' or 'ld_tag_major' option"));
+}
+
+// All causal SNPs in LD with a tag -- see a large comment in calc_univariate_characteristic_function_times_cosinus function.
+void BgmgCalculator::extract_convolve_row(int tag_index, LdMatrixRow* ld_matrix_row) {
+  if (ld_matrix_csr_->is_tag_major()) ld_matrix_csr_->extract_tag_row(tag_index, ld_matrix_row);
+  else ld_matrix_csr_->extract_row(tag_index, ld_matrix_row);  // yes, causal==tag in this case
+}
+
 double BgmgCalculator::calc_univariate_cost_convolve(int trait_index, float pi_vec, float sig2_zero, float sig2_beta) {
-  if (!use_complete_tag_indices_) BGMG_THROW_EXCEPTION(::std::runtime_error("Convolve calculator require 'use_complete_tag_indices' option"));
+  check_convolve_ld();
 
   std::vector<float>& nvec(*get_nvec(trait_index));
   std::vector<float>& zvec(*get_zvec(trait_index));
@@ -1917,15 +2020,14 @@ double BgmgCalculator::calc_univariate_cost_convolve(int trait_index, float pi_v
     data.zvec = &zvec;
     data.nvec = &nvec;
     data.fixed_effect_delta = &fixed_effect_delta;
-    data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
+    data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
 
 #pragma omp for schedule(static) reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals)
     for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
       double tag_weight = static_cast<double>(weights_[tag_index]);
 
-      const int causal_index = tag_index; // yes, causal==tag in this case -- see a large comment in calc_univariate_characteristic_function_times_cosinus function.
-      ld_matrix_csr_.extract_row(causal_index, data.ld_matrix_row);
+      extract_convolve_row(tag_index, data.ld_matrix_row);
       data.tag_index = tag_index;
       data.func_evals = 0;
 
@@ -1968,8 +2070,7 @@ class BivariateCharacteristicFunctionData {
   float rho_zero;
 
   int tag_index;  // for which SNP to calculate the characteristic function
-                  // note that use_complete_tag_indices_ must be enabled for "convolve" calculator, 
-                  // so "tag" and "snp" are in the same indexing
+                  // ld_matrix_row holds all causal SNPs in LD with this tag (see extract_convolve_row)
   LdMatrixRow* ld_matrix_row;
 
   const std::vector<float>* hvec;
@@ -2053,7 +2154,7 @@ int calc_bivariate_characteristic_function_for_integration(unsigned ndim, const
 }
 
 double BgmgCalculator::calc_bivariate_cost_convolve(int pi_vec_len, float* pi_vec, int sig2_beta_len, float* sig2_beta, float rho_beta, int sig2_zero_len, float* sig2_zero, float rho_zero) {
-  if (!use_complete_tag_indices_) BGMG_THROW_EXCEPTION(::std::runtime_error("Convolve calculator require 'use_complete_tag_indices' option"));
+  check_convolve_ld();
   if (!causalbetavec1_.empty() || !causalbetavec2_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("Convolve calculator does not support causalbetavec"));
 
   std::string ss = calc_bivariate_params_to_str(pi_vec_len, pi_vec, sig2_beta_len, sig2_beta, rho_beta, sig2_zero_len, sig2_zero, rho_zero, -1);
@@ -2094,15 +2195,14 @@ double BgmgCalculator::calc_bivariate_cost_convolve(int pi_vec_len, float* pi_ve
     data.nvec1 = &nvec1_;
     data.zvec2 = &zvec2_;
     data.nvec2 = &nvec2_;
-    data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
+    data.ld_tag_sum_r2_below_r2min_adjust_for_hvec = &ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
 
 #pragma omp for schedule(static) reduction(+: log_pdf_total, num_snp_failed, num_infinite, func_evals)
     for (int deftag_index = 0; deftag_index < num_deftag; deftag_index++) {
       int tag_index = deftag_indices[deftag_index];
       double tag_weight = static_cast<double>(weights_[tag_index]);
 
-      const int causal_index = tag_index; // yes, causal==tag in this case -- see a large comment in calc_univariate_characteristic_function_times_cosinus function.
-      ld_matrix_csr_.extract_row(causal_index, data.ld_matrix_row);
+      extract_convolve_row(tag_index, data.ld_matrix_row);
       data.tag_index = tag_index;
       data.func_evals = 0;
 
@@ -2139,7 +2239,9 @@ double BgmgCalculator::calc_bivariate_cost_convolve(int pi_vec_len, float* pi_ve
 void BgmgCalculator::clear_state() {
   LOG << " clear_state";
 
-  ld_matrix_csr_.clear();
+  // LD structure might be shared with other contexts, so we don't clear it in place
+  ld_matrix_csr_ = std::make_shared<LdMatrixCsr>(*this, ld_r_codec_, static_cast<size_t>(ld_memory_budget_mb_ * 1024.0 * 1024.0), ld_symmetric_, ld_tag_major_);
+  ld_matrix_csr_borrowed_ = false;
 
   // clear ordering of SNPs
   snp_order_.clear();
@@ -2156,7 +2258,7 @@ void BgmgCalculator::clear_tag_r2sum(int component_id) {
       // Initialize
       for (int i = 0; i < num_components_; i++) {
         last_num_causals_.push_back(0.0f);
-        tag_r2sum_.push_back(std::make_shared<DenseMatrix<float>>(num_tag_, k_max_));
+        tag_r2sum_.push_back(std::make_shared<TiledMatrix<float>>(num_tag_, k_max_));
         tag_r2sum_[i]->InitializeZeros();
       }
     } else {
@@ -2173,7 +2275,7 @@ void BgmgCalculator::clear_tag_r2sum(int component_id) {
 
 int64_t BgmgCalculator::perform_ld_clump(float r2_threshold, int length, float* buffer) {
   check_num_tag(length);
-  if (!ld_matrix_csr_.is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call perform_ld_clump before set_ld_r2_csr"));
+  if (!ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call perform_ld_clump before set_ld_r2_csr"));
   if (r2_threshold < r2_min_) BGMG_THROW_EXCEPTION(::std::runtime_error("perform_ld_clump: r2 < r2_min_"));
   LOG << ">perform_ld_clump(length=" << length << ", r2=" << r2_threshold << ")";
   SimpleTimer timer(-1);
@@ -2204,7 +2306,7 @@ int64_t BgmgCalculator::perform_ld_clump(float r2_threshold, int length, float*
 
     // Step 3. eliminate all unprocessed tag SNPs in LD with max_index
     int causal_index = tag_to_snp_[tag_index];
-    ld_matrix_csr_.extract_row(causal_index, &ld_matrix_row);
+    ld_matrix_csr_->extract_row(causal_index, &ld_matrix_row);
     auto iter_end = ld_matrix_row.end();
     for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
       const int tag_index_in_ld = iter.tag_index();
@@ -2221,7 +2323,7 @@ int64_t BgmgCalculator::perform_ld_clump(float r2_threshold, int length, float*
 }
 
 int64_t BgmgCalculator::set_weights_randprune(int n, float r2_threshold) {
-  if (!ld_matrix_csr_.is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_weights_randprune before set_ld_r2_csr"));
+  if (!ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_weights_randprune before set_ld_r2_csr"));
   LOG << ">set_weights_randprune(n=" << n << ", r2=" << r2_threshold << ")";
   if (r2_threshold < r2_min_) BGMG_THROW_EXCEPTION(::std::runtime_error("set_weights_randprune: r2 < r2_min_"));
   if (n <= 0) BGMG_THROW_EXCEPTION(::std::runtime_error("set_weights_randprune: n <= 0"));
@@ -2290,7 +2392,7 @@ int64_t BgmgCalculator::set_weights_randprune(int n, float r2_threshold) {
 
         passed_random_pruning_local[random_tag_index] += 1;
         int causal_index = tag_to_snp_[random_tag_index];
-        ld_matrix_csr_.extract_row(causal_index, &ld_matrix_row);
+        ld_matrix_csr_->extract_row(causal_index, &ld_matrix_row);
         auto iter_end = ld_matrix_row.end();
         int num_changes = 0;
         for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
@@ -2423,7 +2525,7 @@ void BgmgCalculator::find_tag_r2sum_no_cache(int component_id, float num_causal,
     int scan_index = change.first;
     float scan_weight = change.second;
     int snp_index = (*snp_order_[component_id])(scan_index, k_index);
-    ld_matrix_csr_.extract_row(snp_index, &ld_matrix_row);
+    ld_matrix_csr_->extract_row(snp_index, &ld_matrix_row);
     auto iter_end = ld_matrix_row.end();
     for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
       const float mafval = mafvec_[snp_index];
@@ -2435,7 +2537,7 @@ void BgmgCalculator::find_tag_r2sum_no_cache(int component_id, float num_causal,
   }
 
   // apply infinitesimal model to adjust tag_r2sum for all r2 that are below r2min (and thus do not contribute via resampling)
-  const std::vector<float>& tag_sum_r2_below_r2min = ld_matrix_csr_.ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
+  const std::vector<float>& tag_sum_r2_below_r2min = ld_matrix_csr_->ld_tag_sum_adjust_for_hvec()->ld_tag_sum_r2(LD_TAG_COMPONENT_BELOW_R2MIN);
   const float pival = num_causal / static_cast<float>(num_snp_);
   for (int i = 0; i < num_tag_; i++) {
     buffer->at(i) += (pival * tag_sum_r2_below_r2min[i]);
@@ -2445,7 +2547,7 @@ void BgmgCalculator::find_tag_r2sum_no_cache(int component_id, float num_causal,
 int64_t BgmgCalculator::retrieve_weighted_causal_r2(int length, float* buffer) {
   if (length != num_snp_) BGMG_THROW_EXCEPTION(::std::runtime_error("length != num_snp_: wrong buffer size"));
   if (weights_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("weights are not set"));
-  if (!ld_matrix_csr_.is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call retrieve_weighted_causal_r2 before set_ld_r2_csr"));
+  if (!ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call retrieve_weighted_causal_r2 before set_ld_r2_csr"));
 
   LOG << ">retrieve_weighted_causal_r2()";
   SimpleTimer timer(-1);
@@ -2454,7 +2556,7 @@ int64_t BgmgCalculator::retrieve_weighted_causal_r2(int length, float* buffer) {
 
   LdMatrixRow ld_matrix_row;
   for (int causal_index = 0; causal_index < num_snp_; causal_index++) {
-    ld_matrix_csr_.extract_row(causal_index, &ld_matrix_row);
+    ld_matrix_csr_->extract_row(causal_index, &ld_matrix_row);
     auto iter_end = ld_matrix_row.end();
     for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
       const int tag_index = iter.tag_index();
@@ -2545,9 +2647,9 @@ int64_t BgmgCalculator::retrieve_chrnumvec(int length, int* buffer) {
 }
 
 int64_t BgmgCalculator::num_ld_r2_snp(int snp_index) {
-  if (!ld_matrix_csr_.is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call num_ld_r2_snp before set_ld_r2_csr"));
+  if (!ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call num_ld_r2_snp before set_ld_r2_csr"));
   CHECK_SNP_INDEX((*this), snp_index);
-  return ld_matrix_csr_.num_ld_r2(snp_index);
+  return ld_matrix_csr_->num_ld_r2(snp_index);
 }
 
 int64_t BgmgCalculator::retrieve_ld_r2_snp(int snp_index, int length, int* tag_index, float* r2) {
@@ -2555,7 +2657,7 @@ int64_t BgmgCalculator::retrieve_ld_r2_snp(int snp_index, int length, int* tag_i
   LOG << " retrieve_ld_r2_snp(snp_index=" << snp_index << ")";
   
   LdMatrixRow ld_matrix_row;
-  ld_matrix_csr_.extract_row(snp_index, &ld_matrix_row);
+  ld_matrix_csr_->extract_row(snp_index, &ld_matrix_row);
   auto iter_end = ld_matrix_row.end();
   int r2_index = 0;
   for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
@@ -2568,7 +2670,7 @@ int64_t BgmgCalculator::retrieve_ld_r2_snp(int snp_index, int length, int* tag_i
 }
 
 int64_t BgmgCalculator::num_ld_r2_chr(int chr_label) {
-  if (!ld_matrix_csr_.is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call num_ld_r2_chr before set_ld_r2_csr"));
+  if (!ld_matrix_csr_->is_ready()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call num_ld_r2_chr before set_ld_r2_csr"));
 
   int64_t retval = 0;
   for (int snp_index = 0; snp_index < num_snp_; snp_index++) {
@@ -2587,7 +2689,7 @@ int64_t BgmgCalculator::retrieve_ld_r2_chr(int chr_label, int64_t length, int* s
   LdMatrixRow ld_matrix_row;
   for (int causal_index = 0; causal_index < num_snp_; causal_index++) {
     if (chrnumvec_[causal_index] != chr_label) continue;
-    ld_matrix_csr_.extract_row(causal_index, &ld_matrix_row);
+    ld_matrix_csr_->extract_row(causal_index, &ld_matrix_row);
     auto iter_end = ld_matrix_row.end();
     for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
       snp_index[r2_index] = causal_index;
@@ -2766,6 +2868,79 @@ int64_t BgmgCalculator::convert_plink_ld(std::string plink_ld_gz, std::string pl
   return 0;
 }
 
+int64_t BgmgCalculator::convert_plink_ld_csr(std::string plink_ld_gz, std::string out_file) {
+  if (bim_file_.size() == 0) BGMG_THROW_EXCEPTION(::std::runtime_error("call init or load_init_snapshot first"));
+  convert_plink_ld_to_ld_matrix(plink_ld_gz, bim_file_, mafvec_, r2_min_, out_file);
+  return 0;
+}
+
+int64_t BgmgCalculator::save_init_snapshot(std::string filename) {
+  if (num_snp_ == -1 || num_tag_ == -1) BGMG_THROW_EXCEPTION(::std::runtime_error("call init or set_tag_indices first"));
+  LOG << ">save_init_snapshot(filename=" << filename << "), format version " << INIT_SNAPSHOT_FORMAT_VERSION;
+  SimpleTimer timer(-1);
+
+  std::ofstream os(filename, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open " + filename));
+
+  save_value(os, static_cast<uint64_t>(INIT_SNAPSHOT_MAGIC));
+  save_value(os, static_cast<uint64_t>(INIT_SNAPSHOT_FORMAT_VERSION));
+  save_value(os, static_cast<int32_t>(num_snp_));
+  save_value(os, static_cast<int32_t>(num_tag_));
+  bim_file_.save(os);
+  save_aligned_vector(os, tag_to_snp_.data(), tag_to_snp_.size());
+  save_aligned_vector(os, chrnumvec_.data(), chrnumvec_.size());
+  save_aligned_vector(os, mafvec_.data(), mafvec_.size());
+  for (int trait = 1; trait <= 2; trait++) {
+    save_aligned_vector(os, get_zvec(trait)->data(), get_zvec(trait)->size());
+    save_aligned_vector(os, get_nvec(trait)->data(), get_nvec(trait)->size());
+  }
+
+  os.close();
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
+  LOG << "<save_init_snapshot(filename=" << filename << "); elapsed time " << timer.elapsed_ms() << "ms";
+  return 0;
+}
+
+int64_t BgmgCalculator::load_init_snapshot(std::string filename) {
+  LOG << ">load_init_snapshot(filename=" << filename << ")";
+  SimpleTimer timer(-1);
+
+  MappedReader reader(filename);
+  if (reader.value<uint64_t>() != INIT_SNAPSHOT_MAGIC) BGMG_THROW_EXCEPTION(::std::runtime_error(filename + " is not an init snapshot"));
+  const uint64_t format_version = reader.value<uint64_t>();
+  if (format_version != INIT_SNAPSHOT_FORMAT_VERSION) BGMG_THROW_EXCEPTION(::std::runtime_error(filename + " has unsupported format version " + std::to_string(format_version)));
+  const int num_snp = reader.value<int32_t>();
+  const int num_tag = reader.value<int32_t>();
+
+  BimFile bim_file;
+  bim_file.load(reader);
+  std::vector<int> tag_to_snp, chrnumvec;
+  std::vector<float> mafvec, zvec[2], nvec[2];
+  reader.vector(&tag_to_snp);
+  reader.vector(&chrnumvec);
+  reader.vector(&mafvec);
+  for (int trait = 1; trait <= 2; trait++) {
+    reader.vector(&zvec[trait - 1]);
+    reader.vector(&nvec[trait - 1]);
+  }
+  if ((tag_to_snp.size() != num_tag) || ((bim_file.size() != 0) && (bim_file.size() != num_snp)))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent init snapshot " + filename));
+
+  // same sequence of calls as in init()
+  if (bim_file.size() > 0) bim_file.find_snp_to_index_map();
+  set_tag_indices(num_snp, num_tag, tag_to_snp.data());
+  bim_file_ = std::move(bim_file);
+  if (!chrnumvec.empty()) set_chrnumvec(chrnumvec.size(), chrnumvec.data());
+  if (!mafvec.empty()) set_mafvec(mafvec.size(), mafvec.data());
+  for (int trait = 1; trait <= 2; trait++) {
+    if (!zvec[trait - 1].empty()) set_zvec(trait, zvec[trait - 1].size(), zvec[trait - 1].data());
+    if (!nvec[trait - 1].empty()) set_nvec(trait, nvec[trait - 1].size(), nvec[trait - 1].data());
+  }
+
+  LOG << "<load_init_snapshot(filename=" << filename << "); num_snp=" << num_snp << ", num_tag=" << num_tag << "; elapsed time " << timer.elapsed_ms() << "ms";
+  return 0;
+}
+
 int64_t BgmgCalculator::num_ld_r2_snp_range(int snp_index_from, int snp_index_to) {
   return retrieve_ld_r2_snp_range(snp_index_from, snp_index_to, -1, nullptr, nullptr, nullptr);
 }
@@ -2777,7 +2952,7 @@ int64_t BgmgCalculator::retrieve_ld_r2_snp_range(int snp_index_from, int snp_ind
   int64_t num_r2 = 0;
   LdMatrixRow ld_matrix_row;
   for (int iter_snp_index = snp_index_from; iter_snp_index < snp_index_to; iter_snp_index++) {
-    ld_matrix_csr_.extract_row(iter_snp_index, &ld_matrix_row);
+    ld_matrix_csr_->extract_row(iter_snp_index, &ld_matrix_row);
     auto iter_end = ld_matrix_row.end();
     for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
       const int iter_tag_index = iter.tag_index();
@@ -2809,6 +2984,7 @@ void BgmgCalculator::calc_fixed_effect_delta_from_causalbetavec(int trait_index,
   if (causalbetavec.empty()) return;
   check_num_snp(causalbetavec.size());
 
+  if (!ld_matrix_csr_->has_r_sign()) BGMG_THROW_EXCEPTION(::std::runtime_error("calc_fixed_effect_delta_from_causalbetavec requires the sign of LD r, which is not kept with ld_r_codec=1"));
   LOG << ">calc_fixed_effect_delta_from_causalbetavec(trait_index=" << trait_index << ")";
   SimpleTimer timer(-1);
 
@@ -2826,7 +3002,7 @@ void BgmgCalculator::calc_fixed_effect_delta_from_causalbetavec(int trait_index,
 #pragma omp for schedule(static)
     for (int causal_index = 0; causal_index < num_snp_; causal_index++) {
       if (causalbetavec[causal_index] == 0.0f) continue;
-      ld_matrix_csr_.extract_row(causal_index, &ld_matrix_row);
+      ld_matrix_csr_->extract_row(causal_index, &ld_matrix_row);
       auto iter_end = ld_matrix_row.end();
       for (auto iter = ld_matrix_row.begin(); iter < iter_end; iter++) {
         const int tag_index = iter.tag_index();
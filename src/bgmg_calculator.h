@@ -194,6 +194,92 @@ class DenseMatrix {
   T* data_;
 };
 
+// Matrix stored in tiles of tile_rows x tile_cols elements, where one row of a tile is one 64-byte aligned cache line.
+// Tiles are ordered by rows, then by columns; within a tile elements are stored by rows. Element (i, j) is at
+//   ((i / tile_rows * no_col_tiles + j / tile_cols) * tile_rows + i % tile_rows) * tile_cols + j % tile_cols.
+// This is the layout of tag_r2sum_ (#rows = num_tag, #cols = k_max), which serves two access patterns:
+// - find_tag_r2sum scatters LD of a causal variant into a range of tags for a fixed k; with tiles these are consecutive cache lines,
+//   and threads that own whole column tiles never write to the same cache line;
+// - cost functions iterate over all k for a given tag, i.e. over no_col_tiles() aligned segments of tile_cols elements (see row_segment).
+// Rows and columns are padded up to the tile size; the padding is never written by operator().
+template<typename T>
+class TiledMatrix {
+ public:
+  static const size_t tile_rows = 16;
+  static const size_t tile_cols = AlignedBuffer<T>::alignment / sizeof(T);
+
+  explicit TiledMatrix(size_t no_rows = 0, size_t no_columns = 0)
+    : no_rows_(no_rows),
+    no_columns_(no_columns),
+    no_col_tiles_((no_columns + tile_cols - 1) / tile_cols) {
+    const size_t no_row_tiles = (no_rows + tile_rows - 1) / tile_rows;
+    data_.resize(no_row_tiles * no_col_tiles_ * tile_rows * tile_cols);
+  }
+
+  void InitializeZeros() {
+    memset(data_.data(), 0, sizeof(T) * data_.size());
+  }
+
+  T& operator() (size_t index_row, size_t index_col) {
+    return data_[offset(index_row, index_col)];
+  }
+
+  const T& operator() (size_t index_row, size_t index_col) const {
+    assert(index_row < no_rows_);
+    assert(index_col < no_columns_);
+    return data_[offset(index_row, index_col)];
+  }
+
+  // Elements [col_tile * tile_cols, (col_tile + 1) * tile_cols) of the row, aligned to 64 bytes.
+  // The last segment of a row is partially filled if no_columns is not a multiple of tile_cols.
+  T* row_segment(size_t index_row, size_t col_tile) {
+    return &data_[offset(index_row, col_tile * tile_cols)];
+  }
+
+  const T* row_segment(size_t index_row, size_t col_tile) const {
+    return &data_[offset(index_row, col_tile * tile_cols)];
+  }
+
+  size_t no_rows() const { return no_rows_; }
+  size_t no_columns() const { return no_columns_; }
+  size_t no_col_tiles() const { return no_col_tiles_; }
+  size_t size() const { return no_rows_ * no_columns_; }
+  size_t mem_bytes() const { return data_.size() * sizeof(T); }  // including padding
+
+  std::string to_str() const {
+    int rows_to_str = std::min<int>(5, no_rows_ - 1);
+    int cols_to_str = std::min<int>(5, no_columns_ - 1);
+    std::stringstream ss;
+    ss << "[";
+    for (int i = 0; i < rows_to_str; i++) {
+      for (int j = 0; j < cols_to_str; j++) {
+        ss << (*this)(i, j);
+        ss << ((j == (cols_to_str - 1)) ? ", ..." : ", ");
+      }
+      ss << ((i == (rows_to_str - 1)) ? "; ..." : "; ");
+    }
+    ss << "]";
+
+    size_t nnz = 0;
+    for (int i = 0; i < no_rows_; i++)
+      for (int j = 0; j < no_columns_; j++)
+        if ((*this)(i, j) != 0) nnz++;
+    ss << ", nnz=" << nnz;
+
+    return ss.str();
+  }
+
+ private:
+  size_t offset(size_t index_row, size_t index_col) const {
+    return ((index_row / tile_rows * no_col_tiles_ + index_col / tile_cols) * tile_rows + index_row % tile_rows) * tile_cols + index_col % tile_cols;
+  }
+
+  size_t no_rows_;
+  size_t no_columns_;
+  size_t no_col_tiles_;
+  AlignedBuffer<T> data_;
+};
+
 struct LoglikeCacheElem {
  public:
   LoglikeCacheElem() {}
@@ -234,6 +320,12 @@ class BgmgCalculator : public TagToSnpMapping {
 
   int64_t init(std::string bim_file, std::string frq_file, std::string chr_labels, std::string trait1_file, std::string trait2_file, std::string exclude, std::string extract);
   int64_t convert_plink_ld(std::string plink_ld_gz, std::string plink_ld_bin);  // require init() to be called first, e.i. doesn't work after set_tag_indices.
+  int64_t convert_plink_ld_csr(std::string plink_ld_gz, std::string out_file);  // same, but writes current LD matrix format (see convert_plink_ld_to_ld_matrix)
+
+  // binary snapshot of the state produced by init(): reference (.bim columns), tag indices, chrnumvec, mafvec, zvec and nvec.
+  // load_init_snapshot replaces init() on a fresh context; vector data is read from a memory mapping of the file.
+  int64_t save_init_snapshot(std::string filename);
+  int64_t load_init_snapshot(std::string filename);
 
   // num_snp = total size of the reference (e.i. the total number of genotyped variants)
   // num_tag = number of tag variants to include in the inference (must be a subset of the reference)
@@ -257,6 +349,15 @@ class BgmgCalculator : public TagToSnpMapping {
   int64_t set_ld_r2_coo(int chr_label, int64_t length, int* snp_index, int* tag_index, float* r);
   int64_t set_ld_r2_coo(int chr_label, const std::string& filename);
   int64_t set_ld_r2_csr(int chr_label = -1);  // finalize
+  int64_t save_ld_r2_csr(int chr_label, const std::string& filename);  // save finalized LD structure in memory-mapped format (loaded via set_ld_r2_coo)
+
+  // attach to a finalized LD structure of another context, instead of loading it again.
+  // Both contexts must have the same tag indices, chrnumvec, mafvec and r2min.
+  // The LD structure is reference-counted, and remains valid after the source context is disposed.
+  // It can't be modified any longer (set_ld_r2_coo will fail); options that reset LD structure detach the context from it.
+  int64_t share_ld(BgmgCalculator& src);
+
+  int64_t num_ld_on_demand_loads() { return ld_matrix_csr_->on_demand_loads(); }  // see set_option("ld_memory_budget_mb", ...)
 
   int64_t num_ld_r2_snp(int snp_index);
   int64_t retrieve_ld_r2_snp(int snp_index, int length, int* tag_index, float* r2);
@@ -355,7 +456,9 @@ class BgmgCalculator : public TagToSnpMapping {
   std::vector<char> is_tag_;    // true or false, size=num_snp_, is_tag_[i] == (snp_to_tag_[i] != -1)
   std::vector<int> chrnumvec_;  // vector of chromosome labels, one per snp
 
-  LdMatrixCsr ld_matrix_csr_;
+  std::shared_ptr<LdMatrixCsr> ld_matrix_csr_;  // immutable once finalized, and potentially shared with other contexts
+  bool ld_matrix_csr_borrowed_;  // true if ld_matrix_csr_ was created by another context (its TagToSnpMapping may no longer exist)
+  void check_ld_not_shared();
 
   // all stored for for tag variants (only)
   std::vector<float> zvec1_;
@@ -378,7 +481,7 @@ class BgmgCalculator : public TagToSnpMapping {
   // snp_order_ gives the order of how SNPs are considered to be causal 
   // tag_r2_sum_ gives cumulated r2 across causal SNPs, according to snp_order, where last_num_causals_ define the actual number of causal variants.
   std::vector<std::shared_ptr<DenseMatrix<int>>> snp_order_;  // permutation matrix; #rows = pimax*num_snp; #cols=k_max_
-  std::vector<std::shared_ptr<DenseMatrix<float>>> tag_r2sum_;
+  std::vector<std::shared_ptr<TiledMatrix<float>>> tag_r2sum_;
   std::vector<float>                               last_num_causals_;
 
   // options, and what do they affect
@@ -396,6 +499,10 @@ class BgmgCalculator : public TagToSnpMapping {
   double cubature_abs_error_;
   double cubature_rel_error_;
   int cubature_max_evals_;
+  LdRCodec ld_r_codec_;        // encoding of LD r values after set_ld_r2_csr (LdRCodec_Uint16_R by default)
+  double ld_memory_budget_mb_; // memory budget for on-demand loading of memory-mapped LD files (0 means all LD stays in memory)
+  bool ld_symmetric_;          // store only the upper triangle of the LD matrix (requires use_complete_tag_indices)
+  bool ld_tag_major_;          // build the tag-major LD index, so that convolve calculator does not require use_complete_tag_indices
   int ld_format_version_;      // overwrite format version for LD matrix files. Default -1. Set this to 0 to read from MiXeR v1.0 LD files.
   std::vector<double> k_pdf_;  // the log-likelihood cost calculated independently for each of 0...k_max-1 selections of causal variants.            
   bool calc_k_pdf_;            // a calc_fixed_effect_delta_from_causalbetavecflag indicating whether we should calculate k_pdf_
@@ -405,6 +512,8 @@ class BgmgCalculator : public TagToSnpMapping {
   double calc_bivariate_cost_fast(int pi_vec_len, float* pi_vec, int sig2_beta_len, float* sig2_beta, float rho_beta, int sig2_zero_len, float* sig2_zero, float rho_zero);
   double calc_univariate_cost_convolve(int trait_index, float pi_vec, float sig2_zero, float sig2_beta);
   double calc_bivariate_cost_convolve(int pi_vec_len, float* pi_vec, int sig2_beta_len, float* sig2_beta, float rho_beta, int sig2_zero_len, float* sig2_zero, float rho_zero);
+  void check_convolve_ld();
+  void extract_convolve_row(int tag_index, LdMatrixRow* ld_matrix_row);
   void calc_fixed_effect_delta_from_causalbetavec(int trait_index, std::valarray<float>* delta);
 
   BimFile bim_file_;
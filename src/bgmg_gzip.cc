@@ -0,0 +1,247 @@
+#include "bgmg_gzip.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+
+#include "zlib.h"
+
+#include "bgmg_log.h"
+
+#define GZIP_CHUNK_SIZE (4 * 1024 * 1024)  // plain gzip is inflated by a background thread in chunks of this size
+#define GZIP_INPUT_BUFFER_SIZE (1024 * 1024)
+#define BGZF_BLOCKS_PER_BATCH 256  // BGZF blocks inflated in parallel at once (each block inflates to at most 64 KB)
+#define BGZF_FIXED_HEADER_SIZE 12  // gzip header up to and including XLEN
+#define BGZF_FOOTER_SIZE 8  // CRC32 and ISIZE
+#define BGZF_MAX_BLOCK_SIZE 65536  // upper bound on the inflated size of a BGZF block
+
+namespace {
+
+uint32_t read_uint16_le(const unsigned char* p) { return p[0] | (p[1] << 8); }
+uint32_t read_uint32_le(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+
+bool is_gzip_header_with_extra_field(const unsigned char* header) {
+  const int FEXTRA = 4;
+  return (header[0] == 31) && (header[1] == 139) && (header[2] == 8) && (header[3] & FEXTRA);
+}
+
+// Total size of a BGZF block, taken from the 'BC' subfield of the gzip extra field; 0 if there is no such subfield.
+size_t bgzf_block_size(const unsigned char* extra, size_t xlen) {
+  size_t pos = 0;
+  while (pos + 4 <= xlen) {
+    const uint32_t slen = read_uint16_le(&extra[pos + 2]);
+    if ((extra[pos] == 'B') && (extra[pos + 1] == 'C') && (slen == 2) && (pos + 6 <= xlen)) return read_uint16_le(&extra[pos + 4]) + 1;
+    pos += 4 + slen;
+  }
+  return 0;
+}
+
+// Inflates one raw deflate stream of a known decompressed size.
+bool inflate_block(const char* in, size_t in_size, char* out, size_t out_size) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) return false;
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+  strm.avail_in = in_size;
+  strm.next_out = reinterpret_cast<Bytef*>(out);
+  strm.avail_out = out_size;
+  const int ret = inflate(&strm, Z_FINISH);
+  const bool ok = (ret == Z_STREAM_END) && (strm.avail_out == 0);
+  inflateEnd(&strm);
+  return ok;
+}
+
+// Produces decompressed content of a file chunk by chunk; an empty chunk marks the end of the file.
+// next_chunk() is called from one thread at a time.
+class GzipChunkSource {
+public:
+  virtual ~GzipChunkSource() {}
+  virtual std::string next_chunk() = 0;
+};
+
+class BgzfChunkSource : public GzipChunkSource {
+public:
+  explicit BgzfChunkSource(const std::string& filename) : filename_(filename), in_(filename, std::ios::in | std::ios::binary), eof_(false) {
+    if (!in_) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open " + filename));
+  }
+
+  std::string next_chunk() override {
+    std::string chunk;
+    while (chunk.empty() && !eof_) {  // skip batches of empty blocks, e.g. the BGZF end-of-file marker
+      compressed_.clear();
+      blocks_.clear();
+      size_t chunk_size = 0;
+      while ((blocks_.size() < BGZF_BLOCKS_PER_BATCH) && read_block(&chunk_size)) {}
+      chunk.resize(chunk_size);
+
+      int num_errors = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+: num_errors)
+      for (int i = 0; i < blocks_.size(); i++) {
+        const Block& block = blocks_[i];
+        char* out = &chunk[0] + block.out_offset;
+        if (!inflate_block(&compressed_[block.in_offset], block.in_size, out, block.out_size) ||
+            (crc32(0L, reinterpret_cast<const Bytef*>(out), block.out_size) != block.crc)) num_errors++;
+      }
+      if (num_errors > 0) BGMG_THROW_EXCEPTION(::std::runtime_error("corrupted BGZF block in " + filename_));
+    }
+    return chunk;
+  }
+
+private:
+  struct Block {
+    size_t in_offset;  // deflate data, within compressed_
+    size_t in_size;
+    size_t out_offset;  // within the chunk
+    size_t out_size;
+    uint32_t crc;
+  };
+
+  // appends the next block of the file to compressed_ and blocks_; returns false at the end of the file
+  bool read_block(size_t* chunk_size) {
+    unsigned char header[BGZF_FIXED_HEADER_SIZE];
+    in_.read(reinterpret_cast<char*>(header), BGZF_FIXED_HEADER_SIZE);
+    if (in_.gcount() == 0) { eof_ = true; return false; }
+    if ((in_.gcount() != BGZF_FIXED_HEADER_SIZE) || !is_gzip_header_with_extra_field(header)) throw_invalid_block();
+
+    const size_t xlen = read_uint16_le(&header[10]);
+    std::vector<unsigned char> extra(xlen);
+    in_.read(reinterpret_cast<char*>(extra.data()), xlen);
+    if (in_.gcount() != xlen) throw_invalid_block();
+    const size_t block_size = bgzf_block_size(extra.data(), xlen);
+    if (block_size < BGZF_FIXED_HEADER_SIZE + xlen + BGZF_FOOTER_SIZE) throw_invalid_block();
+
+    const size_t remaining_size = block_size - BGZF_FIXED_HEADER_SIZE - xlen;
+    const size_t in_offset = compressed_.size();
+    compressed_.resize(in_offset + remaining_size);
+    in_.read(&compressed_[in_offset], remaining_size);
+    if (in_.gcount() != remaining_size) throw_invalid_block();
+
+    const unsigned char* footer = reinterpret_cast<const unsigned char*>(&compressed_[in_offset + remaining_size - BGZF_FOOTER_SIZE]);
+    Block block;
+    block.in_offset = in_offset;
+    block.in_size = remaining_size - BGZF_FOOTER_SIZE;
+    block.out_offset = *chunk_size;
+    block.out_size = read_uint32_le(&footer[4]);
+    if (block.out_size > BGZF_MAX_BLOCK_SIZE) throw_invalid_block();  // don't trust ISIZE to size the output buffer
+    block.crc = read_uint32_le(&footer[0]);
+    blocks_.push_back(block);
+    *chunk_size += block.out_size;
+    return true;
+  }
+
+  void throw_invalid_block() {
+    BGMG_THROW_EXCEPTION(::std::runtime_error("invalid or truncated BGZF block in " + filename_));
+  }
+
+  const std::string filename_;
+  std::ifstream in_;
+  bool eof_;
+  std::vector<char> compressed_;
+  std::vector<Block> blocks_;
+};
+
+class PlainGzipChunkSource : public GzipChunkSource {
+public:
+  explicit PlainGzipChunkSource(const std::string& filename) : filename_(filename), in_(filename, std::ios::in | std::ios::binary), in_buffer_(GZIP_INPUT_BUFFER_SIZE), stream_end_(false) {
+    if (!in_) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open " + filename));
+    memset(&strm_, 0, sizeof(strm_));
+    if (inflateInit2(&strm_, MAX_WBITS + 16) != Z_OK) BGMG_THROW_EXCEPTION(::std::runtime_error("inflateInit2 failed"));  // +16: gzip format
+  }
+  ~PlainGzipChunkSource() { inflateEnd(&strm_); }
+
+  std::string next_chunk() override {
+    std::string chunk(GZIP_CHUNK_SIZE, '\0');
+    strm_.next_out = reinterpret_cast<Bytef*>(&chunk[0]);
+    strm_.avail_out = chunk.size();
+    while (strm_.avail_out > 0) {
+      if ((strm_.avail_in == 0) && !refill()) {
+        if (!stream_end_) BGMG_THROW_EXCEPTION(::std::runtime_error("unexpected end of file " + filename_));
+        break;
+      }
+      if (stream_end_) {  // another gzip member follows the one that ended
+        inflateReset(&strm_);
+        stream_end_ = false;
+      }
+      const int ret = inflate(&strm_, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) stream_end_ = true;
+      else if (ret != Z_OK) BGMG_THROW_EXCEPTION(::std::runtime_error("corrupted gzip data in " + filename_));
+    }
+    chunk.resize(chunk.size() - strm_.avail_out);
+    return chunk;
+  }
+
+private:
+  bool refill() {
+    in_.read(&in_buffer_[0], in_buffer_.size());
+    strm_.next_in = reinterpret_cast<Bytef*>(&in_buffer_[0]);
+    strm_.avail_in = in_.gcount();
+    return strm_.avail_in > 0;
+  }
+
+  const std::string filename_;
+  std::ifstream in_;
+  std::vector<char> in_buffer_;
+  z_stream strm_;
+  bool stream_end_;  // inflate reached the end of a gzip member
+};
+
+// Serves chunks of a GzipChunkSource, inflating the next chunk in a background thread.
+class GzipStreambuf : public std::streambuf {
+public:
+  explicit GzipStreambuf(std::unique_ptr<GzipChunkSource> source) : source_(std::move(source)) { prefetch(); }
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (!next_chunk_.valid()) return traits_type::eof();
+    chunk_ = next_chunk_.get();  // re-throws errors from the background thread
+    if (chunk_.empty()) return traits_type::eof();
+    prefetch();
+    setg(&chunk_[0], &chunk_[0], &chunk_[0] + chunk_.size());
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  void prefetch() {
+    GzipChunkSource* source = source_.get();
+    next_chunk_ = std::async(std::launch::async, [source]() { return source->next_chunk(); });
+  }
+
+  std::unique_ptr<GzipChunkSource> source_;
+  std::string chunk_;
+  std::future<std::string> next_chunk_;  // declared last, so destructor waits for pending chunk before closing the source
+};
+
+class GzipIstream : public std::istream {
+public:
+  explicit GzipIstream(std::unique_ptr<GzipChunkSource> source) : std::istream(nullptr), buf_(std::move(source)) {
+    rdbuf(&buf_);
+    exceptions(std::ios::badbit);  // propagate decompression errors instead of silently ending the stream
+  }
+
+private:
+  GzipStreambuf buf_;
+};
+
+}  // namespace
+
+bool is_bgzf_file(const std::string& filename) {
+  std::ifstream in(filename, std::ios::in | std::ios::binary);
+  unsigned char header[BGZF_FIXED_HEADER_SIZE];
+  in.read(reinterpret_cast<char*>(header), BGZF_FIXED_HEADER_SIZE);
+  if ((in.gcount() != BGZF_FIXED_HEADER_SIZE) || !is_gzip_header_with_extra_field(header)) return false;
+
+  const size_t xlen = read_uint16_le(&header[10]);
+  std::vector<unsigned char> extra(xlen);
+  in.read(reinterpret_cast<char*>(extra.data()), xlen);
+  return (in.gcount() == xlen) && (bgzf_block_size(extra.data(), xlen) > 0);
+}
+
+std::shared_ptr<std::istream> open_gzip_file(const std::string& filename) {
+  if (is_bgzf_file(filename)) return std::make_shared<GzipIstream>(std::unique_ptr<GzipChunkSource>(new BgzfChunkSource(filename)));
+  return std::make_shared<GzipIstream>(std::unique_ptr<GzipChunkSource>(new PlainGzipChunkSource(filename)));
+}
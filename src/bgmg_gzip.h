@@ -0,0 +1,14 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+
+// Opens a .gz file for reading, with decompression running ahead of the reader in other threads.
+// BGZF files (a series of gzip members of up to 64 KB, as written by bgzip / htslib) are inflated block-parallel;
+// other gzip files (including concatenated gzip members) are inflated by a background thread, one chunk ahead of the reader.
+// Decompression errors are re-thrown from the reading call (the stream has badbit in its exception mask).
+std::shared_ptr<std::istream> open_gzip_file(const std::string& filename);
+
+// Whether the file starts with a BGZF block header.
+bool is_bgzf_file(const std::string& filename);
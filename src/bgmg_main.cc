@@ -51,6 +51,22 @@ public:
     handle_errror(bgmg_convert_plink_ld(context_id_, plink_ld_gz.c_str(), plink_ld_bin.c_str()));
   }
 
+  void convert_plink_ld_csr(std::string plink_ld_gz, std::string out_file) {
+    handle_errror(bgmg_convert_plink_ld_csr(context_id_, plink_ld_gz.c_str(), out_file.c_str()));
+  }
+
+  void set_option(std::string option, double value) {
+    handle_errror(bgmg_set_option(context_id_, &option[0], value));
+  }
+
+  void save_init_snapshot(std::string filename) {
+    handle_errror(bgmg_save_init_snapshot(context_id_, filename.c_str()));
+  }
+
+  void load_init_snapshot(std::string filename) {
+    handle_errror(bgmg_load_init_snapshot(context_id_, filename.c_str()));
+  }
+
 private:
   void handle_errror(int error_code) {
     if (error_code < 0) throw std::runtime_error(bgmg_get_last_error());
@@ -109,10 +125,16 @@ struct BgmgOptions {
   std::string chr_labels;
   std::string out;
   std::string plink_ld;
+  bool plink_ld_version0;
   std::string trait1;
   std::string exclude;
   std::string extract;
+  std::string save_snapshot;
+  std::string load_snapshot;
   float r2min;
+  int ld_window;
+  float ld_window_kb;
+  float ld_window_cm;
 };
 
 void describe_bgmg_options(BgmgOptions& s) {
@@ -121,15 +143,36 @@ void describe_bgmg_options(BgmgOptions& s) {
   if (!s.frq.empty()) LOG << "\t--frq " << s.frq << " \\";
   if (!s.out.empty()) LOG << "\t--out " << s.out << " \\";
   if (!s.plink_ld.empty()) LOG << "\t--plink-ld " << s.plink_ld << " \\";
+  if (s.plink_ld_version0) LOG << "\t--plink-ld-version0 \\";
   if (!s.trait1.empty()) LOG << "\t--trait1 " << s.trait1 << " \\";
   if (!s.exclude.empty()) LOG << "\t--exclude " << s.exclude << " \\";
+  if (s.ld_window > 0) LOG << "\t--ld-window " << s.ld_window << " \\";
+  if (s.ld_window_kb > 0) LOG << "\t--ld-window-kb " << s.ld_window_kb << " \\";
+  if (s.ld_window_cm > 0) LOG << "\t--ld-window-cm " << s.ld_window_cm << " \\";
   if (!s.extract.empty()) LOG << "\t--extract " << s.extract << " \\";
+  if (!s.save_snapshot.empty()) LOG << "\t--save-snapshot " << s.save_snapshot << " \\";
+  if (!s.load_snapshot.empty()) LOG << "\t--load-snapshot " << s.load_snapshot << " \\";
 }
 
 void fix_and_validate(BgmgOptions& bgmg_options, po::variables_map& vm) {
   // Validate --bim / --bim-chr option
-  if (bgmg_options.bim.empty() && bgmg_options.bfile.empty())
-    throw std::invalid_argument(std::string("ERROR: --bim or --bfile must be specified"));
+  if (bgmg_options.bim.empty() && bgmg_options.bfile.empty() && bgmg_options.load_snapshot.empty())
+    throw std::invalid_argument(std::string("ERROR: --bim, --bfile or --load-snapshot must be specified"));
+
+  // Validate --load-snapshot option: it replaces --bim, --frq, --trait1, --exclude and --extract (and can't be combined with them, or with --bfile)
+  if (!bgmg_options.load_snapshot.empty()) {
+    if (!bgmg_options.bfile.empty())
+      throw std::invalid_argument(std::string("ERROR: --load-snapshot can not be combined with --bfile"));
+    const std::vector<std::pair<std::string, std::string>> replaced_options = {
+      { "--bim", bgmg_options.bim }, { "--frq", bgmg_options.frq }, { "--trait1", bgmg_options.trait1 },
+      { "--exclude", bgmg_options.exclude }, { "--extract", bgmg_options.extract } };
+    for (const auto& option : replaced_options) {
+      if (!option.second.empty())
+        throw std::invalid_argument(std::string("ERROR: --load-snapshot can not be combined with " + option.first));
+    }
+    if (!boost::filesystem::exists(bgmg_options.load_snapshot))
+      throw std::invalid_argument(std::string("ERROR: input file " + bgmg_options.load_snapshot + " does not exist"));
+  }
 
   // Validate --out option
   if (bgmg_options.out.empty())
@@ -145,6 +188,17 @@ void fix_and_validate(BgmgOptions& bgmg_options, po::variables_map& vm) {
     return;
   }
 
+  if (!bgmg_options.load_snapshot.empty())  // all other inputs come from the snapshot
+    return;
+
+  // Validate --ld-window, --ld-window-kb, --ld-window-cm options
+  if ((bgmg_options.ld_window < 0) || (bgmg_options.ld_window_kb < 0) || (bgmg_options.ld_window_cm < 0))
+    throw std::invalid_argument(std::string("ERROR: --ld-window, --ld-window-kb and --ld-window-cm must be non-negative"));
+
+  // Validate --bfile option: per-chromosome input requires per-chromosome output
+  if ((bgmg_options.bfile.find("@") != std::string::npos) && (bgmg_options.out.find("@") == std::string::npos))
+    throw std::invalid_argument(std::string("ERROR: --out must contain @ when --bfile contains @"));
+
   // Validate --frq / --frq-chr option
   if (bgmg_options.frq.empty())
     throw std::invalid_argument(std::string("ERROR: --frq must be specified"));
@@ -163,10 +217,14 @@ int main(int argc, char *argv[]) {
     po::options_description po_options("BGMG " VERSION " - Univariate and Bivariate causal mixture models for GWAS");
     po_options.add_options()
       ("help,h", "produce this help message")
-      ("bfile", po::value(&bgmg_options.bfile), "Path to .fam/.bim/.bed file that defines the reference genotypes for LD structure estimatiion.")
+      ("bfile", po::value(&bgmg_options.bfile), "Path to .fam/.bim/.bed file that defines the reference genotypes for LD structure estimatiion. "
+        "If --out contains @, LD structure is saved in one file per chromosome, and chromosomes are processed in parallel; "
+        "in this case --bfile and --frq may also use @ to specify location of chromosome label.")
       ("bim", po::value(&bgmg_options.bim), "Path to .bim file that defines the reference set of SNPs. Optionally, if input files are split per chromosome, use @ to specify location of chromosome label.")
       ("frq", po::value(&bgmg_options.frq), "Path to .frq file that defines the minor allele frequency for the reference set of SNPs. Optionally, if input files are split per chromosome, use @ to specify location of chromosome label.")
-      ("plink-ld", po::value(&bgmg_options.plink_ld), "Path to plink .ld.gz file to convert into BGMG binary format.")
+      ("plink-ld", po::value(&bgmg_options.plink_ld), "Path to plink .ld.gz file to convert into BGMG binary format. "
+        "LD r2 values below --r2min only contribute to LD scores. If --out contains @, one file per chromosome is saved.")
+      ("plink-ld-version0", po::bool_switch(&bgmg_options.plink_ld_version0)->default_value(false), "Convert --plink-ld into the legacy format (to be loaded with ld_format_version=0 option).")
       ("chr-labels", po::value(&bgmg_options.chr_labels), "Set of chromosome labels. Defaults to '1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22'")
       ("out", po::value(&bgmg_options.out)->default_value("bgmg"),
         "prefix of the output files; "
@@ -174,7 +232,12 @@ int main(int argc, char *argv[]) {
         ("trait1", po::value(&bgmg_options.trait1), "Path to .sumstats.gz file for the trait to analyze")
       ("exclude", po::value(&bgmg_options.exclude)->default_value(""), "File with a set of SNP rs# to exclude from the analysis")
       ("extract", po::value(&bgmg_options.extract)->default_value(""), "File with a set of SNP rs# to use in the analysis; this is optional, by default use all available markers")
+      ("save-snapshot", po::value(&bgmg_options.save_snapshot)->default_value(""), "Save the parsed reference, frequencies and summary statistics into a binary snapshot file, to be used with --load-snapshot")
+      ("load-snapshot", po::value(&bgmg_options.load_snapshot)->default_value(""), "Load a binary snapshot produced by --save-snapshot, instead of reading --bim, --frq, --trait1, --exclude and --extract")
       ("r2min", po::value(&bgmg_options.r2min)->default_value(0.05), "Threshold for LD r2 estimation.")
+      ("ld-window", po::value(&bgmg_options.ld_window)->default_value(0), "Maximum distance between SNPs, in number of SNPs, for LD r2 estimation; 0 means no limit.")
+      ("ld-window-kb", po::value(&bgmg_options.ld_window_kb)->default_value(0), "Maximum distance between SNPs, in kb, for LD r2 estimation; 0 means no limit.")
+      ("ld-window-cm", po::value(&bgmg_options.ld_window_cm)->default_value(0), "Maximum distance between SNPs, in cM, for LD r2 estimation; 0 means no limit.")
     ;
 
     po::variables_map vm;
@@ -199,15 +262,35 @@ int main(int argc, char *argv[]) {
       describe_bgmg_options(bgmg_options);
 
       if (!bgmg_options.bfile.empty()) {
-        bgmg_calc_ld_matrix(bgmg_options.bfile.c_str(), bgmg_options.frq.c_str(),
-                            bgmg_options.out.c_str(), bgmg_options.r2min);
+        if (bgmg_options.out.find("@") != std::string::npos) {
+          bgmg_calc_ld_matrix_per_chr(bgmg_options.bfile.c_str(), bgmg_options.frq.c_str(), bgmg_options.chr_labels.c_str(),
+                                      bgmg_options.out.c_str(), bgmg_options.r2min,
+                                      bgmg_options.ld_window, bgmg_options.ld_window_kb, bgmg_options.ld_window_cm);
+        } else {
+          bgmg_calc_ld_matrix(bgmg_options.bfile.c_str(), bgmg_options.frq.c_str(),
+                              bgmg_options.out.c_str(), bgmg_options.r2min,
+                              bgmg_options.ld_window, bgmg_options.ld_window_kb, bgmg_options.ld_window_cm);
+        }
       } else {
         const int context_id = 0;
         BgmgCpp bgmg_cpp_interface(context_id);
-        bgmg_cpp_interface.init(bgmg_options.bim, bgmg_options.frq, bgmg_options.chr_labels, bgmg_options.trait1, std::string(), bgmg_options.exclude, bgmg_options.extract);
+        if (!bgmg_options.load_snapshot.empty()) {
+          bgmg_cpp_interface.load_init_snapshot(bgmg_options.load_snapshot);
+        } else {
+          bgmg_cpp_interface.init(bgmg_options.bim, bgmg_options.frq, bgmg_options.chr_labels, bgmg_options.trait1, std::string(), bgmg_options.exclude, bgmg_options.extract);
+        }
+
+        if (!bgmg_options.save_snapshot.empty()) {
+          bgmg_cpp_interface.save_init_snapshot(bgmg_options.save_snapshot);
+        }
 
         if (!bgmg_options.plink_ld.empty()) {
-          bgmg_cpp_interface.convert_plink_ld(bgmg_options.plink_ld, bgmg_options.out);
+          if (bgmg_options.plink_ld_version0) {
+            bgmg_cpp_interface.convert_plink_ld(bgmg_options.plink_ld, bgmg_options.out);
+          } else {
+            bgmg_cpp_interface.set_option("r2min", bgmg_options.r2min);
+            bgmg_cpp_interface.convert_plink_ld_csr(bgmg_options.plink_ld, bgmg_options.out);
+          }
         }
       }
 
@@ -1,80 +1,382 @@
 #include "bgmg_parse.h"
 
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <fstream>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
+#include "bgmg_gzip.h"
 #include "bgmg_log.h"
-#include "zstr.hpp"
+#include "mapped_file.h"
 
 
-void BimFile::find_snp_to_index_map() {
-  snp_to_index_.clear();
-  for (int i = 0; i < size(); i++) {
-    if (snp_to_index_.find(snp_[i]) != snp_to_index_.end()) {
-      std::stringstream error_str;
-      error_str << "Reference contains duplicated variant names (" << snp_[i] << ")";
-      throw std::invalid_argument(error_str.str());
+#define SNP_ID_STRING_KEY (1ull << 63)  // marks keys of SnpIdIndex that refer to the string pool
+
+// rs<digits> without leading zeros, up to 18 digits (so that the number fits below SNP_ID_STRING_KEY)
+static bool parse_rs_id(const char* id, size_t length, uint64_t* number) {
+  if ((length < 3) || (length > 20) || (id[0] != 'r') || (id[1] != 's') || (id[2] == '0')) return false;
+  uint64_t value = 0;
+  for (size_t i = 2; i < length; i++) {
+    if ((id[i] < '0') || (id[i] > '9')) return false;
+    value = value * 10 + (id[i] - '0');
+  }
+  *number = value;
+  return true;
+}
+
+static uint64_t mix64(uint64_t x) {  // finalizer of splitmix64
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static uint64_t snp_id_hash(const char* id, size_t length, bool is_rs, uint64_t rs_number) {
+  if (is_rs) return mix64(rs_number);
+  uint64_t hash = 14695981039346656037ull;  // FNV-1a
+  for (size_t i = 0; i < length; i++) { hash ^= static_cast<unsigned char>(id[i]); hash *= 1099511628211ull; }
+  return mix64(hash);
+}
+
+void SnpIdIndex::clear() {
+  slots_.clear();
+  mask_ = 0;
+  keys_.clear();
+  pool_.clear();
+}
+
+bool SnpIdIndex::same_id(int index1, int index2) const {
+  const uint64_t key1 = keys_[index1], key2 = keys_[index2];
+  if (!(key1 & SNP_ID_STRING_KEY) || !(key2 & SNP_ID_STRING_KEY)) return key1 == key2;
+  return !strcmp(&pool_[key1 & ~SNP_ID_STRING_KEY], &pool_[key2 & ~SNP_ID_STRING_KEY]);
+}
+
+int SnpIdIndex::build(const StringColumn& ids) {
+  clear();
+  const int num_ids = ids.size();
+  if (num_ids == 0) return -1;
+
+  // keys and hashes; ids that are not rs<digits> get a place in the string pool
+  std::vector<uint64_t> hashes(num_ids);
+  std::vector<size_t> pool_offset(num_ids + 1, 0);
+  keys_.resize(num_ids);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < num_ids; i++) {
+    uint64_t rs_number = 0;
+    const bool is_rs = parse_rs_id(ids.c_str(i), ids.length(i), &rs_number);
+    keys_[i] = rs_number;
+    hashes[i] = snp_id_hash(ids.c_str(i), ids.length(i), is_rs, rs_number);
+    pool_offset[i + 1] = is_rs ? 0 : (ids.length(i) + 1);
+  }
+  for (int i = 0; i < num_ids; i++) pool_offset[i + 1] += pool_offset[i];
+  pool_.resize(pool_offset[num_ids]);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < num_ids; i++) {
+    if (pool_offset[i + 1] == pool_offset[i]) continue;
+    memcpy(&pool_[pool_offset[i]], ids.c_str(i), ids.length(i) + 1);
+    keys_[i] = SNP_ID_STRING_KEY | pool_offset[i];
+  }
+
+  size_t capacity = 1;
+  while (capacity * 7 < static_cast<size_t>(num_ids) * 10) capacity *= 2;  // load factor below 0.7
+  mask_ = capacity - 1;
+  std::vector<std::atomic<uint64_t>> table(capacity);  // value-initialized, i.e. all slots empty
+
+  int duplicate = -1;
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < num_ids; i++) {
+    const uint64_t fingerprint = hashes[i] >> 32;
+    const uint64_t slot = (fingerprint << 32) | static_cast<uint64_t>(i + 1);
+    for (uint64_t pos = hashes[i] & mask_; ; pos = (pos + 1) & mask_) {
+      uint64_t current = table[pos].load(std::memory_order_relaxed);
+      if ((current == 0) && table[pos].compare_exchange_strong(current, slot)) break;
+      // here current is the slot inserted by this or another thread
+      const int other = static_cast<int>(current & 0xffffffffu) - 1;
+      if (((current >> 32) == fingerprint) && same_id(i, other)) {
+#pragma omp critical(snp_id_index_duplicate)
+        duplicate = std::max(duplicate, std::max(i, other));
+        break;
+      }
+    }
+  }
+
+  slots_.resize(capacity);
+#pragma omp parallel for schedule(static)
+  for (int64_t pos = 0; pos < static_cast<int64_t>(capacity); pos++) slots_[pos] = table[pos].load(std::memory_order_relaxed);
+  return duplicate;
+}
+
+int SnpIdIndex::find(const char* id, size_t length) const {
+  if (slots_.empty()) return -1;
+  uint64_t rs_number = 0;
+  const bool is_rs = parse_rs_id(id, length, &rs_number);
+  const uint64_t hash = snp_id_hash(id, length, is_rs, rs_number);
+  for (uint64_t pos = hash & mask_; ; pos = (pos + 1) & mask_) {
+    const uint64_t slot = slots_[pos];
+    if (slot == 0) return -1;
+    if ((slot >> 32) != (hash >> 32)) continue;
+    const int index = static_cast<int>(slot & 0xffffffffu) - 1;
+    const uint64_t key = keys_[index];
+    if (is_rs) {
+      if (key == rs_number) return index;
+    } else if (key & SNP_ID_STRING_KEY) {
+      const char* pooled = &pool_[key & ~SNP_ID_STRING_KEY];
+      if (!strncmp(pooled, id, length) && (pooled[length] == '\0')) return index;
     }
+  }
+}
 
-    snp_to_index_.insert(std::pair<std::string, int>(snp_[i], i));
+void BimFile::find_snp_to_index_map() {
+  const int duplicate = snp_to_index_.build(snp_);
+  if (duplicate >= 0) {
+    snp_to_index_.clear();
+    std::stringstream error_str;
+    error_str << "Reference contains duplicated variant names (" << snp_[duplicate] << ")";
+    throw std::invalid_argument(error_str.str());
   }
 }
 
 int BimFile::snp_index(const std::string& snp) const {
-  auto iter = snp_to_index_.find(snp);
-  if (iter == snp_to_index_.end()) return -1;
-  return iter->second;
+  return snp_to_index_.find(snp);
+}
+
+int BimFile::snp_index(const char* snp) const {
+  return snp_to_index_.find(snp, strlen(snp));
 }
 
 std::shared_ptr<std::istream> open_file(std::string filename) {
   if (boost::algorithm::ends_with(filename, ".gz")) {
-    return std::make_shared<zstr::ifstream>(filename, std::ios_base::in | std::ios_base::binary);
+    return open_gzip_file(filename);
   }
   else {
     return std::make_shared<std::ifstream>(filename, std::ios_base::in | std::ios_base::binary);
   }
 }
 
+LineTokenizer::LineTokenizer(std::istream& in, size_t block_size) :
+    in_(in), buffer_(block_size + 1), begin_(0), end_(0), eof_(false), line_no_(0) {
+}
+
+// moves the incomplete line to the front of the buffer, and appends the next block of the stream
+void LineTokenizer::read_block() {
+  if (begin_ > 0) {
+    memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  if (end_ + 1 >= buffer_.size()) buffer_.resize(2 * buffer_.size());  // the line is longer than the buffer
+  in_.read(&buffer_[end_], buffer_.size() - 1 - end_);  // one spare byte is kept for the terminator of the last line
+  end_ += in_.gcount();
+  if (!in_) eof_ = true;
+}
+
+bool LineTokenizer::next_line() {
+  fields_.clear();
+
+  size_t line_end;
+  for (;;) {
+    const char* newline = static_cast<const char*>(memchr(&buffer_[begin_], '\n', end_ - begin_));
+    if (newline != nullptr) { line_end = newline - &buffer_[0]; break; }
+    if (eof_) {
+      if (begin_ == end_) return false;
+      line_end = end_;
+      break;
+    }
+    read_block();
+  }
+
+  buffer_[line_end] = '\0';
+  char* pos = &buffer_[begin_];
+  char* const end = &buffer_[line_end];
+  while (pos < end) {
+    while ((pos < end) && (*pos == ' ' || *pos == '\t' || *pos == '\r')) pos++;
+    if (pos == end) break;
+    fields_.push_back(pos);
+    while ((pos < end) && !(*pos == ' ' || *pos == '\t' || *pos == '\r')) pos++;
+    if (pos < end) *(pos++) = '\0';  // at the end of line the terminator is already in place
+  }
+
+  begin_ = std::min(line_end + 1, end_);
+  line_no_++;
+  return true;
+}
+
+void LineTokenizer::to_lower(int index) {
+  for (char* pos = fields_[index]; *pos; pos++) *pos = std::tolower(static_cast<unsigned char>(*pos));
+}
+
+std::string LineTokenizer::line() const {
+  std::string str;
+  for (int i = 0; i < fields_.size(); i++) {
+    if (i > 0) str += ' ';
+    str += fields_[i];
+  }
+  return str;
+}
+
+// must not use stream or boost::lexical_cast (result in some lock contention)
+bool parse_int(const char* str, int* value) {
+  char* end;
+  errno = 0;
+  const long result = strtol(str, &end, 10);
+  if ((end == str) || (errno == ERANGE) || (result < INT_MIN) || (result > INT_MAX)) return false;
+  *value = static_cast<int>(result);
+  return true;
+}
+
+bool parse_float(const char* str, float* value) {
+  char* end;
+  errno = 0;
+  const float result = strtof(str, &end);
+  if ((end == str) || (errno == ERANGE)) return false;
+  *value = result;
+  return true;
+}
+
+bool parse_double(const char* str, double* value) {
+  char* end;
+  errno = 0;
+  const double result = strtod(str, &end);
+  if ((end == str) || (errno == ERANGE)) return false;
+  *value = result;
+  return true;
+}
+
+StringColumn::StringColumn(const std::vector<std::string>& values) : offsets_(1, 0) {
+  size_t num_chars = 0;
+  for (const auto& value : values) num_chars += value.size() + 1;
+  reserve(values.size(), num_chars);
+  for (const auto& value : values) push_back(value.c_str());
+}
+
+void StringColumn::push_back(const char* value) {
+  chars_.insert(chars_.end(), value, value + strlen(value) + 1);
+  offsets_.push_back(chars_.size());
+}
+
+void StringColumn::append(const StringColumn& other) {
+  const uint64_t shift = chars_.size();
+  chars_.insert(chars_.end(), other.chars_.begin(), other.chars_.end());
+  offsets_.reserve(offsets_.size() + other.size());
+  for (int i = 1; i <= other.size(); i++) offsets_.push_back(shift + other.offsets_[i]);
+}
+
+void StringColumn::reserve(size_t num_values, size_t num_chars) {
+  offsets_.reserve(num_values + 1);
+  chars_.reserve(num_chars);
+}
+
+void StringColumn::clear() {
+  offsets_.assign(1, 0);
+  chars_.clear();
+}
+
+void StringColumn::save(std::ofstream& os) const {
+  save_aligned_vector(os, offsets_.data(), offsets_.size());
+  save_aligned_vector(os, chars_.data(), chars_.size());
+}
+
+void StringColumn::load(MappedReader& reader) {
+  reader.vector(&offsets_);
+  reader.vector(&chars_);
+  if (offsets_.empty() || (offsets_.front() != 0) || (offsets_.back() != chars_.size()) || (!chars_.empty() && (chars_.back() != '\0')))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent string column in " + reader.filename()));
+}
+
+AlleleColumn::ALLELE_CODE AlleleColumn::encode(const char* allele) {
+  if ((allele[0] == '\0') || (allele[1] != '\0')) return ALLELE_OTHER;
+  switch (allele[0]) {
+    case 'A': case 'a': return ALLELE_A;
+    case 'C': case 'c': return ALLELE_C;
+    case 'G': case 'g': return ALLELE_G;
+    case 'T': case 't': return ALLELE_T;
+    default: return ALLELE_OTHER;
+  }
+}
+
+std::string AlleleColumn::operator[](int index) const {
+  static const char* const nucleotides[] = { "", "A", "C", "G", "T" };
+  if (codes_[index] != ALLELE_OTHER) return nucleotides[codes_[index]];
+  const int other = std::lower_bound(other_index_.begin(), other_index_.end(), index) - other_index_.begin();
+  return other_[other];
+}
+
+void AlleleColumn::push_back(const char* allele) {
+  const ALLELE_CODE code = encode(allele);
+  if (code == ALLELE_OTHER) {
+    other_index_.push_back(size());
+    other_.push_back(allele);
+  }
+  codes_.push_back(code);
+}
+
+void AlleleColumn::append(const AlleleColumn& other) {
+  const int shift = size();
+  codes_.insert(codes_.end(), other.codes_.begin(), other.codes_.end());
+  for (int index : other.other_index_) other_index_.push_back(shift + index);
+  other_.append(other.other_);
+}
+
+void AlleleColumn::clear() {
+  codes_.clear();
+  other_index_.clear();
+  other_.clear();
+}
+
+void AlleleColumn::save(std::ofstream& os) const {
+  save_aligned_vector(os, codes_.data(), codes_.size());
+  save_aligned_vector(os, other_index_.data(), other_index_.size());
+  other_.save(os);
+}
+
+void AlleleColumn::load(MappedReader& reader) {
+  reader.vector(&codes_);
+  reader.vector(&other_index_);
+  other_.load(reader);
+  if ((other_index_.size() != other_.size()) || (std::count(codes_.begin(), codes_.end(), ALLELE_OTHER) != static_cast<int64_t>(other_index_.size())))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent allele column in " + reader.filename()));
+}
+
+static void throw_parse_error(const std::string& filename, const LineTokenizer& tokenizer) {
+  std::stringstream error_str;
+  error_str << "Error parsing " << filename << ":" << tokenizer.line_no() << " ('" << tokenizer.line() << "')";
+  throw std::invalid_argument(error_str.str());
+}
+
 void BimFile::read(std::string filename) {
   //LOG << "Reading " << filename << "...";
 
-  const std::string separators = " \t\n\r";
-  std::vector<std::string> tokens;
-
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
+  LineTokenizer tokenizer(*in_ptr);
 
-  int line_no = 0;
-  for (std::string str; std::getline(in, str); )
+  while (tokenizer.next_line())
   {
-    line_no++;
     int chr_label, bp;
     float gp;
-    std::string snp, a1, a2;
-
-    boost::trim_if(str, boost::is_any_of(separators));
-    boost::split(tokens, str, boost::is_any_of(separators), boost::token_compress_on);
-    try {
-      chr_label = stoi(tokens[0]);  // must not use stream or boost::lexical_cast (result in some lock contention)	
-      snp = tokens[1];
-      gp = stof(tokens[2]);
-      bp = stoi(tokens[3]);
-      a1 = tokens[4];
-      a2 = tokens[5];
-    }
-    catch (...) {
-      std::stringstream error_str;
-      error_str << "Error parsing " << filename << ":" << line_no << " ('" << str << "')";
-      throw std::invalid_argument(error_str.str());
+
+    if ((tokenizer.num_fields() < 6) ||
+        !parse_int(tokenizer.field(0), &chr_label) ||
+        !parse_float(tokenizer.field(2), &gp) ||
+        !parse_int(tokenizer.field(3), &bp)) {
+      throw_parse_error(filename, tokenizer);
     }
+
     chr_label_.push_back(chr_label);
-    snp_.push_back(snp);
+    snp_.push_back(tokenizer.field(1));
     gp_.push_back(gp);
     bp_.push_back(bp);
-    a1_.push_back(a1);
-    a2_.push_back(a2);
+    a1_.push_back(tokenizer.field(4));
+    a2_.push_back(tokenizer.field(5));
   }
 
   LOG << " Found " << chr_label_.size() << " variants in " << filename;
@@ -92,7 +394,6 @@ void BimFile::read(std::vector<std::string> filenames) {
   size_t total_size = 0;
   for (int i = 0; i < filenames.size(); i++) total_size += bim_files[i].size();
   chr_label_.reserve(total_size);
-  snp_.reserve(total_size);
   gp_.reserve(total_size);
   bp_.reserve(total_size);
   a1_.reserve(total_size);
@@ -100,54 +401,61 @@ void BimFile::read(std::vector<std::string> filenames) {
 
   for (int i = 0; i < filenames.size(); i++) {
     chr_label_.insert(chr_label_.end(), bim_files[i].chr_label_.begin(), bim_files[i].chr_label_.end());
-    snp_.insert(snp_.end(), bim_files[i].snp_.begin(), bim_files[i].snp_.end());
+    snp_.append(bim_files[i].snp_);
     gp_.insert(gp_.end(), bim_files[i].gp_.begin(), bim_files[i].gp_.end());
     bp_.insert(bp_.end(), bim_files[i].bp_.begin(), bim_files[i].bp_.end());
-    a1_.insert(a1_.end(), bim_files[i].a1_.begin(), bim_files[i].a1_.end());
-    a2_.insert(a2_.end(), bim_files[i].a2_.begin(), bim_files[i].a2_.end());
+    a1_.append(bim_files[i].a1_);
+    a2_.append(bim_files[i].a2_);
+    bim_files[i].clear();  // release memory early
   }
 
   LOG << " Found " << chr_label_.size() << " variants in total.";
 }
 
-PlinkLdFile::PlinkLdFile(const BimFile& bim, std::string filename) {
-  const std::string separators = " \t\n\r";
-  std::vector<std::string> tokens;
+void BimFile::save(std::ofstream& os) const {
+  save_aligned_vector(os, chr_label_.data(), chr_label_.size());
+  save_aligned_vector(os, gp_.data(), gp_.size());
+  save_aligned_vector(os, bp_.data(), bp_.size());
+  snp_.save(os);
+  a1_.save(os);
+  a2_.save(os);
+}
+
+void BimFile::load(MappedReader& reader) {
+  clear();
+  reader.vector(&chr_label_);
+  reader.vector(&gp_);
+  reader.vector(&bp_);
+  snp_.load(reader);
+  a1_.load(reader);
+  a2_.load(reader);
+  if ((gp_.size() != size()) || (bp_.size() != size()) || (snp_.size() != size()) || (a1_.size() != size()) || (a2_.size() != size()))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent reference in " + reader.filename()));
+}
 
+PlinkLdFile::PlinkLdFile(const BimFile& bim, std::string filename) {
   LOG << " Reading " << filename << "...";
 
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
-  int line_no = 0;
+  LineTokenizer tokenizer(*in_ptr);
   int lines_not_match = 0;
-  for (std::string str; std::getline(in, str); )
+  while (tokenizer.next_line())
   {
-    line_no++;
-
+    const int line_no = tokenizer.line_no();
     if (line_no == 1) continue;  // skip header
 
                                   //  CHR_A         BP_A        SNP_A  CHR_B         BP_B        SNP_B           R2
                                   //    22     16051249   rs62224609     22     16052962  rs376238049     0.774859
 
                                   // int chr_a, bp_a, chr_b, bp_b;
-    std::string snp_a, snp_b;
     float r2;
 
-    boost::trim_if(str, boost::is_any_of(separators));
-    boost::split(tokens, str, boost::is_any_of(separators), boost::token_compress_on);
-    try {
-      snp_a = tokens[2];
-      snp_b = tokens[5];
-      r2 = stof(tokens[6]);
-    }
-    catch (...) {
-      std::stringstream error_str;
-      error_str << "Error parsing " << filename << ":" << line_no << " ('" << str << "')";
-      throw std::invalid_argument(error_str.str());
+    if ((tokenizer.num_fields() < 7) || !parse_float(tokenizer.field(6), &r2)) {
+      throw_parse_error(filename, tokenizer);
     }
 
-    int snpA_index = bim.snp_index(snp_a);
-    int snpB_index = bim.snp_index(snp_b);
+    int snpA_index = bim.snp_index(tokenizer.field(2));
+    int snpB_index = bim.snp_index(tokenizer.field(5));
     if (snpA_index < 0 || snpB_index < 0) {
       lines_not_match++;
       continue;
@@ -183,38 +491,23 @@ void PlinkLdFile::save_as_binary(std::string filename) {
 
 
 void FrqFile::read(const BimFile& bim, std::string filename) {
-  const std::string separators = " \t\n\r";
-  std::vector<std::string> tokens;
-
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
-  int line_no = 0;
+  LineTokenizer tokenizer(*in_ptr);
   int lines_not_match = 0;
-  for (std::string str; std::getline(in, str); )
+  while (tokenizer.next_line())
   {
-    line_no++;
-
-    if (line_no == 1) continue;  // skip header
+    if (tokenizer.line_no() == 1) continue;  // skip header
 
                                   //  CHR           SNP   A1   A2          MAF  NCHROBS
                                   // 1   rs376342519 CCGCCGTTGCAAAGGCGCGCCG    C     0.005964     1006
 
-    std::string snp;
     float frq;
 
-    boost::trim_if(str, boost::is_any_of(separators));
-    boost::split(tokens, str, boost::is_any_of(separators), boost::token_compress_on);
-    try {
-      snp = tokens[1];
-      frq = stof(tokens[4]);
-    }
-    catch (...) {
-      std::stringstream error_str;
-      error_str << "Error parsing " << filename << ":" << line_no << " ('" << str << "')";
-      throw std::invalid_argument(error_str.str());
+    if ((tokenizer.num_fields() < 5) || !parse_float(tokenizer.field(4), &frq)) {
+      throw_parse_error(filename, tokenizer);
     }
 
-    int snp_index = bim.snp_index(snp);
+    int snp_index = bim.snp_index(tokenizer.field(1));
     if (snp_index < 0) {
       lines_not_match++;
       continue;
@@ -291,7 +584,7 @@ SumstatFile::FLIP_STATUS SumstatFile::flip_strand(
     std::string retval;
     for (int i = 0; i < val.size(); i++) {
       if (val[i] == 'a') retval += 't';
-      if (val[i] == 't') retval += 't';
+      if (val[i] == 't') retval += 'a';
       if (val[i] == 'c') retval += 'g';
       if (val[i] == 'g') retval += 'c';
     }
@@ -309,17 +602,34 @@ SumstatFile::FLIP_STATUS SumstatFile::flip_strand(
   return FLIP_STATUS_MISMATCH;
 }
 
+SumstatFile::FLIP_STATUS SumstatFile::flip_strand(
+  AlleleColumn::ALLELE_CODE a1sumstat,
+  AlleleColumn::ALLELE_CODE a2sumstat,
+  AlleleColumn::ALLELE_CODE a1reference,
+  AlleleColumn::ALLELE_CODE a2reference) {
+
+  auto complement = [](int code) { return 5 - code; };
+  const int a1 = a1sumstat, a2 = a2sumstat, a1ref = a1reference, a2ref = a2reference;
+
+  if (complement(a1) == a2) return FLIP_STATUS_AMBIGUOUS;
+
+  if (a1 == a1ref && a2 == a2ref) return FLIP_STATUS_ALIGNED;
+  if (a1 == a2ref && a2 == a1ref) return FLIP_STATUS_FLIPPED;
+  if (complement(a1) == a1ref && complement(a2) == a2ref) return FLIP_STATUS_FLIPPED;
+  if (complement(a1) == a2ref && complement(a2) == a1ref) return FLIP_STATUS_ALIGNED;
+
+  return FLIP_STATUS_MISMATCH;
+}
+
 // Read "N, Z, SNP, A1, A2" 
 // Flip Z scores to align them with the reference
 // SNP     A1      A2      Z       N
 // rs1234567       T       C - 0.154  35217.000
 void SumstatFile::read(const BimFile& bim, std::string filename) {
   std::vector<int> snp_index_;
-  const std::string separators = " \t\n\r";
-  std::vector<std::string> tokens;
 
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
+  LineTokenizer tokenizer(*in_ptr);
 
   // gather statistics
   int line_no = 0;
@@ -333,25 +643,24 @@ void SumstatFile::read(const BimFile& bim, std::string filename) {
 
   int snp_col = -1, a1_col = -1, a2_col = -1, z_col = -1, n_col = -1;
   int num_cols_required;
-  for (std::string str; std::getline(in, str); )
+  while (tokenizer.next_line())
   {
-    line_no++;
-    boost::trim_if(str, boost::is_any_of(separators));
-    boost::to_lower(str);
-    boost::split(tokens, str, boost::is_any_of(separators), boost::token_compress_on);
+    line_no = tokenizer.line_no();
 
     if (line_no == 1) { // process header
-      for (int coli = 0; coli < tokens.size(); coli++) {
-        if (tokens[coli] == std::string("snp")) snp_col = coli;
-        if (tokens[coli] == std::string("a1")) a1_col = coli;
-        if (tokens[coli] == std::string("a2")) a2_col = coli;
-        if (tokens[coli] == std::string("n")) n_col = coli;
-        if (tokens[coli] == std::string("z")) z_col = coli;
+      for (int coli = 0; coli < tokenizer.num_fields(); coli++) {
+        tokenizer.to_lower(coli);
+        const char* token = tokenizer.field(coli);
+        if (!strcmp(token, "snp")) snp_col = coli;
+        if (!strcmp(token, "a1")) a1_col = coli;
+        if (!strcmp(token, "a2")) a2_col = coli;
+        if (!strcmp(token, "n")) n_col = coli;
+        if (!strcmp(token, "z")) z_col = coli;
       }
 
       if (snp_col == -1 || a1_col == -1 || a2_col == -1 || z_col == -1 || n_col == -1) {
         std::stringstream error_str;
-        error_str << "Error parsing " << filename << ", unexpected header: " << str;
+        error_str << "Error parsing " << filename << ", unexpected header: " << tokenizer.line();
         throw std::invalid_argument(error_str.str());
       }
 
@@ -360,39 +669,36 @@ void SumstatFile::read(const BimFile& bim, std::string filename) {
       continue;  // finish processing header
     }
 
-    if (tokens.size() < num_cols_required) {
+    if (tokenizer.num_fields() < num_cols_required) {
       lines_incomplete++;
       continue;
     }
 
-    if ((tokens[z_col] == "na") || (tokens[n_col] == "na")) {
+    for (int coli : { snp_col, a1_col, a2_col, z_col, n_col }) tokenizer.to_lower(coli);
+    if (!strcmp(tokenizer.field(z_col), "na") || !strcmp(tokenizer.field(n_col), "na")) {
       undefined_z_or_n++;
       continue;
     }
 
-    std::string snp, a1, a2;
     float sample_size, zscore;
-
-    try {
-      snp = tokens[snp_col];
-      a1 = tokens[a1_col];
-      a2 = tokens[a2_col];
-      zscore = stof(tokens[z_col]);
-      sample_size = stof(tokens[n_col]);
-    }
-    catch (...) {
-      std::stringstream error_str;
-      error_str << "Error parsing " << filename << ":" << line_no << " ('" << str << "')";
-      throw std::invalid_argument(error_str.str());
+    if (!parse_float(tokenizer.field(z_col), &zscore) || !parse_float(tokenizer.field(n_col), &sample_size)) {
+      throw_parse_error(filename, tokenizer);
     }
 
-    int snp_index = bim.snp_index(snp);
+    int snp_index = bim.snp_index(tokenizer.field(snp_col));
     if (snp_index < 0) {
       snps_dont_match_reference++;
       continue;
     }
 
-    FLIP_STATUS flip_status = flip_strand(a1, a2, bim.a1()[snp_index], bim.a2()[snp_index]);
+    // single-nucleotide alleles (the usual case) are compared by their codes; others as strings
+    const AlleleColumn::ALLELE_CODE a1 = AlleleColumn::encode(tokenizer.field(a1_col));
+    const AlleleColumn::ALLELE_CODE a2 = AlleleColumn::encode(tokenizer.field(a2_col));
+    const AlleleColumn::ALLELE_CODE a1ref = bim.a1().code(snp_index);
+    const AlleleColumn::ALLELE_CODE a2ref = bim.a2().code(snp_index);
+    FLIP_STATUS flip_status;
+    if (a1 && a2 && a1ref && a2ref) flip_status = flip_strand(a1, a2, a1ref, a2ref);
+    else flip_status = flip_strand(tokenizer.field(a1_col), tokenizer.field(a2_col), bim.a1()[snp_index], bim.a2()[snp_index]);
     if (flip_status == FLIP_STATUS_AMBIGUOUS) {
       snp_ambiguous++;
       continue;
@@ -456,25 +762,23 @@ void BimFile::clear() {
 }
 
 void SnpList::read(std::string filename) {
-  const std::string separators = " \t\n\r";
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
-  std::stringstream buffer;
-  buffer << in.rdbuf();
-  std::string str = buffer.str();
-  boost::trim_if(str, boost::is_any_of(separators));
-  boost::split(snp_, str, boost::is_any_of(separators), boost::token_compress_on);
-
-  snp_set_.clear();
-  for (int i = 0; i < snp_.size(); i++) {
-    if (!snp_[i].empty()) {
-      snp_set_.insert(std::pair<std::string, char>(boost::to_lower_copy(snp_[i]), 1));
+  LineTokenizer tokenizer(*in_ptr);
+
+  snp_.clear();
+  StringColumn snp_lower_case;
+  while (tokenizer.next_line()) {
+    for (int i = 0; i < tokenizer.num_fields(); i++) {
+      snp_.push_back(tokenizer.field(i));
+      tokenizer.to_lower(i);
+      snp_lower_case.push_back(tokenizer.field(i));
     }
   }
+  snp_set_.build(snp_lower_case);  // duplicates are fine here
 }
 
 bool SnpList::contains(const std::string& snp) const { 
-  return snp_set_.find(boost::to_lower_copy(snp)) != snp_set_.end();
+  return snp_set_.find(boost::to_lower_copy(snp)) >= 0;
 }
 
 void FamFile::clear() {
@@ -489,39 +793,24 @@ void FamFile::clear() {
 void FamFile::read(std::string filename) {
 //LOG << "Reading " << filename << "...";
 
-  const std::string separators = " \t\n\r";
-  std::vector<std::string> tokens;
-
   std::shared_ptr<std::istream> in_ptr = open_file(filename);
-  std::istream& in = *in_ptr;
+  LineTokenizer tokenizer(*in_ptr);
 
-  int line_no = 0;
-  for (std::string str; std::getline(in, str); )
+  while (tokenizer.next_line())
   {
-    line_no++;
-    std::string fid, iid, father_id, mother_id;
     int sex;
     double pheno;
 
-    boost::trim_if(str, boost::is_any_of(separators));
-    boost::split(tokens, str, boost::is_any_of(separators), boost::token_compress_on);
-    try {
-      fid = tokens[0];
-      iid = tokens[1];
-      father_id = tokens[2];
-      mother_id = tokens[3];
-      sex = stoi(tokens[4]);  // must not use stream or boost::lexical_cast (result in some lock contention)
-      pheno = stod(tokens[5]);
-    }
-    catch (...) {
-      std::stringstream error_str;
-      error_str << "Error parsing " << filename << ":" << line_no << " ('" << str << "')";
-      throw std::invalid_argument(error_str.str());
+    if ((tokenizer.num_fields() < 6) ||
+        !parse_int(tokenizer.field(4), &sex) ||
+        !parse_double(tokenizer.field(5), &pheno)) {
+      throw_parse_error(filename, tokenizer);
     }
-    fid_.push_back(fid);
-    iid_.push_back(iid);
-    father_id_.push_back(father_id);
-    mother_id_.push_back(mother_id);
+
+    fid_.emplace_back(tokenizer.field(0));
+    iid_.emplace_back(tokenizer.field(1));
+    father_id_.emplace_back(tokenizer.field(2));
+    mother_id_.emplace_back(tokenizer.field(3));
     sex_.push_back(sex);
     pheno_.push_back(pheno);
   }
@@ -530,11 +819,24 @@ void FamFile::read(std::string filename) {
 }
 
 void BedFileInMemory::read(std::string filename) {
-  LOG << " Reading " << num_subjects_ << " subjects, " << num_snps_ << " variants from " << filename;
-  std::ifstream bedfile_stream(filename, std::ios::in | std::ios::binary);
-  std::istreambuf_iterator<char> eos;
-  std::string buffer(std::istreambuf_iterator<char>(bedfile_stream), eos);
-  buffer_.swap(buffer);
-  if (buffer_.size() != row_byte_size_ * num_snps_ + BED_HEADER_SIZE) throw std::invalid_argument("plink .bed file has a wrong size");
-  LOG << " Finish reading " << filename;
-}
\ No newline at end of file
+#pragma omp critical(bgmg_log)
+  LOG << " Mapping " << num_subjects_ << " subjects, " << num_snps_ << " variants from " << filename;
+  try {
+    boost::interprocess::file_mapping file(filename.c_str(), boost::interprocess::read_only);
+    region_ = std::make_shared<boost::interprocess::mapped_region>(file, boost::interprocess::read_only);
+  } catch (const boost::interprocess::interprocess_exception& e) {
+    throw std::invalid_argument("can't map plink .bed file " + filename + ": " + e.what());
+  }
+  data_ = static_cast<const char*>(region_->get_address());
+  if (region_->get_size() != static_cast<size_t>(row_byte_size_) * num_snps_ + BED_HEADER_SIZE) throw std::invalid_argument("plink .bed file has a wrong size");
+  region_->advise(boost::interprocess::mapped_region::advice_sequential);
+}
+
+void BedFileInMemory::willneed(int snp_index, int num_snps) const {
+  if (!region_ || num_snps <= 0) return;
+  // madvise needs a page-aligned start address
+  const size_t page_size = boost::interprocess::mapped_region::get_page_size();
+  const size_t begin = (BED_HEADER_SIZE + static_cast<size_t>(snp_index) * row_byte_size_) / page_size * page_size;
+  const size_t end = std::min(region_->get_size(), BED_HEADER_SIZE + static_cast<size_t>(snp_index + num_snps) * row_byte_size_);
+  if (begin < end) posix_madvise(const_cast<char*>(data_) + begin, end - begin, POSIX_MADV_WILLNEED);
+}
@@ -3,26 +3,156 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <memory>
+#include <istream>
+#include <fstream>
+#include <cstdint>
 
 #define BED_HEADER_SIZE 3
 
+namespace boost { namespace interprocess { class mapped_region; } }
+class MappedReader;
+
+// plink .bed file, memory-mapped (read-only) rather than copied into a buffer.
+// Pages are loaded by the OS on first access; read() hints sequential access, and willneed() can request
+// read-ahead of a range of SNPs that is about to be used. geno() pointers remain valid while the object lives.
 class BedFileInMemory {
 public:
-  BedFileInMemory() : num_subjects_(0), num_snps_(0), row_byte_size_(0) {}
+  BedFileInMemory() : num_subjects_(0), num_snps_(0), row_byte_size_(0), data_(nullptr) {}
   explicit BedFileInMemory(int num_subjects, int num_snps, std::string filename) :
-      num_subjects_(num_subjects), num_snps_(num_snps), row_byte_size_((num_subjects + 3) / 4) { read(filename); }
+      num_subjects_(num_subjects), num_snps_(num_snps), row_byte_size_((num_subjects + 3) / 4), data_(nullptr) { read(filename); }
 
   void read(std::string filename);
+  void willneed(int snp_index, int num_snps) const;  // hint that genotypes of these SNPs will be accessed soon
 
-  const char* geno(int snp_index) {
-    return &buffer_[BED_HEADER_SIZE + snp_index * row_byte_size_];
+  const char* geno(int snp_index) const {
+    return data_ + BED_HEADER_SIZE + static_cast<size_t>(snp_index) * row_byte_size_;
   }
 
+  int num_subjects() const { return num_subjects_; }
+  int num_snps() const { return num_snps_; }
+  int row_byte_size() const { return row_byte_size_; }
+
 private:
   const int num_subjects_;
   const int num_snps_;
   const int row_byte_size_;
-  std::string buffer_; // remember this has a header (3 bytes), followed by the actual genotypes
+  std::shared_ptr<boost::interprocess::mapped_region> region_;
+  const char* data_; // remember this has a header (3 bytes), followed by the actual genotypes
+};
+
+// Splits a text stream into lines, and each line into fields separated by spaces or tabs, without allocating per line.
+// The stream is read in large blocks; fields are NUL-terminated and point into the internal buffer,
+// so they remain valid only until the next call to next_line().
+class LineTokenizer {
+public:
+  explicit LineTokenizer(std::istream& in, size_t block_size = 1 << 20);
+
+  bool next_line();  // false at the end of the stream; empty lines are returned with num_fields() == 0
+  int line_no() const { return line_no_; }
+  int num_fields() const { return static_cast<int>(fields_.size()); }
+  const char* field(int index) const { return fields_[index]; }
+  void to_lower(int index);  // converts field to lower case, in place
+  std::string line() const;  // fields of the current line, joined by a space (for error messages)
+
+private:
+  void read_block();
+
+  std::istream& in_;
+  std::vector<char> buffer_;
+  size_t begin_, end_;  // buffer_[begin_, end_) holds data not yet split into lines
+  bool eof_;
+  int line_no_;
+  std::vector<char*> fields_;
+};
+
+// Opens a text file for reading; .gz files are decompressed on the fly (see open_gzip_file).
+std::shared_ptr<std::istream> open_file(std::string filename);
+
+// Number parsing for fields of LineTokenizer, with the same semantics as stoi / stof / stod
+// (a valid prefix is accepted), but returning false instead of throwing and without constructing a std::string.
+bool parse_int(const char* str, int* value);
+bool parse_float(const char* str, float* value);
+bool parse_double(const char* str, double* value);
+
+// Column of strings stored back to back (NUL-terminated) in one buffer, instead of one heap allocation per string.
+class StringColumn {
+public:
+  StringColumn() : offsets_(1, 0) {}
+  explicit StringColumn(const std::vector<std::string>& values);
+
+  int size() const { return static_cast<int>(offsets_.size()) - 1; }
+  const char* c_str(int index) const { return &chars_[offsets_[index]]; }
+  size_t length(int index) const { return offsets_[index + 1] - offsets_[index] - 1; }
+  std::string operator[](int index) const { return std::string(c_str(index), length(index)); }
+
+  void push_back(const char* value);
+  void append(const StringColumn& other);
+  void reserve(size_t num_values, size_t num_chars);
+  void clear();
+
+  void save(std::ofstream& os) const;
+  void load(MappedReader& reader);
+
+private:
+  std::vector<uint64_t> offsets_;  // value i is chars_[offsets_[i], offsets_[i + 1]), including its terminator
+  std::vector<char> chars_;
+};
+
+// Column of alleles. Single-nucleotide alleles take one byte (their code, case-insensitive, reported in upper case);
+// other alleles (indels, missing '0', etc) are coded as ALLELE_OTHER and kept in a string pool.
+class AlleleColumn {
+public:
+  enum ALLELE_CODE {
+    ALLELE_OTHER = 0,
+    ALLELE_A = 1,
+    ALLELE_C = 2,
+    ALLELE_G = 3,
+    ALLELE_T = 4,  // so that the complement of a code is (5 - code)
+  };
+  static ALLELE_CODE encode(const char* allele);
+
+  int size() const { return static_cast<int>(codes_.size()); }
+  ALLELE_CODE code(int index) const { return static_cast<ALLELE_CODE>(codes_[index]); }
+  std::string operator[](int index) const;
+
+  void push_back(const char* allele);
+  void append(const AlleleColumn& other);
+  void reserve(size_t num_values) { codes_.reserve(num_values); }
+  void clear();
+
+  void save(std::ofstream& os) const;
+  void load(MappedReader& reader);
+
+private:
+  std::vector<uint8_t> codes_;
+  std::vector<int> other_index_;  // positions of ALLELE_OTHER alleles, in increasing order
+  StringColumn other_;            // values of ALLELE_OTHER alleles, in the same order
+};
+
+// Flat open-addressing hash table (linear probing) from SNP ids to their position in a list of ids.
+// Ids of the form rs<digits> are stored as integers; other ids are copied to a string pool.
+// Each slot holds a 32-bit fingerprint of the hash and the position, so a lookup typically touches one slot and one key.
+class SnpIdIndex {
+public:
+  SnpIdIndex() : mask_(0) {}
+
+  // Builds the table in parallel. Returns the position of a duplicated id (one of them, if there are several), or -1.
+  // Lookup of a duplicated id returns one of its positions.
+  int build(const StringColumn& ids);
+  int build(const std::vector<std::string>& ids) { return build(StringColumn(ids)); }
+  void clear();
+
+  int find(const char* id, size_t length) const;  // -1 if not found
+  int find(const std::string& id) const { return find(id.data(), id.size()); }
+
+private:
+  bool same_id(int index1, int index2) const;
+
+  std::vector<uint64_t> slots_;  // (fingerprint << 32) | (position + 1); 0 for an empty slot
+  uint64_t mask_;                // slots_.size() - 1
+  std::vector<uint64_t> keys_;   // for each id: the rs number, or SNP_ID_STRING_KEY | offset of the id in pool_
+  std::vector<char> pool_;       // NUL-terminated ids that are not rs<digits>
 };
 
 class BimFile {
@@ -34,25 +164,30 @@ public:
 
   void find_snp_to_index_map();
   int snp_index(const std::string& snp) const;
+  int snp_index(const char* snp) const;
   void read(std::string filename);
   void read(std::vector<std::string> filenames);
 
+  // binary layout used by init snapshots (see BgmgCalculator::save_init_snapshot)
+  void save(std::ofstream& os) const;
+  void load(MappedReader& reader);
+
   int size() const { return chr_label_.size(); }
   const std::vector<int>& chr_label() const { return chr_label_; }
-  const std::vector<std::string>& snp() const { return snp_; }
+  const StringColumn& snp() const { return snp_; }
   const std::vector<float>& gp() const { return gp_; }
   const std::vector<int>& bp() const { return bp_; }
-  const std::vector<std::string>& a1() const { return a1_; }
-  const std::vector<std::string>& a2() const { return a2_; }
+  const AlleleColumn& a1() const { return a1_; }
+  const AlleleColumn& a2() const { return a2_; }
 
 private:
   std::vector<int> chr_label_;
-  std::vector<std::string> snp_;
+  StringColumn snp_;
   std::vector<float> gp_;
   std::vector<int> bp_;
-  std::vector<std::string> a1_;
-  std::vector<std::string> a2_;
-  std::map<std::string, int> snp_to_index_;
+  AlleleColumn a1_;
+  AlleleColumn a2_;
+  SnpIdIndex snp_to_index_;
 };
 
 class FamFile {
@@ -85,12 +220,12 @@ public:
   SnpList() {}
   explicit SnpList(std::string filename) { read(filename); }
   void read(std::string filename);
-  const std::vector<std::string>& snp() const { return snp_; }
+  const StringColumn& snp() const { return snp_; }
   bool contains(const std::string& snp) const;
 
 private:
-  std::vector<std::string> snp_;
-  std::map<std::string, char> snp_set_;
+  StringColumn snp_;
+  SnpIdIndex snp_set_;  // lower case ids
 };
 
 class PlinkLdFile {
@@ -137,6 +272,13 @@ public:
     const std::string& a1reference,
     const std::string& a2reference);
 
+  // Same as above, for single-nucleotide alleles given by their codes (none of them AlleleColumn::ALLELE_OTHER)
+  static FLIP_STATUS flip_strand(
+    AlleleColumn::ALLELE_CODE a1sumstat,
+    AlleleColumn::ALLELE_CODE a2sumstat,
+    AlleleColumn::ALLELE_CODE a1reference,
+    AlleleColumn::ALLELE_CODE a2reference);
+
   const std::vector<float>& zscore() { return zscore_; }
   const std::vector<float>& sample_size() { return sample_size_; }
 
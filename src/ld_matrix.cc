@@ -1,57 +1,99 @@
 #include "ld_matrix.h"
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <exception>
+#include <future>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <valarray>
 
+#include <omp.h>
+#include "zlib.h"
+
+#include "boost/algorithm/string.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/lexical_cast.hpp"
+
 #include "bgmg_log.h"
 #include "bgmg_parse.h"
 #include "plink_ld.h"
 #include "ld_matrix_csr.h"
+#include "mapped_file.h"
+
+#define LD_MATRIX_FORMAT_VERSION 3  // version 3 stores CSR arrays in independently compressed blocks of snps, with an index at the end of the file
+#define LD_MATRIX_SNPS_PER_BLOCK 4096
+#define LD_MATRIX_BLOCKS_PER_BATCH 64  // save_ld_matrix compresses this many blocks in parallel before writing them
+
+#define PLINK_LD_LINES_PER_BATCH (64 * 1024)  // lines of plink .ld file that are matched to the reference in parallel
+#define PLINK_LD_BUFFER_SIZE (256 * 1024)  // initial capacity of PlinkLdCsrBuilder buffer, in LD values
 
-#define LD_MATRIX_FORMAT_VERSION 2
+#define LD_MATRIX_MAPPED_MAGIC 0x504d444c474d4742ull  // "BGMGLDMP"
+#define LD_MATRIX_MAPPED_FORMAT_VERSION 2  // version 2 adds ld_r_codec
 
-class PosixFile {
+// Distance limits for pairs of SNPs considered in generate_ld_matrix_from_bed_file.
+// Assumes SNPs are sorted by chromosome and position, so that distance is monotone within each row of the LD matrix.
+class LdWindow {
 public:
-  PosixFile(std::string filename, std::string modes) {
-    file = fopen(filename.c_str(), modes.c_str());
-    if (file == nullptr) BGMG_THROW_EXCEPTION(::std::runtime_error(std::string("Unable to open ") + filename));
+  LdWindow(const BimFile& bim_file, int ld_window, float ld_window_kb, float ld_window_cm)
+    : chr_label_(bim_file.chr_label()), bp_(bim_file.bp()), gp_(bim_file.gp()),
+      ld_window_(ld_window), ld_window_bp_(1000.0 * ld_window_kb), ld_window_cm_(ld_window_cm) {
+    if (!enabled()) return;
+    for (int i = 1; i < chr_label_.size(); i++) {
+      if ((chr_label_[i] < chr_label_[i-1]) ||
+          ((chr_label_[i] == chr_label_[i-1]) && ((bp_[i] < bp_[i-1]) || (gp_[i] < gp_[i-1])))) {
+        std::stringstream ss; ss << "windowed LD computation requires .bim file sorted by chromosome and position, check SNP " << bim_file.snp()[i];
+        BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+      }
+    }
+  }
+
+  bool enabled() const { return (ld_window_ > 0) || (ld_window_bp_ > 0) || (ld_window_cm_ > 0); }
+
+  // whether a pair of SNPs, snp_index < snp_jndex, is within the window
+  bool contains(int snp_index, int snp_jndex) const {
+    if (!enabled()) return true;
+    if (chr_label_[snp_index] != chr_label_[snp_jndex]) return false;
+    if ((ld_window_ > 0) && ((snp_jndex - snp_index) > ld_window_)) return false;
+    if ((ld_window_bp_ > 0) && ((bp_[snp_jndex] - bp_[snp_index]) > ld_window_bp_)) return false;
+    if ((ld_window_cm_ > 0) && ((gp_[snp_jndex] - gp_[snp_index]) > ld_window_cm_)) return false;
+    return true;
   }
-  ~PosixFile() { fclose(file); }
-  FILE* handle() { return file; }
 
 private:
-  FILE* file;
+  const std::vector<int>& chr_label_;
+  const std::vector<int>& bp_;
+  const std::vector<float>& gp_;
+  const int ld_window_;
+  const double ld_window_bp_;
+  const float ld_window_cm_;
 };
 
-void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, float r2_min, std::string outfile) {
-  LOG << ">generate_ld_matrix_from_bed_file(bfile=" << bfile << ");";
+// LD matrix of SNPs [snp_from, snp_to) of a .bed file, saved with SNP indices relative to snp_from.
+// bim_file and frq describe all SNPs of the .bed file.
+// Can run concurrently for different ranges of SNPs (see generate_ld_matrix_from_bed_file_per_chr).
+static void generate_ld_matrix_for_snp_range(const std::string& bfile, const BimFile& bim_file, int num_subj, const std::vector<float>& frq,
+                                             int snp_from, int snp_to, float r2_min, const std::string& outfile,
+                                             int ld_window, float ld_window_kb, float ld_window_cm) {
+#pragma omp critical(bgmg_log)
+  LOG << ">generate_ld_matrix_for_snp_range(bfile=" << bfile << ", snp_from=" << snp_from << ", snp_to=" << snp_to << ", outfile=" << outfile << ");";
   SimpleTimer timer(-1);
 
-  FamFile fam_file(bfile + ".fam");
-  BimFile bim_file(bfile + ".bim");
-  bim_file.find_snp_to_index_map();
-  const int num_snps = bim_file.size();
-  const int num_subj = fam_file.size();
+  const int num_snps = snp_to - snp_from;
+  if (num_snps <= 0) BGMG_THROW_EXCEPTION(::std::runtime_error("no SNPs to compute LD for " + outfile));
 
-  FrqFile frq_file(bim_file, frqfile);
-  frq_file.align_to_reference(bim_file);
-  const std::vector<float>& frq = frq_file.frq();
+  // window.contains() takes SNP indices of the whole .bed file, i.e. snp_from + (index within the range)
+  const LdWindow window(bim_file, ld_window, ld_window_kb, ld_window_cm);
 
   std::vector<float> hvec(num_snps, 0.0f);
-  for (int i = 0; i < num_snps; i++) hvec[i] = 2 * frq[i] * (1.0f - frq[i]);
+  for (int i = 0; i < num_snps; i++) hvec[i] = 2 * frq[snp_from + i] * (1.0f - frq[snp_from + i]);
 
   const int block_size = std::min(8*1024, num_snps);  // handle blocks of up to 8K SNPs
-  const int block_elems = block_size * block_size;
   const int num_blocks = (num_snps + (block_size-1)) / block_size;
-  std::vector<int> idx1(block_elems, 0), idx2(block_elems, 0);
-  for (int i = 0; i < block_size; i++) {
-    for (int j = 0; j < block_size; j++) {
-      idx1[i*block_size + j] = i;
-      idx2[i*block_size + j] = j;
-    }
-  }
-
-  PosixFile bedfile(bfile + ".bed", "rb");
+  const SampleCountInfo sample_count_info(num_subj);
 
   LdMatrixCsrChunk ld_matrix_csr_chunk;
   ld_matrix_csr_chunk.snp_index_from_inclusive_ = 0;
@@ -60,72 +102,118 @@ void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, fl
   std::valarray<float> ld_tag_r2_sum(0.0, num_snps), ld_tag_r2_sum_adjust_for_hvec(0.0, num_snps);
   std::valarray<float> ld_tag_r4_sum(0.0, num_snps), ld_tag_r4_sum_adjust_for_hvec(0.0, num_snps);
 
-  PlinkLdBedFileChunk chunk_fixed, chunk_var, *chunk_var_ptr;
+  // the closest pair of a tile is (last SNP of block_idx, first SNP of block_jdx);
+  // if it is outside the window, so is the rest of this tile and all tiles further right.
+  auto tile_in_window = [&](int block_idx, int block_jdx) {
+    return (block_jdx == block_idx) || window.contains(snp_from + std::min((block_idx + 1) * block_size, num_snps) - 1, snp_from + block_jdx * block_size);
+  };
+
+  // blocks in the order they are used by the loop below: fixed block of each row, followed by its var blocks
+  std::vector<int> block_sequence;
+  for (int block_idx = 0; block_idx < num_blocks; block_idx++) {
+    for (int block_jdx = block_idx; (block_jdx < num_blocks) && tile_in_window(block_idx, block_jdx); block_jdx++)
+      block_sequence.push_back(block_jdx);
+  }
+  PlinkLdBedBlockReader bed_reader(bfile + ".bed", num_subj, bim_file.size(), snp_from, num_snps, block_size, block_sequence);
+
+  // The CSR structure is built row block by row block: each row of the current row block collects its elements
+  // (only the thread that owns the row writes to it), then complete rows are appended to the CSR arrays.
+  std::vector<std::vector<std::pair<uint32_t, packed_r_value>>> row_ld(block_size);
+  std::vector<uint32_t> csr_ld_tag_index;
+  ld_matrix_csr_chunk.csr_ld_snp_index_.push_back(0);
+
+  std::shared_ptr<PlinkLdBedFileChunk> chunk_fixed, chunk_var;
   for (int block_idx = 0; block_idx < num_blocks; block_idx++) {
     const int block_istart = block_idx * block_size;
     const int block_iend = std::min(block_istart + block_size, num_snps);
     const int block_isize = block_iend - block_istart;
-    if (0 != chunk_fixed.init(num_subj, block_istart, block_isize, bedfile.handle()))
-      BGMG_THROW_EXCEPTION(::std::runtime_error("error while reading .bed file"));
-
-    for (int block_jdx = block_idx; block_jdx < num_blocks; block_jdx++) {
-    LOG << " processing block " << (block_idx+1) << "x" << (block_jdx+1) << " of " << num_blocks << "x" << num_blocks << "... ";
 
+    for (int block_jdx = block_idx; (block_jdx < num_blocks) && tile_in_window(block_idx, block_jdx); block_jdx++) {
       const int block_jstart = block_jdx * block_size;
       const int block_jend = std::min(block_jstart + block_size, num_snps);
       const int block_jsize = block_jend - block_jstart;
+
+#pragma omp critical(bgmg_log)
+      LOG << " processing block " << (block_idx+1) << "x" << (block_jdx+1) << " of " << num_blocks << "x" << num_blocks << "... ";
+      chunk_var.reset();  // release the previous block before the reader allocates one more
       if (block_jdx == block_idx) {
-        chunk_var_ptr = &chunk_fixed;  // reuse the block
+        chunk_fixed.reset();
+        chunk_fixed = bed_reader.next();
+        chunk_var = chunk_fixed;  // reuse the block
       } else {
-        if (0 != chunk_var.init(num_subj, block_jstart, block_jsize, bedfile.handle()))
-          BGMG_THROW_EXCEPTION(::std::runtime_error("error while reading .bed file"));
-        chunk_var_ptr = &chunk_var;
+        chunk_var = bed_reader.next();
       }
 
 #pragma omp parallel
       {
-        std::vector<std::tuple<int, int, packed_r_value>> local_coo_ld; // snp, tag, r2
-        std::valarray<float> local_ld_tag_r2_sum(0.0, num_snps), local_ld_tag_r2_sum_adjust_for_hvec(0.0, num_snps);
-        std::valarray<float> local_ld_tag_r4_sum(0.0, num_snps), local_ld_tag_r4_sum_adjust_for_hvec(0.0, num_snps);
-
-#pragma omp for schedule(static)
-        for (int k = 0; k < block_elems; k++) {
-          int block_snp_index = k / block_size;
-          int block_snp_jndex = k % block_size;
-          int global_snp_index = block_snp_index + block_istart;
-          int global_snp_jndex = block_snp_jndex + block_jstart;
-          if (global_snp_jndex <= global_snp_index || global_snp_jndex >= num_snps) continue;
-          float ld_corr = (float)PlinkLdBedFileChunk::calculate_ld_corr(chunk_fixed, *chunk_var_ptr, block_snp_index, block_snp_jndex);
-          float ld_r2 = ld_corr * ld_corr;
-          float ld_r4 = ld_r2 * ld_r2;
-
-          if (ld_r2 < r2_min) {
-            local_ld_tag_r2_sum[global_snp_index] += ld_r2;
-            local_ld_tag_r2_sum[global_snp_jndex] += ld_r2;
-            local_ld_tag_r2_sum_adjust_for_hvec[global_snp_index] += ld_r2 * hvec[global_snp_jndex];  // note that i-th SNP is adjusted for het of j-th SNP
-            local_ld_tag_r2_sum_adjust_for_hvec[global_snp_jndex] += ld_r2 * hvec[global_snp_index];  // and vice versa.
-            local_ld_tag_r4_sum[global_snp_index] += ld_r4;
-            local_ld_tag_r4_sum[global_snp_jndex] += ld_r4;
-            local_ld_tag_r4_sum_adjust_for_hvec[global_snp_index] += ld_r4 * pow(hvec[global_snp_jndex], 2);  // note that i-th SNP is adjusted for het of j-th SNP
-            local_ld_tag_r4_sum_adjust_for_hvec[global_snp_jndex] += ld_r4 * pow(hvec[global_snp_index], 2);  // and vice versa.
-          }
-          else {
-            local_coo_ld.push_back(std::make_tuple(global_snp_index, global_snp_jndex, ld_corr));
+        // sums for SNPs of block_jdx are shared across rows, so each thread keeps its own copy for the tile;
+        // sums for the SNP of a row are only updated by the thread that owns the row
+        std::valarray<float> local_ld_tag_r2_sum(0.0, block_jsize), local_ld_tag_r2_sum_adjust_for_hvec(0.0, block_jsize);
+        std::valarray<float> local_ld_tag_r4_sum(0.0, block_jsize), local_ld_tag_r4_sum_adjust_for_hvec(0.0, block_jsize);
+        std::vector<double> ld_corr_tile(block_jsize);
+
+#pragma omp for schedule(dynamic, 16)
+        for (int block_snp_index = 0; block_snp_index < block_isize; block_snp_index++) {
+          const int global_snp_index = block_snp_index + block_istart;
+
+          // SNPs of block_jdx that pair with global_snp_index: upper triangle, within the window
+          const int global_snp_jndex_from = std::max(block_jstart, global_snp_index + 1);
+          int global_snp_jndex_to = global_snp_jndex_from;
+          while ((global_snp_jndex_to < block_jend) && window.contains(snp_from + global_snp_index, snp_from + global_snp_jndex_to)) global_snp_jndex_to++;
+          if (global_snp_jndex_to == global_snp_jndex_from) continue;
+
+          PlinkLdBedFileChunk::calculate_ld_corr_tile(sample_count_info, *chunk_fixed, *chunk_var, block_snp_index,
+                                                      global_snp_jndex_from - block_jstart, global_snp_jndex_to - block_jstart, &ld_corr_tile[0]);
+
+          std::vector<std::pair<uint32_t, packed_r_value>>& row = row_ld[block_snp_index];
+          float row_r2_sum = 0.0f, row_r2_sum_adjust_for_hvec = 0.0f, row_r4_sum = 0.0f, row_r4_sum_adjust_for_hvec = 0.0f;
+          for (int global_snp_jndex = global_snp_jndex_from; global_snp_jndex < global_snp_jndex_to; global_snp_jndex++) {
+            const int block_snp_jndex = global_snp_jndex - block_jstart;
+            float ld_corr = (float)ld_corr_tile[global_snp_jndex - global_snp_jndex_from];
+            float ld_r2 = ld_corr * ld_corr;
+            float ld_r4 = ld_r2 * ld_r2;
+
+            if (ld_r2 < r2_min) {
+              row_r2_sum += ld_r2;
+              local_ld_tag_r2_sum[block_snp_jndex] += ld_r2;
+              row_r2_sum_adjust_for_hvec += ld_r2 * hvec[global_snp_jndex];  // note that i-th SNP is adjusted for het of j-th SNP
+              local_ld_tag_r2_sum_adjust_for_hvec[block_snp_jndex] += ld_r2 * hvec[global_snp_index];  // and vice versa.
+              row_r4_sum += ld_r4;
+              local_ld_tag_r4_sum[block_snp_jndex] += ld_r4;
+              row_r4_sum_adjust_for_hvec += ld_r4 * pow(hvec[global_snp_jndex], 2);  // note that i-th SNP is adjusted for het of j-th SNP
+              local_ld_tag_r4_sum_adjust_for_hvec[block_snp_jndex] += ld_r4 * pow(hvec[global_snp_index], 2);  // and vice versa.
+            }
+            else {
+              row.push_back(std::make_pair(global_snp_jndex, packed_r_value(ld_corr)));
+            }
           }
-        }
-#pragma omp critical 
+          ld_tag_r2_sum[global_snp_index] += row_r2_sum;
+          ld_tag_r2_sum_adjust_for_hvec[global_snp_index] += row_r2_sum_adjust_for_hvec;
+          ld_tag_r4_sum[global_snp_index] += row_r4_sum;
+          ld_tag_r4_sum_adjust_for_hvec[global_snp_index] += row_r4_sum_adjust_for_hvec;
+        }  // implicit barrier - all rows are done before the per-thread sums are merged
+#pragma omp critical
         {
-          ld_tag_r2_sum += local_ld_tag_r2_sum;
-          ld_tag_r4_sum += local_ld_tag_r4_sum;
-          ld_tag_r2_sum_adjust_for_hvec += local_ld_tag_r2_sum_adjust_for_hvec;
-          ld_tag_r4_sum_adjust_for_hvec += local_ld_tag_r4_sum_adjust_for_hvec;
-          ld_matrix_csr_chunk.coo_ld_.insert( ld_matrix_csr_chunk.coo_ld_.end(), local_coo_ld.begin(), local_coo_ld.end() );
+          ld_tag_r2_sum[std::slice(block_jstart, block_jsize, 1)] += local_ld_tag_r2_sum;
+          ld_tag_r4_sum[std::slice(block_jstart, block_jsize, 1)] += local_ld_tag_r4_sum;
+          ld_tag_r2_sum_adjust_for_hvec[std::slice(block_jstart, block_jsize, 1)] += local_ld_tag_r2_sum_adjust_for_hvec;
+          ld_tag_r4_sum_adjust_for_hvec[std::slice(block_jstart, block_jsize, 1)] += local_ld_tag_r4_sum_adjust_for_hvec;
         }
       }
     }
+
+    // all tiles of the row block are done, so its rows are complete (and sorted by tag index, as tiles go left to right)
+    for (int block_snp_index = 0; block_snp_index < block_isize; block_snp_index++) {
+      for (auto& elem : row_ld[block_snp_index]) {
+        csr_ld_tag_index.push_back(elem.first);
+        ld_matrix_csr_chunk.csr_ld_r_.push_back(elem.second);
+      }
+      ld_matrix_csr_chunk.csr_ld_snp_index_.push_back(csr_ld_tag_index.size());
+      row_ld[block_snp_index].clear();
+    }
   }
-  
-  ld_matrix_csr_chunk.set_ld_r2_csr(nullptr); 
+
+  ld_matrix_csr_chunk.pack_ld_r2_csr(&csr_ld_tag_index);
   std::vector<float> ld_tag_r2_sum_vec, ld_tag_r2_sum_adjust_for_hvec_vec;
   std::vector<float> ld_tag_r4_sum_vec, ld_tag_r4_sum_adjust_for_hvec_vec;
   ld_tag_r2_sum_vec.assign(std::begin(ld_tag_r2_sum), std::end(ld_tag_r2_sum));
@@ -140,7 +228,361 @@ void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, fl
                  ld_tag_r4_sum_adjust_for_hvec_vec,
                  outfile);
 
-  LOG << "<generate_ld_matrix_from_bed_file(bfile=" << bfile << "), nnz=" << ld_matrix_csr_chunk.csr_ld_r_.size() <<", elapsed time " << timer.elapsed_ms() << "ms";
+#pragma omp critical(bgmg_log)
+  LOG << "<generate_ld_matrix_for_snp_range(outfile=" << outfile << "), nnz=" << ld_matrix_csr_chunk.csr_ld_r_.size() <<", elapsed time " << timer.elapsed_ms() << "ms";
+}
+
+void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, float r2_min, std::string outfile,
+                                      int ld_window, float ld_window_kb, float ld_window_cm) {
+  LOG << ">generate_ld_matrix_from_bed_file(bfile=" << bfile << ", ld_window=" << ld_window << ", ld_window_kb=" << ld_window_kb << ", ld_window_cm=" << ld_window_cm << ");";
+  SimpleTimer timer(-1);
+
+  FamFile fam_file(bfile + ".fam");
+  BimFile bim_file(bfile + ".bim");
+  bim_file.find_snp_to_index_map();
+
+  FrqFile frq_file(bim_file, frqfile);
+  frq_file.align_to_reference(bim_file);
+
+  generate_ld_matrix_for_snp_range(bfile, bim_file, fam_file.size(), frq_file.frq(), 0, bim_file.size(), r2_min, outfile, ld_window, ld_window_kb, ld_window_cm);
+
+  LOG << "<generate_ld_matrix_from_bed_file(bfile=" << bfile << "), elapsed time " << timer.elapsed_ms() << "ms";
+}
+
+// One chromosome for generate_ld_matrix_from_bed_file_per_chr: SNPs [snp_from, snp_to) of a .bed file
+struct LdMatrixChrJob {
+  std::string bfile;
+  std::string outfile;
+  int bim_index;  // which of the .bim/.frq files describes the .bed file
+  int snp_from;
+  int snp_to;
+};
+
+void generate_ld_matrix_from_bed_file_per_chr(std::string bfile, std::string frqfile, std::string chr_labels, float r2_min, std::string outfile,
+                                              int ld_window, float ld_window_kb, float ld_window_cm) {
+  LOG << ">generate_ld_matrix_from_bed_file_per_chr(bfile=" << bfile << ", chr_labels=" << chr_labels << ", outfile=" << outfile << ");";
+  SimpleTimer timer(-1);
+
+  if (outfile.find("@") == std::string::npos) BGMG_THROW_EXCEPTION(::std::runtime_error("output file name must contain @ to be replaced with chromosome label"));
+  if ((bfile.find("@") == std::string::npos) != (frqfile.find("@") == std::string::npos)) BGMG_THROW_EXCEPTION(::std::runtime_error("either both or none of bfile and frqfile can contain @"));
+  const bool split_files = (bfile.find("@") != std::string::npos);
+
+  std::vector<std::string> chr_labels_vector;
+  if (chr_labels.empty()) {
+    for (int i = 1; i <= 22; i++)
+      chr_labels_vector.push_back(boost::lexical_cast<std::string>(i));
+  } else {
+    const std::string separators = " ,;\t\n\r";
+    boost::trim_if(chr_labels, boost::is_any_of(separators));
+    boost::split(chr_labels_vector, chr_labels, boost::is_any_of(separators), boost::token_compress_on);
+  }
+
+  // .bim/.frq files are small compared to .bed, so they are all read upfront
+  std::vector<std::string> bfiles;
+  if (split_files) {
+    for (auto chrlabel : chr_labels_vector) { bfiles.push_back(bfile); boost::replace_all(bfiles.back(), "@", chrlabel); }
+  } else {
+    bfiles.push_back(bfile);
+  }
+  std::vector<BimFile> bim_files(bfiles.size());
+  std::vector<std::vector<float>> frqs(bfiles.size());
+  std::vector<int> num_subjs(bfiles.size());
+  for (int i = 0; i < bfiles.size(); i++) {
+    std::string frqfile_chr = frqfile;
+    if (split_files) boost::replace_all(frqfile_chr, "@", chr_labels_vector[i]);
+    num_subjs[i] = FamFile(bfiles[i] + ".fam").size();
+    bim_files[i].read(bfiles[i] + ".bim");
+    bim_files[i].find_snp_to_index_map();
+    FrqFile frq_file(bim_files[i], frqfile_chr);
+    frq_file.align_to_reference(bim_files[i]);
+    frqs[i] = frq_file.frq();
+  }
+
+  std::vector<LdMatrixChrJob> jobs;
+  for (int i = 0; i < chr_labels_vector.size(); i++) {
+    LdMatrixChrJob job;
+    job.bim_index = split_files ? i : 0;
+    job.bfile = bfiles[job.bim_index];
+    job.outfile = outfile;
+    boost::replace_all(job.outfile, "@", chr_labels_vector[i]);
+    if (split_files) {
+      job.snp_from = 0;
+      job.snp_to = bim_files[i].size();
+    } else {
+      // SNPs of the chromosome must be contiguous in a genome-wide .bed file
+      const int chr_label = boost::lexical_cast<int>(chr_labels_vector[i]);
+      const std::vector<int>& chr = bim_files[0].chr_label();
+      job.snp_from = std::find(chr.begin(), chr.end(), chr_label) - chr.begin();
+      job.snp_to = std::find_if(chr.begin() + job.snp_from, chr.end(), [chr_label](int label) { return label != chr_label; }) - chr.begin();
+      if (std::find(chr.begin() + job.snp_to, chr.end(), chr_label) != chr.end())
+        BGMG_THROW_EXCEPTION(::std::runtime_error("SNPs of chromosome " + chr_labels_vector[i] + " are not contiguous in " + bfile + ".bim"));
+    }
+    if (job.snp_from == job.snp_to) { LOG << " no SNPs on chromosome " << chr_labels_vector[i] << ", skip"; continue; }
+    jobs.push_back(job);
+  }
+
+  // Largest chromosomes first; each chromosome runs on an equal share of threads, with nested parallel regions.
+  std::sort(jobs.begin(), jobs.end(), [](const LdMatrixChrJob& a, const LdMatrixChrJob& b) { return (a.snp_to - a.snp_from) > (b.snp_to - b.snp_from); });
+  const int num_threads = omp_get_max_threads();
+  const int num_parallel_jobs = std::max(1, std::min<int>(jobs.size(), num_threads));
+  const int num_threads_per_job = std::max(1, num_threads / num_parallel_jobs);
+  LOG << " computing LD for " << jobs.size() << " chromosomes, " << num_parallel_jobs << " at a time with " << num_threads_per_job << " threads each";
+
+  const int max_active_levels = omp_get_max_active_levels();
+  omp_set_max_active_levels(std::max(2, max_active_levels));
+  std::exception_ptr error = nullptr;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_parallel_jobs)
+  for (int job_index = 0; job_index < jobs.size(); job_index++) {
+    const LdMatrixChrJob& job = jobs[job_index];
+    omp_set_num_threads(num_threads_per_job);
+    try {
+      generate_ld_matrix_for_snp_range(job.bfile, bim_files[job.bim_index], num_subjs[job.bim_index], frqs[job.bim_index],
+                                       job.snp_from, job.snp_to, r2_min, job.outfile, ld_window, ld_window_kb, ld_window_cm);
+    } catch (...) {
+#pragma omp critical(generate_ld_matrix_error)
+      if (error == nullptr) error = std::current_exception();
+    }
+  }
+  omp_set_max_active_levels(max_active_levels);
+  if (error != nullptr) std::rethrow_exception(error);
+
+  LOG << "<generate_ld_matrix_from_bed_file_per_chr(bfile=" << bfile << "), elapsed time " << timer.elapsed_ms() << "ms";
+}
+
+// Upper-triangular CSR structure of one chromosome (the layout produced by generate_ld_matrix_from_bed_file),
+// built from pairs of SNPs listed in a plink .ld file; r2 values below r2_min go to LD score sums instead.
+// LD values are collected in a bounded buffer. plink lists pairs in the order of the first SNP, so when the buffer is full
+// all its rows except the highest one (which may still grow) are complete; they are sorted and appended to the CSR arrays.
+// Values that arrive for a row that is already complete are kept aside and merged in save(), so any input order gives the same result.
+class PlinkLdCsrBuilder {
+public:
+  // hvec holds heterozygosity 2*maf*(1-maf) of each SNP of the chromosome
+  PlinkLdCsrBuilder(const std::vector<float>& hvec, float r2_min)
+    : num_snps_(hvec.size()), hvec_(hvec), r2_min_(r2_min), buffer_capacity_(PLINK_LD_BUFFER_SIZE), num_complete_rows_(0),
+      ld_tag_r2_sum_(num_snps_, 0.0f), ld_tag_r2_sum_adjust_for_hvec_(num_snps_, 0.0f), ld_tag_r4_sum_(num_snps_, 0.0f), ld_tag_r4_sum_adjust_for_hvec_(num_snps_, 0.0f) {
+    chunk_.snp_index_from_inclusive_ = 0;
+    chunk_.snp_index_to_exclusive_ = num_snps_;
+    chunk_.chr_label_ = 0;
+    chunk_.csr_ld_snp_index_.push_back(0);
+  }
+
+  // snp_index < snp_jndex, both relative to the chromosome
+  void add(int snp_index, int snp_jndex, float r2) {
+    if (r2 < r2_min_) {
+      const float r4 = r2 * r2;
+      ld_tag_r2_sum_[snp_index] += r2;
+      ld_tag_r2_sum_[snp_jndex] += r2;
+      ld_tag_r2_sum_adjust_for_hvec_[snp_index] += r2 * hvec_[snp_jndex];  // note that i-th SNP is adjusted for het of j-th SNP
+      ld_tag_r2_sum_adjust_for_hvec_[snp_jndex] += r2 * hvec_[snp_index];  // and vice versa.
+      ld_tag_r4_sum_[snp_index] += r4;
+      ld_tag_r4_sum_[snp_jndex] += r4;
+      ld_tag_r4_sum_adjust_for_hvec_[snp_index] += r4 * pow(hvec_[snp_jndex], 2);
+      ld_tag_r4_sum_adjust_for_hvec_[snp_jndex] += r4 * pow(hvec_[snp_index], 2);
+      return;
+    }
+
+    buffer_.push_back(Entry(snp_index, snp_jndex, packed_r_value(sqrt(r2))));  // plink .ld files have r2, without the sign of r
+    if (buffer_.size() >= buffer_capacity_) flush(false);
+  }
+
+  int64_t num_ld_r() const { return csr_ld_tag_index_.size() + buffer_.size() + late_.size(); }
+
+  void save(const std::string& filename) {
+    flush(true);
+    if (!late_.empty()) merge_late();
+    chunk_.pack_ld_r2_csr(&csr_ld_tag_index_);
+    save_ld_matrix(chunk_, ld_tag_r2_sum_, ld_tag_r2_sum_adjust_for_hvec_, ld_tag_r4_sum_, ld_tag_r4_sum_adjust_for_hvec_, filename);
+  }
+
+private:
+  struct Entry {
+    Entry(uint32_t row, uint32_t col, packed_r_value r) : row(row), col(col), r(r) {}
+    bool operator<(const Entry& other) const { return (row < other.row) || ((row == other.row) && (col < other.col)); }
+    uint32_t row;
+    uint32_t col;
+    packed_r_value r;
+  };
+
+  // CSR rows [num_complete_rows_, row) are complete
+  void close_rows(int row) {
+    for (; num_complete_rows_ < row; num_complete_rows_++) chunk_.csr_ld_snp_index_.push_back(csr_ld_tag_index_.size());
+  }
+
+  // appends buffered rows to the CSR arrays; all of them, or all except the highest one
+  void flush(bool all) {
+    std::sort(buffer_.begin(), buffer_.end());
+    const uint32_t last_row = all ? num_snps_ : buffer_.back().row;
+    auto split = std::lower_bound(buffer_.begin(), buffer_.end(), Entry(last_row, 0, packed_r_value()));
+    for (auto iter = buffer_.begin(); iter != split; iter++) {
+      if (iter->row < num_complete_rows_) { late_.push_back(*iter); continue; }
+      close_rows(iter->row);
+      csr_ld_tag_index_.push_back(iter->col);
+      chunk_.csr_ld_r_.push_back(iter->r);
+    }
+    close_rows(last_row);
+    buffer_.erase(buffer_.begin(), split);
+    if (2 * buffer_.size() > buffer_capacity_) buffer_capacity_ *= 2;  // a single row takes most of the buffer
+  }
+
+  void merge_late() {
+#pragma omp critical(bgmg_log)
+    LOG << " " << late_.size() << " LD values are not in the order of the first SNP, merging them into CSR structure";
+    std::sort(late_.begin(), late_.end());
+    LdMatrixCsrChunk merged;
+    merged.snp_index_from_inclusive_ = chunk_.snp_index_from_inclusive_;
+    merged.snp_index_to_exclusive_ = chunk_.snp_index_to_exclusive_;
+    merged.chr_label_ = chunk_.chr_label_;
+    merged.csr_ld_snp_index_.push_back(0);
+    std::vector<uint32_t> csr_ld_tag_index;
+    csr_ld_tag_index.reserve(num_ld_r());
+    merged.csr_ld_r_.reserve(num_ld_r());
+    auto late = late_.begin();
+    for (int row = 0; row < num_snps_; row++) {
+      int64_t ld_index = chunk_.csr_ld_snp_index_[row];
+      const int64_t ld_index_end = chunk_.csr_ld_snp_index_[row + 1];
+      while ((ld_index < ld_index_end) || ((late != late_.end()) && (late->row == row))) {
+        if ((late != late_.end()) && (late->row == row) && ((ld_index == ld_index_end) || (late->col < csr_ld_tag_index_[ld_index]))) {
+          csr_ld_tag_index.push_back(late->col);
+          merged.csr_ld_r_.push_back(late->r);
+          late++;
+        } else {
+          csr_ld_tag_index.push_back(csr_ld_tag_index_[ld_index]);
+          merged.csr_ld_r_.push_back(chunk_.csr_ld_r_[ld_index]);
+          ld_index++;
+        }
+      }
+      merged.csr_ld_snp_index_.push_back(csr_ld_tag_index.size());
+    }
+    chunk_ = std::move(merged);
+    csr_ld_tag_index_.swap(csr_ld_tag_index);
+    std::vector<Entry>().swap(late_);
+  }
+
+  const uint32_t num_snps_;
+  const std::vector<float> hvec_;
+  const float r2_min_;
+  std::vector<Entry> buffer_;
+  size_t buffer_capacity_;
+  std::vector<Entry> late_;
+  uint32_t num_complete_rows_;
+  LdMatrixCsrChunk chunk_;
+  std::vector<uint32_t> csr_ld_tag_index_;
+  std::vector<float> ld_tag_r2_sum_, ld_tag_r2_sum_adjust_for_hvec_;
+  std::vector<float> ld_tag_r4_sum_, ld_tag_r4_sum_adjust_for_hvec_;
+};
+
+void convert_plink_ld_to_ld_matrix(std::string plink_ld_file, const BimFile& bim_file, const std::vector<float>& mafvec, float r2_min, std::string out_file) {
+  LOG << ">convert_plink_ld_to_ld_matrix(plink_ld_file=" << plink_ld_file << ", r2_min=" << r2_min << ", out_file=" << out_file << ");";
+  SimpleTimer timer(-1);
+
+  if (!mafvec.empty() && (mafvec.size() != bim_file.size())) BGMG_THROW_EXCEPTION(::std::runtime_error("mafvec does not match the reference"));
+  if (mafvec.empty()) LOG << " [WARNING] mafvec is not available, LD scores adjusted for heterozygosity will be zero";
+
+  // LD matrix files use SNP indices relative to the chromosome, so SNPs of each chromosome must be contiguous in the reference
+  const std::vector<int>& chr_label = bim_file.chr_label();
+  std::vector<int> chr_snp_from, chr_snp_to;  // indexed by chromosome label
+  for (int snp_index = 0; snp_index < bim_file.size(); snp_index++) {
+    const int label = chr_label[snp_index];
+    if (label < 0) BGMG_THROW_EXCEPTION(::std::runtime_error("negative chromosome label in the reference"));
+    if (label >= chr_snp_from.size()) { chr_snp_from.resize(label + 1, -1); chr_snp_to.resize(label + 1, -1); }
+    if (chr_snp_from[label] < 0) chr_snp_from[label] = snp_index;
+    else if (chr_snp_to[label] != snp_index) BGMG_THROW_EXCEPTION(::std::runtime_error("SNPs of chromosome " + std::to_string(label) + " are not contiguous in the reference"));
+    chr_snp_to[label] = snp_index + 1;
+  }
+
+  // plink groups .ld output by CHR_A, so chromosomes are converted one at a time:
+  // a chromosome is saved as soon as LD values of the next chromosome appear, keeping at most one builder in memory
+  std::unique_ptr<PlinkLdCsrBuilder> builder;
+  int builder_label = -1;
+  std::vector<char> chr_saved(chr_snp_from.size(), 0);
+  const bool out_file_per_chr = (out_file.find("@") != std::string::npos);
+  auto save_builder = [&]() {
+    std::string filename = out_file;
+    boost::replace_all(filename, "@", std::to_string(builder_label));
+    LOG << " chromosome " << builder_label << ": " << builder->num_ld_r() << " LD values above r2_min";
+    builder->save(filename);
+    builder.reset();
+    chr_saved[builder_label] = 1;
+  };
+
+  int64_t lines_not_match = 0, undefined_r2 = 0, pairs_across_chromosomes = 0, pairs_of_same_snp = 0;
+  std::shared_ptr<std::istream> in_ptr = open_file(plink_ld_file);
+  if (!*in_ptr) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open " + plink_ld_file));
+  LineTokenizer tokenizer(*in_ptr);
+
+  //  CHR_A         BP_A        SNP_A  CHR_B         BP_B        SNP_B           R2
+  //    22     16051249   rs62224609     22     16052962  rs376238049     0.774859
+  // Lines are tokenized sequentially, a batch at a time; then the batch is matched to the reference in parallel.
+  StringColumn snp_a, snp_b, r2_field;
+  std::vector<int> line_no;
+  std::vector<int> snp_a_index, snp_b_index;
+  std::vector<float> r2_value;
+  for (bool eof = false; !eof; ) {
+    snp_a.clear(); snp_b.clear(); r2_field.clear(); line_no.clear();
+    while (line_no.size() < PLINK_LD_LINES_PER_BATCH) {
+      if (!tokenizer.next_line()) { eof = true; break; }
+      if (tokenizer.line_no() == 1) continue;  // skip header
+      if (tokenizer.num_fields() < 7) {
+        std::stringstream ss; ss << "Error parsing " << plink_ld_file << ":" << tokenizer.line_no() << " ('" << tokenizer.line() << "')";
+        BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+      }
+      snp_a.push_back(tokenizer.field(2));
+      snp_b.push_back(tokenizer.field(5));
+      r2_field.push_back(tokenizer.field(6));
+      line_no.push_back(tokenizer.line_no());
+    }
+
+    const int num_lines = line_no.size();
+    snp_a_index.resize(num_lines); snp_b_index.resize(num_lines); r2_value.resize(num_lines);
+    int error_line_no = INT_MAX;
+#pragma omp parallel for schedule(static) reduction(min: error_line_no)
+    for (int i = 0; i < num_lines; i++) {
+      snp_a_index[i] = bim_file.snp_index(snp_a.c_str(i));
+      snp_b_index[i] = bim_file.snp_index(snp_b.c_str(i));
+      if (!parse_float(r2_field.c_str(i), &r2_value[i])) error_line_no = std::min(error_line_no, line_no[i]);
+    }
+    if (error_line_no != INT_MAX) {
+      std::stringstream ss; ss << "Error parsing " << plink_ld_file << ":" << error_line_no << " (invalid R2 value)";
+      BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+    }
+
+    for (int i = 0; i < num_lines; i++) {
+      const int snp_index = std::min(snp_a_index[i], snp_b_index[i]), snp_jndex = std::max(snp_a_index[i], snp_b_index[i]);
+      if (snp_index < 0) { lines_not_match++; continue; }
+      if (!std::isfinite(r2_value[i])) { undefined_r2++; continue; }
+      if (snp_index == snp_jndex) { pairs_of_same_snp++; continue; }
+      const int label = chr_label[snp_index];
+      if (chr_label[snp_jndex] != label) { pairs_across_chromosomes++; continue; }
+
+      if (label != builder_label) {
+        if (chr_saved[label]) {
+          std::stringstream ss; ss << "Error parsing " << plink_ld_file << ":" << line_no[i] << " (LD values of chromosome " << label
+                                   << " follow another chromosome, but plink .ld file must be grouped by chromosome)";
+          BGMG_THROW_EXCEPTION(::std::runtime_error(ss.str()));
+        }
+        if (builder != nullptr) {
+          if (!out_file_per_chr) BGMG_THROW_EXCEPTION(::std::runtime_error(plink_ld_file + " covers several chromosomes, output file name must contain @ to be replaced with chromosome label"));
+          save_builder();
+        }
+        builder_label = label;
+        std::vector<float> hvec(chr_snp_to[label] - chr_snp_from[label], 0.0f);
+        if (!mafvec.empty()) for (int k = 0; k < hvec.size(); k++) hvec[k] = 2.0f * mafvec[chr_snp_from[label] + k] * (1.0f - mafvec[chr_snp_from[label] + k]);
+        builder.reset(new PlinkLdCsrBuilder(hvec, r2_min));
+      }
+      builder->add(snp_index - chr_snp_from[label], snp_jndex - chr_snp_from[label], std::max(0.0f, std::min(1.0f, r2_value[i])));
+    }
+  }
+
+  LOG << " Parsed " << tokenizer.line_no() << " lines from " << plink_ld_file;
+  if (lines_not_match > 0) LOG << " [WARNING] " << lines_not_match << " lines ignored because SNP rs# were not found in the reference";
+  if (undefined_r2 > 0) LOG << " [WARNING] " << undefined_r2 << " lines ignored because R2 value was not defined";
+  if (pairs_of_same_snp > 0) LOG << " [WARNING] " << pairs_of_same_snp << " lines ignored because SNP_A and SNP_B refer to the same variant";
+  if (pairs_across_chromosomes > 0) LOG << " [WARNING] " << pairs_across_chromosomes << " lines ignored because SNP_A and SNP_B are on different chromosomes";
+
+  if (builder == nullptr) BGMG_THROW_EXCEPTION(::std::runtime_error("no LD values in " + plink_ld_file + " match the reference"));
+  save_builder();
+
+  LOG << "<convert_plink_ld_to_ld_matrix(plink_ld_file=" << plink_ld_file << "), elapsed time " << timer.elapsed_ms() << "ms";
 }
 
 // reader must know the type
@@ -152,8 +594,10 @@ void save_vector(std::ofstream& os, const std::vector<T>& vec) {
 }
 
 template<typename T>
-void save_value(std::ofstream& os, T value) {
-  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+void save_vector(std::ofstream& os, const LdVector<T>& vec) {
+  size_t numel = vec.size();
+  os.write(reinterpret_cast<const char*>(&numel), sizeof(size_t));
+  os.write(reinterpret_cast<const char*>(vec.data()), numel * sizeof(T));
 }
 
 template<typename T>
@@ -164,11 +608,76 @@ void load_vector(std::ifstream& is, std::vector<T>* vec) {
   is.read(reinterpret_cast<char*>(&(*vec)[0]), numel * sizeof(T));
 }
 
+template<typename T>
+void load_vector(std::ifstream& is, LdVector<T>* vec) {
+  size_t numel;
+  is.read(reinterpret_cast<char*>(&numel), sizeof(size_t));
+  vec->resize(numel);
+  is.read(reinterpret_cast<char*>(vec->data()), numel * sizeof(T));
+}
+
 template<typename T>
 void load_value(std::ifstream& is, T* value) {
   is.read(reinterpret_cast<char*>(value), sizeof(T));
 }
 
+// Format version 3:
+//   header: format version, snp_index_from_inclusive_, snp_index_to_exclusive_
+//   blocks of LD_MATRIX_SNPS_PER_BLOCK rows, each compressed with zlib on its own
+//   index: snps per block, number of blocks, and an LdMatrixBlock entry for each block
+//   ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec, ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec
+//   offset of the index (the last 8 bytes of the file)
+// An uncompressed block holds the number of LD r values and the number of packed tag index bytes for each row (both uint64_t),
+// followed by the packed tag indices and the LD r values of the block. Any range of rows can be read by decompressing only the blocks that cover it.
+struct LdMatrixBlock {
+  uint64_t file_offset;
+  uint64_t compressed_bytes;
+  uint64_t num_ld_r;      // number of LD r values in the block
+  uint64_t packed_bytes;  // number of packed tag index bytes in the block
+  uint32_t crc;           // crc32 of the compressed block
+};
+
+struct LdMatrixIndex {
+  int snp_index_from_inclusive;
+  int snp_index_to_exclusive;
+  int snps_per_block;
+  std::vector<LdMatrixBlock> blocks;
+
+  int num_snps() const { return snp_index_to_exclusive - snp_index_from_inclusive; }
+  int block_rows(int block_index) const { return std::min(snps_per_block, num_snps() - block_index * snps_per_block); }
+  uint64_t uncompressed_bytes(int block_index) const {
+    return 2 * sizeof(uint64_t) * block_rows(block_index) + blocks[block_index].packed_bytes + blocks[block_index].num_ld_r * sizeof(packed_r_value);
+  }
+};
+
+static void compress_ld_matrix_block(const LdMatrixCsrChunk& chunk, const LdMatrixIndex& index, int block_index, std::vector<unsigned char>* compressed, LdMatrixBlock* block) {
+  const int row_from = block_index * index.snps_per_block;
+  const int row_to = row_from + index.block_rows(block_index);
+  block->num_ld_r = chunk.csr_ld_snp_index_[row_to] - chunk.csr_ld_snp_index_[row_from];
+  block->packed_bytes = chunk.csr_ld_tag_index_offset_[row_to] - chunk.csr_ld_tag_index_offset_[row_from];
+
+  std::vector<unsigned char> payload(index.uncompressed_bytes(block_index));
+  unsigned char* pos = payload.data();
+  for (int row = row_from; row < row_to; row++, pos += sizeof(uint64_t)) {
+    const uint64_t num_ld_r = chunk.csr_ld_snp_index_[row + 1] - chunk.csr_ld_snp_index_[row];
+    memcpy(pos, &num_ld_r, sizeof(uint64_t));
+  }
+  for (int row = row_from; row < row_to; row++, pos += sizeof(uint64_t)) {
+    const uint64_t packed_bytes = chunk.csr_ld_tag_index_offset_[row + 1] - chunk.csr_ld_tag_index_offset_[row];
+    memcpy(pos, &packed_bytes, sizeof(uint64_t));
+  }
+  if (block->packed_bytes > 0) memcpy(pos, &chunk.csr_ld_tag_index_packed_[chunk.csr_ld_tag_index_offset_[row_from]], block->packed_bytes);
+  pos += block->packed_bytes;
+  if (block->num_ld_r > 0) memcpy(pos, &chunk.csr_ld_r_[chunk.csr_ld_snp_index_[row_from]], block->num_ld_r * sizeof(packed_r_value));
+
+  uLongf compressed_bytes = compressBound(payload.size());
+  compressed->resize(compressed_bytes);
+  if (compress2(compressed->data(), &compressed_bytes, payload.data(), payload.size(), Z_DEFAULT_COMPRESSION) != Z_OK) compressed_bytes = 0;
+  compressed->resize(compressed_bytes);
+  block->compressed_bytes = compressed_bytes;
+  block->crc = crc32(0L, compressed->data(), compressed_bytes);
+}
+
 void save_ld_matrix(const LdMatrixCsrChunk& chunk,
                     const std::vector<float>& ld_tag_r2_sum,
                     const std::vector<float>& ld_tag_r2_sum_adjust_for_hvec,
@@ -178,27 +687,180 @@ void save_ld_matrix(const LdMatrixCsrChunk& chunk,
   std::ofstream os(filename, std::ofstream::binary);
   if (!os) BGMG_THROW_EXCEPTION(std::runtime_error(::std::runtime_error("can't open" + filename)));
 
+#pragma omp critical(bgmg_log)
   LOG << ">save_ld_matrix(filename=" << filename << "), format version " << LD_MATRIX_FORMAT_VERSION;
+  if (chunk.ld_r_codec_ != LdRCodec_Uint16_R) BGMG_THROW_EXCEPTION(::std::runtime_error("save_ld_matrix supports only ld_r_codec=0"));
+  SimpleTimer timer(-1);
 
   size_t format_version = LD_MATRIX_FORMAT_VERSION;
   os.write(reinterpret_cast<const char*>(&format_version), sizeof(format_version));
 
   save_value(os, chunk.snp_index_from_inclusive_);
   save_value(os, chunk.snp_index_to_exclusive_);
-  save_vector(os, chunk.csr_ld_snp_index_);
-  save_vector(os, chunk.csr_ld_tag_index_offset_);
-  save_vector(os, chunk.csr_ld_tag_index_packed_);
-  save_vector(os, chunk.csr_ld_r_);
+
+  LdMatrixIndex index;
+  index.snp_index_from_inclusive = chunk.snp_index_from_inclusive_;
+  index.snp_index_to_exclusive = chunk.snp_index_to_exclusive_;
+  index.snps_per_block = LD_MATRIX_SNPS_PER_BLOCK;
+  const int num_blocks = (index.num_snps() + index.snps_per_block - 1) / index.snps_per_block;
+  index.blocks.resize(num_blocks);
+
+  // blocks are compressed in parallel, one batch at a time, and written in order
+  std::vector<std::vector<unsigned char>> compressed(LD_MATRIX_BLOCKS_PER_BATCH);
+  for (int batch_from = 0; batch_from < num_blocks; batch_from += LD_MATRIX_BLOCKS_PER_BATCH) {
+    const int batch_to = std::min(num_blocks, batch_from + LD_MATRIX_BLOCKS_PER_BATCH);
+#pragma omp parallel for schedule(dynamic)
+    for (int block_index = batch_from; block_index < batch_to; block_index++)
+      compress_ld_matrix_block(chunk, index, block_index, &compressed[block_index - batch_from], &index.blocks[block_index]);
+
+    for (int block_index = batch_from; block_index < batch_to; block_index++) {
+      if (index.blocks[block_index].compressed_bytes == 0) BGMG_THROW_EXCEPTION(::std::runtime_error("can't compress LD matrix block"));
+      index.blocks[block_index].file_offset = os.tellp();
+      os.write(reinterpret_cast<const char*>(compressed[block_index - batch_from].data()), index.blocks[block_index].compressed_bytes);
+    }
+  }
+
+  const uint64_t index_offset = os.tellp();
+  save_value(os, static_cast<uint64_t>(index.snps_per_block));
+  save_value(os, static_cast<uint64_t>(num_blocks));
+  for (const LdMatrixBlock& block : index.blocks) {
+    save_value(os, block.file_offset);
+    save_value(os, block.compressed_bytes);
+    save_value(os, block.num_ld_r);
+    save_value(os, block.packed_bytes);
+    save_value(os, block.crc);
+  }
 
   save_vector(os, ld_tag_r2_sum);
   save_vector(os, ld_tag_r2_sum_adjust_for_hvec);
+  save_vector(os, ld_tag_r4_sum);
+  save_vector(os, ld_tag_r4_sum_adjust_for_hvec);
+  save_value(os, index_offset);
 
-  save_vector(os, ld_tag_r4_sum);  // format version >= 2
-  save_vector(os, ld_tag_r4_sum_adjust_for_hvec);  // format version >= 2
-
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
   os.close();
 
-  LOG << "<save_ld_matrix(filename=" << filename << ")...";
+#pragma omp critical(bgmg_log)
+  LOG << "<save_ld_matrix(filename=" << filename << "), " << num_blocks << " blocks, elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+// reads the index of a file in format version 3; the stream must be positioned right after the header.
+// On return the stream is positioned at ld_tag_r2_sum.
+static void read_ld_matrix_index(std::ifstream& is, const std::string& filename, LdMatrixIndex* index) {
+  load_value(is, &index->snp_index_from_inclusive);
+  load_value(is, &index->snp_index_to_exclusive);
+
+  uint64_t index_offset, snps_per_block, num_blocks;
+  is.seekg(-static_cast<std::streamoff>(sizeof(uint64_t)), std::ios_base::end);
+  load_value(is, &index_offset);
+  is.seekg(index_offset);
+  load_value(is, &snps_per_block);
+  load_value(is, &num_blocks);
+  if (!is || (snps_per_block == 0) || (index->num_snps() < 0) || (num_blocks != (index->num_snps() + snps_per_block - 1) / snps_per_block))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("invalid index of LD matrix blocks in " + filename));
+  index->snps_per_block = snps_per_block;
+  index->blocks.resize(num_blocks);
+  for (LdMatrixBlock& block : index->blocks) {
+    load_value(is, &block.file_offset);
+    load_value(is, &block.compressed_bytes);
+    load_value(is, &block.num_ld_r);
+    load_value(is, &block.packed_bytes);
+    load_value(is, &block.crc);
+  }
+  if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename));
+}
+
+// Reads rows [snp_index_from, snp_index_to) into the chunk. Only the blocks covering the rows are read;
+// they are decompressed in parallel, and then copied into CSR arrays of the chunk, also in parallel.
+static void load_ld_matrix_blocks(std::ifstream& is, const std::string& filename, const LdMatrixIndex& index, int snp_index_from, int snp_index_to, LdMatrixCsrChunk* chunk) {
+  const int row_from = snp_index_from - index.snp_index_from_inclusive;
+  const int row_to = snp_index_to - index.snp_index_from_inclusive;
+  const int num_rows = row_to - row_from;
+  chunk->snp_index_from_inclusive_ = snp_index_from;
+  chunk->snp_index_to_exclusive_ = snp_index_to;
+  chunk->csr_ld_snp_index_.resize(num_rows + 1);
+  chunk->csr_ld_tag_index_offset_.resize(num_rows + 1);
+  chunk->csr_ld_snp_index_[0] = 0;
+  chunk->csr_ld_tag_index_offset_[0] = 0;
+  if (num_rows == 0) { chunk->csr_ld_tag_index_packed_.clear(); chunk->csr_ld_r_.clear(); return; }
+
+  // compressed blocks are adjacent in the file, so they are read at once
+  const int block_from = row_from / index.snps_per_block;
+  const int block_to = (row_to - 1) / index.snps_per_block + 1;
+  const uint64_t offset0 = index.blocks[block_from].file_offset;
+  std::vector<unsigned char> compressed(index.blocks[block_to - 1].file_offset + index.blocks[block_to - 1].compressed_bytes - offset0);
+  is.seekg(offset0);
+  is.read(reinterpret_cast<char*>(compressed.data()), compressed.size());
+  if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename));
+
+  std::vector<std::vector<unsigned char>> payload(block_to - block_from);
+  int num_failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+: num_failed)
+  for (int block_index = block_from; block_index < block_to; block_index++) {
+    const LdMatrixBlock& block = index.blocks[block_index];
+    const unsigned char* src = &compressed[block.file_offset - offset0];
+    if (crc32(0L, src, block.compressed_bytes) != block.crc) { num_failed++; continue; }
+    std::vector<unsigned char>& dst = payload[block_index - block_from];
+    dst.resize(index.uncompressed_bytes(block_index));
+    uLongf dst_bytes = dst.size();
+    if ((uncompress(dst.data(), &dst_bytes, src, block.compressed_bytes) != Z_OK) || (dst_bytes != dst.size())) num_failed++;
+  }
+  if (num_failed > 0) BGMG_THROW_EXCEPTION(::std::runtime_error("corrupted LD matrix block in " + filename));
+  std::vector<unsigned char>().swap(compressed);
+
+  for (int row = row_from; row < row_to; row++) {
+    const int block_index = row / index.snps_per_block;
+    const int k = row - block_index * index.snps_per_block;
+    const unsigned char* p = payload[block_index - block_from].data();
+    uint64_t num_ld_r, packed_bytes;
+    memcpy(&num_ld_r, p + k * sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&packed_bytes, p + (index.block_rows(block_index) + k) * sizeof(uint64_t), sizeof(uint64_t));
+    chunk->csr_ld_snp_index_[row - row_from + 1] = chunk->csr_ld_snp_index_[row - row_from] + num_ld_r;
+    chunk->csr_ld_tag_index_offset_[row - row_from + 1] = chunk->csr_ld_tag_index_offset_[row - row_from] + packed_bytes;
+  }
+  chunk->csr_ld_tag_index_packed_.resize(chunk->csr_ld_tag_index_offset_[num_rows]);
+  chunk->csr_ld_r_.resize(chunk->csr_ld_snp_index_[num_rows]);
+
+#pragma omp parallel for schedule(dynamic)
+  for (int block_index = block_from; block_index < block_to; block_index++) {
+    const int block_row0 = block_index * index.snps_per_block;
+    const int r0 = std::max(row_from, block_row0) - row_from;
+    const int r1 = std::min(row_to, block_row0 + index.block_rows(block_index)) - row_from;
+    const unsigned char* p = payload[block_index - block_from].data();
+    // skip rows of the block that precede the requested range
+    uint64_t skip_ld_r = 0, skip_packed_bytes = 0;
+    for (int k = 0; k < (r0 + row_from - block_row0); k++) {
+      uint64_t value;
+      memcpy(&value, p + k * sizeof(uint64_t), sizeof(uint64_t)); skip_ld_r += value;
+      memcpy(&value, p + (index.block_rows(block_index) + k) * sizeof(uint64_t), sizeof(uint64_t)); skip_packed_bytes += value;
+    }
+    const unsigned char* packed_src = p + 2 * sizeof(uint64_t) * index.block_rows(block_index) + skip_packed_bytes;
+    const unsigned char* r_src = p + 2 * sizeof(uint64_t) * index.block_rows(block_index) + index.blocks[block_index].packed_bytes + skip_ld_r * sizeof(packed_r_value);
+    const uint64_t packed_bytes = chunk->csr_ld_tag_index_offset_[r1] - chunk->csr_ld_tag_index_offset_[r0];
+    const uint64_t num_ld_r = chunk->csr_ld_snp_index_[r1] - chunk->csr_ld_snp_index_[r0];
+    if (packed_bytes > 0) memcpy(&chunk->csr_ld_tag_index_packed_[chunk->csr_ld_tag_index_offset_[r0]], packed_src, packed_bytes);
+    if (num_ld_r > 0) memcpy(&chunk->csr_ld_r_[chunk->csr_ld_snp_index_[r0]], r_src, num_ld_r * sizeof(packed_r_value));
+  }
+}
+
+void load_ld_matrix_snp_range(std::string filename, int snp_index_from, int snp_index_to, LdMatrixCsrChunk* chunk) {
+  LOG << ">load_ld_matrix_snp_range(filename=" << filename << ", snp_index_from=" << snp_index_from << ", snp_index_to=" << snp_index_to << ")";
+  SimpleTimer timer(-1);
+
+  std::ifstream is(filename, std::ifstream::binary);
+  if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open" + filename));
+
+  size_t format_version;
+  load_value(is, &format_version);
+  if (!is || format_version < 3 || format_version > LD_MATRIX_FORMAT_VERSION) BGMG_THROW_EXCEPTION(::std::runtime_error("load_ld_matrix_snp_range requires LD matrix file in format version 3: " + filename));
+
+  LdMatrixIndex index;
+  read_ld_matrix_index(is, filename, &index);
+  if (snp_index_from < index.snp_index_from_inclusive || snp_index_to > index.snp_index_to_exclusive || snp_index_from > snp_index_to)
+    BGMG_THROW_EXCEPTION(::std::runtime_error("snp range is outside of LD matrix in " + filename));
+  load_ld_matrix_blocks(is, filename, index, snp_index_from, snp_index_to, chunk);
+
+  LOG << "<load_ld_matrix_snp_range(filename=" << filename << "), nnz=" << chunk->num_ld_r() << ", elapsed time " << timer.elapsed_ms() << " ms";
 }
 
 // load LD matrix from an old format
@@ -245,6 +907,19 @@ void load_ld_matrix(std::string filename,
   is.read(reinterpret_cast<char*>(&format_version), sizeof(size_t));
   if (format_version <= 0 || format_version > LD_MATRIX_FORMAT_VERSION) throw("Unable to read an old format version");
 
+  if (format_version >= 3) {
+    LdMatrixIndex index;
+    read_ld_matrix_index(is, filename, &index);
+    load_vector(is, ld_tag_r2_sum);
+    load_vector(is, ld_tag_r2_sum_adjust_for_hvec);
+    load_vector(is, ld_tag_r4_sum);
+    load_vector(is, ld_tag_r4_sum_adjust_for_hvec);
+    if (!is) BGMG_THROW_EXCEPTION(::std::runtime_error("can't read from " + filename));
+    load_ld_matrix_blocks(is, filename, index, index.snp_index_from_inclusive, index.snp_index_to_exclusive, chunk);
+    LOG << "<load_ld_matrix(filename=" << filename << "), format version " << format_version << ", " << index.blocks.size() << " blocks";
+    return;
+  }
+
   load_value(is, &chunk->snp_index_from_inclusive_);
   load_value(is, &chunk->snp_index_to_exclusive_);
   load_vector(is, &chunk->csr_ld_snp_index_);
@@ -265,3 +940,165 @@ void load_ld_matrix(std::string filename,
 
   LOG << "<load_ld_matrix(filename=" << filename << "), format version " << format_version;
 }
+
+
+// tag snps located within a chunk
+static void find_chunk_tags(const LdMatrixCsrChunk& chunk, TagToSnpMapping& mapping, std::vector<int>* chunk_tags) {
+  chunk_tags->clear();
+  for (int tag_index = 0; tag_index < mapping.num_tag(); tag_index++) {
+    const int snp_index = mapping.tag_to_snp()[tag_index];
+    if (snp_index >= chunk.snp_index_from_inclusive_ && snp_index < chunk.snp_index_to_exclusive_) chunk_tags->push_back(tag_index);
+  }
+}
+
+bool is_ld_matrix_mapped(std::string filename) {
+  std::ifstream is(filename, std::ifstream::binary);
+  if (!is) return false;
+  uint64_t magic = 0;
+  is.read(reinterpret_cast<char*>(&magic), sizeof(uint64_t));
+  return is && (magic == LD_MATRIX_MAPPED_MAGIC);
+}
+
+void save_ld_matrix_mapped(const LdMatrixCsrChunk& chunk,
+                           TagToSnpMapping& mapping,
+                           float r2_min,
+                           const LdTagSum& ld_tag_sum,
+                           const LdTagSum& ld_tag_sum_adjust_for_hvec,
+                           std::string filename) {
+  std::ofstream os(filename, std::ofstream::binary);
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't open" + filename));
+
+  LOG << ">save_ld_matrix_mapped(filename=" << filename << ", chr_label=" << chunk.chr_label_ << "), format version " << LD_MATRIX_MAPPED_FORMAT_VERSION;
+
+  std::vector<int> chunk_tags;
+  find_chunk_tags(chunk, mapping, &chunk_tags);
+
+  save_value(os, static_cast<uint64_t>(LD_MATRIX_MAPPED_MAGIC));
+  save_value(os, static_cast<uint64_t>(LD_MATRIX_MAPPED_FORMAT_VERSION));
+  save_value(os, static_cast<int32_t>(chunk.chr_label_));
+  save_value(os, static_cast<int32_t>(chunk.snp_index_from_inclusive_));
+  save_value(os, static_cast<int32_t>(chunk.snp_index_to_exclusive_));
+  save_value(os, static_cast<int32_t>(mapping.num_snp()));
+  save_value(os, static_cast<int32_t>(mapping.num_tag()));
+  save_value(os, r2_min);
+  save_value(os, static_cast<int32_t>(chunk.ld_r_codec_));
+
+  save_aligned_vector(os, mapping.tag_to_snp().data(), mapping.tag_to_snp().size());
+  save_aligned_vector(os, mapping.mafvec().data() + chunk.snp_index_from_inclusive_, chunk.num_snps_in_chunk());
+
+  save_aligned_vector(os, chunk.csr_ld_snp_index_.data(), chunk.csr_ld_snp_index_.size());
+  save_aligned_vector(os, chunk.csr_ld_tag_index_offset_.data(), chunk.csr_ld_tag_index_offset_.size());
+  save_aligned_vector(os, chunk.csr_ld_tag_index_packed_.data(), chunk.csr_ld_tag_index_packed_.size());
+  if (chunk.ld_r_codec_ == LdRCodec_Uint16_R) save_aligned_vector(os, chunk.csr_ld_r_.data(), chunk.csr_ld_r_.size());
+  else save_aligned_vector(os, chunk.csr_ld_r_packed_.data(), chunk.csr_ld_r_packed_.size());
+
+  // ld_tag_sum for each component (including the total), restricted to tag snps of this chunk
+  save_aligned_vector(os, chunk_tags.data(), chunk_tags.size());
+  std::vector<float> values(chunk_tags.size(), 0.0f);
+  for (const LdTagSum* sum : { &ld_tag_sum, &ld_tag_sum_adjust_for_hvec }) {
+    for (int ld_component = 0; ld_component <= LD_TAG_COMPONENT_COUNT; ld_component++) {
+      for (int i = 0; i < chunk_tags.size(); i++) values[i] = sum->ld_tag_sum_r2(ld_component)[chunk_tags[i]];
+      save_aligned_vector(os, values.data(), values.size());
+      for (int i = 0; i < chunk_tags.size(); i++) values[i] = sum->ld_tag_sum_r4(ld_component)[chunk_tags[i]];
+      save_aligned_vector(os, values.data(), values.size());
+    }
+  }
+
+  if (!os) BGMG_THROW_EXCEPTION(::std::runtime_error("can't write to " + filename));
+  os.close();
+
+  LOG << "<save_ld_matrix_mapped(filename=" << filename << ")...";
+}
+
+struct MappedHeader {
+  uint64_t format_version;
+  int32_t num_snp;
+  int32_t num_tag;
+  float r2_min;
+};
+
+// read and validate header of a memory-mapped LD file against the chunk (chr_label and snp range); sets chunk->ld_r_codec_
+static MappedHeader read_mapped_header(MappedReader& reader, LdMatrixCsrChunk* chunk) {
+  const std::string& filename = reader.filename();
+  MappedHeader header;
+  if (reader.value<uint64_t>() != LD_MATRIX_MAPPED_MAGIC) BGMG_THROW_EXCEPTION(::std::runtime_error(filename + " is not a memory-mapped LD matrix file"));
+  header.format_version = reader.value<uint64_t>();
+  if (header.format_version < 1 || header.format_version > LD_MATRIX_MAPPED_FORMAT_VERSION) BGMG_THROW_EXCEPTION(::std::runtime_error("unsupported format version of " + filename));
+
+  if (reader.value<int32_t>() != chunk->chr_label_) BGMG_THROW_EXCEPTION(::std::runtime_error("chr_label in " + filename + " does not match"));
+  if (reader.value<int32_t>() != chunk->snp_index_from_inclusive_) BGMG_THROW_EXCEPTION(::std::runtime_error("snp_index_from_inclusive in " + filename + " does not match reference"));
+  if (reader.value<int32_t>() != chunk->snp_index_to_exclusive_) BGMG_THROW_EXCEPTION(::std::runtime_error("snp_index_to_exclusive in " + filename + " does not match reference"));
+  header.num_snp = reader.value<int32_t>();
+  header.num_tag = reader.value<int32_t>();
+  header.r2_min = reader.value<float>();
+  const int32_t ld_r_codec = (header.format_version >= 2) ? reader.value<int32_t>() : LdRCodec_Uint16_R;
+  if (ld_r_codec < LdRCodec_Uint16_R || ld_r_codec > LdRCodec_Fp16_R) BGMG_THROW_EXCEPTION(::std::runtime_error("unknown ld_r_codec in " + filename));
+  chunk->ld_r_codec_ = static_cast<LdRCodec>(ld_r_codec);
+  return header;
+}
+
+// read CSR arrays as views on the mapped file
+static void read_mapped_csr(MappedReader& reader, LdMatrixCsrChunk* chunk) {
+  reader.vector(&chunk->csr_ld_snp_index_);
+  reader.vector(&chunk->csr_ld_tag_index_offset_);
+  reader.vector(&chunk->csr_ld_tag_index_packed_);
+  if (chunk->ld_r_codec_ == LdRCodec_Uint16_R) reader.vector(&chunk->csr_ld_r_);
+  else reader.vector(&chunk->csr_ld_r_packed_);
+  const size_t ld_r_bytes = (chunk->ld_r_codec_ == LdRCodec_Uint16_R) ? (chunk->csr_ld_r_.size() * sizeof(packed_r_value)) : chunk->csr_ld_r_packed_.size();
+  if ((chunk->csr_ld_snp_index_.size() != (chunk->num_snps_in_chunk() + 1)) ||
+      (chunk->csr_ld_tag_index_offset_.size() != (chunk->num_snps_in_chunk() + 1)) ||
+      (chunk->csr_ld_snp_index_.back() * ld_r_codec_bytes(chunk->ld_r_codec_) != ld_r_bytes) ||
+      (chunk->csr_ld_tag_index_offset_.back() != chunk->csr_ld_tag_index_packed_.size()))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent CSR structure in " + reader.filename()));
+}
+
+void load_ld_matrix_mapped(std::string filename,
+                           TagToSnpMapping& mapping,
+                           float r2_min,
+                           LdMatrixCsrChunk* chunk,
+                           LdTagSum* ld_tag_sum,
+                           LdTagSum* ld_tag_sum_adjust_for_hvec) {
+  LOG << ">load_ld_matrix_mapped(filename=" << filename << ")";
+
+  // validate that the file matches current reference and tag indices
+  MappedReader reader(filename);
+  const MappedHeader header = read_mapped_header(reader, chunk);
+  if (header.num_snp != mapping.num_snp()) BGMG_THROW_EXCEPTION(::std::runtime_error("num_snp in " + filename + " does not match reference"));
+  if (header.num_tag != mapping.num_tag()) BGMG_THROW_EXCEPTION(::std::runtime_error("num_tag in " + filename + " does not match tag indices"));
+  if (header.r2_min != r2_min) BGMG_THROW_EXCEPTION(::std::runtime_error("r2min in " + filename + " does not match r2min option"));
+
+  std::vector<int> tag_to_snp;
+  std::vector<float> mafvec;
+  reader.vector(&tag_to_snp);
+  reader.vector(&mafvec);
+  if (tag_to_snp != mapping.tag_to_snp()) BGMG_THROW_EXCEPTION(::std::runtime_error("tag indices in " + filename + " does not match"));
+  if (!std::equal(mafvec.begin(), mafvec.end(), mapping.mafvec().begin() + chunk->snp_index_from_inclusive_) || (mafvec.size() != chunk->num_snps_in_chunk()))
+    BGMG_THROW_EXCEPTION(::std::runtime_error("mafvec in " + filename + " does not match"));
+
+  read_mapped_csr(reader, chunk);
+
+  std::vector<int> chunk_tags, chunk_tags_expected;
+  find_chunk_tags(*chunk, mapping, &chunk_tags_expected);
+  reader.vector(&chunk_tags);
+  if (chunk_tags != chunk_tags_expected) BGMG_THROW_EXCEPTION(::std::runtime_error("tag indices in " + filename + " does not match"));
+
+  std::vector<float> r2_sum, r4_sum;
+  for (LdTagSum* sum : { ld_tag_sum, ld_tag_sum_adjust_for_hvec }) {
+    for (int ld_component = 0; ld_component <= LD_TAG_COMPONENT_COUNT; ld_component++) {
+      reader.vector(&r2_sum);
+      reader.vector(&r4_sum);
+      if ((r2_sum.size() != chunk_tags.size()) || (r4_sum.size() != chunk_tags.size())) BGMG_THROW_EXCEPTION(::std::runtime_error("inconsistent ld_tag_sum in " + filename));
+      for (int i = 0; i < chunk_tags.size(); i++) sum->assign(ld_component, chunk_tags[i], r2_sum[i], r4_sum[i]);
+    }
+  }
+
+  LOG << "<load_ld_matrix_mapped(filename=" << filename << "), nnz=" << chunk->num_ld_r() << ", ld_r_codec=" << chunk->ld_r_codec_;
+}
+
+void load_ld_matrix_mapped_csr(std::string filename, LdMatrixCsrChunk* chunk) {
+  MappedReader reader(filename);
+  read_mapped_header(reader, chunk);
+  reader.skip_vector<int>();    // tag_to_snp
+  reader.skip_vector<float>();  // mafvec
+  read_mapped_csr(reader, chunk);
+}
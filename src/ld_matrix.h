@@ -23,7 +23,29 @@
 
 #include "ld_matrix_csr.h"
 
-void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, float r2min, std::string out_file);
+class BimFile;
+
+// ld_window (number of SNPs), ld_window_kb and ld_window_cm restrict LD computation to pairs of SNPs
+// on the same chromosome that are within the given distance; zero value disables the corresponding limit.
+// Windowed computation requires .bim file to be sorted by chromosome and position.
+void generate_ld_matrix_from_bed_file(std::string bfile, std::string frqfile, float r2min, std::string out_file,
+                                      int ld_window = 0, float ld_window_kb = 0.0f, float ld_window_cm = 0.0f);
+
+// Same as generate_ld_matrix_from_bed_file, but writes one LD file per chromosome, replacing @ in out_file with chromosome label.
+// SNP indices in each file are relative to the chromosome, as expected by set_ld_r2_coo_from_file.
+// bfile and frqfile either contain @ (one set of files per chromosome), or are genome-wide (SNPs of each chromosome must be contiguous).
+// chr_labels is a comma-separated list of chromosome labels, defaults to 1..22. Chromosomes are processed concurrently.
+void generate_ld_matrix_from_bed_file_per_chr(std::string bfile, std::string frqfile, std::string chr_labels, float r2min, std::string out_file,
+                                              int ld_window = 0, float ld_window_kb = 0.0f, float ld_window_cm = 0.0f);
+
+// Converts plink .ld file (output of plink --r2, optionally gzipped) into LD matrix files of the current format (see save_ld_matrix),
+// one file per chromosome, replacing @ in out_file with chromosome label; without @ all pairs must be on one chromosome.
+// SNP indices in each file are relative to the chromosome, as expected by set_ld_r2_coo_from_file; bim_file must have SNPs of each chromosome contiguous.
+// LD r values are square roots of plink's r2 (the sign is not available). Pairs with r2 below r2_min contribute to LD score sums (ld_tag_r2_sum, etc.)
+// instead of CSR structure; mafvec (optional, all zeros if empty) gives heterozygosity for the sums adjusted for hvec.
+// The file is parsed as a stream, one chromosome at a time: pairs must be grouped by chromosome (as in plink output, sorted by CHR_A),
+// and each chromosome is saved as soon as the next one starts, so only one chromosome's LD is held in memory.
+void convert_plink_ld_to_ld_matrix(std::string plink_ld_file, const BimFile& bim_file, const std::vector<float>& mafvec, float r2_min, std::string out_file);
 
 void save_ld_matrix(const LdMatrixCsrChunk& chunk,
                     const std::vector<float>& ld_tag_r2_sum,
@@ -39,6 +61,35 @@ void load_ld_matrix(std::string filename,
                     std::vector<float>* ld_tag_r4_sum,
                     std::vector<float>* ld_tag_r4_sum_adjust_for_hvec);
 
+// Reads rows [snp_index_from, snp_index_to) of an LD matrix file saved by save_ld_matrix (format version 3 and above),
+// decompressing only the blocks that cover the range. The chunk covers exactly the requested snps; tag indices are the same as in the file.
+void load_ld_matrix_snp_range(std::string filename, int snp_index_from, int snp_index_to, LdMatrixCsrChunk* chunk);
+
+// Memory-mapped format for a finalized LdMatrixCsrChunk (e.i. after set_ld_r2_csr, with tag indices and r2min already applied).
+// All arrays are 64-byte aligned, so that load_ld_matrix_mapped() can turn chunk->csr_ld_* vectors into views on read-only mapped pages.
+// The pages are then shared, via page cache, across all processes (and contexts) that load the same file.
+// The file is only valid for the exact set of tag snps, mafvec and r2min it was saved with; this is validated on load.
+// LD r values are stored with the ld_r_codec of the chunk, recorded in the header; on load it takes precedence over the ld_r_codec option.
+bool is_ld_matrix_mapped(std::string filename);
+
+void save_ld_matrix_mapped(const LdMatrixCsrChunk& chunk,
+                           TagToSnpMapping& mapping,
+                           float r2_min,
+                           const LdTagSum& ld_tag_sum,
+                           const LdTagSum& ld_tag_sum_adjust_for_hvec,
+                           std::string filename);
+
+void load_ld_matrix_mapped(std::string filename,
+                           TagToSnpMapping& mapping,
+                           float r2_min,
+                           LdMatrixCsrChunk* chunk,
+                           LdTagSum* ld_tag_sum,
+                           LdTagSum* ld_tag_sum_adjust_for_hvec);
+
+// re-load CSR arrays of a chunk from a file that has been already validated by load_ld_matrix_mapped (tag indices, mafvec, r2min);
+// used to bring evicted chunks back into memory (see LdMatrixCsr::acquire_chunk).
+void load_ld_matrix_mapped_csr(std::string filename, LdMatrixCsrChunk* chunk);
+
 void load_ld_matrix_version0(std::string filename,
                              std::vector<int>* snp_index,
                              std::vector<int>* tag_index,
@@ -21,6 +21,13 @@
 #include <assert.h>
 #include <algorithm>
 #include <numeric>
+#include <cstring>
+#include <exception>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "TurboPFor/vsimple.h"
 #include "FastDifferentialCoding/fastdelta.h"
@@ -33,6 +40,67 @@
 #define VSDEC_BOUND(n, size) ((n + 32) * (size))
 #define VSDEC_NUMEL(n      ) (n + 32)
 
+// Finalization of the CSR structure runs as a tree of OpenMP tasks: one task per chromosome (LdMatrixCsr::set_ld_r2_csr),
+// and within each chromosome one task per block of rows (parallel_for_blocks).
+// Log statements issued from such tasks must be serialized with #pragma omp critical(bgmg_log).
+#define FINALIZE_ROWS_PER_TASK 4096
+
+template<typename Body>
+static void spawn_blocks(int64_t numel, int64_t block_size, Body* body, std::exception_ptr* error) {
+  for (int64_t from = 0; from < numel; from += block_size) {
+    const int64_t to = std::min(numel, from + block_size);
+#pragma omp task firstprivate(from, to, body, error)
+    {
+      try {
+        (*body)(from, to);
+      } catch (...) {
+#pragma omp critical(spawn_blocks_error)
+        if (*error == nullptr) *error = std::current_exception();
+      }
+    }
+  }
+#pragma omp taskwait
+}
+
+// Calls body(from, to) for consecutive blocks of [0, numel), each block as an OpenMP task.
+// It spawns tasks into the enclosing team if there is one, and otherwise starts its own parallel region.
+// The first exception thrown by any block is re-thrown after all blocks are finished.
+template<typename Body>
+static void parallel_for_blocks(int64_t numel, int64_t block_size, Body body) {
+  if (numel <= block_size) { if (numel > 0) body(0, numel); return; }
+  std::exception_ptr error;
+#ifdef _OPENMP
+  if (omp_get_num_threads() > 1) {
+    spawn_blocks(numel, block_size, &body, &error);
+  } else {
+#pragma omp parallel
+#pragma omp single
+    spawn_blocks(numel, block_size, &body, &error);
+  }
+#else
+  spawn_blocks(numel, block_size, &body, &error);
+#endif
+  if (error != nullptr) std::rethrow_exception(error);
+}
+
+// Sort each row of a CSR structure by tag index (rows that are already sorted are left as is).
+static void sort_csr_rows(const LdVector<int64_t>& csr_ld_snp_index, std::vector<uint32_t>* csr_ld_tag_index, LdVector<packed_r_value>* csr_ld_r) {
+  const int num_snps = csr_ld_snp_index.size() - 1;
+  parallel_for_blocks(num_snps, FINALIZE_ROWS_PER_TASK, [&csr_ld_snp_index, csr_ld_tag_index, csr_ld_r](int64_t from, int64_t to) {
+    uint32_t* tag_index = csr_ld_tag_index->data();
+    packed_r_value* r = csr_ld_r->data();
+    std::vector<std::pair<uint32_t, packed_r_value>> row;
+    for (int64_t i = from; i < to; i++) {
+      const int64_t ld_index_from = csr_ld_snp_index[i], ld_index_to = csr_ld_snp_index[i + 1];
+      if (std::is_sorted(tag_index + ld_index_from, tag_index + ld_index_to)) continue;
+      row.clear();
+      for (int64_t k = ld_index_from; k < ld_index_to; k++) row.push_back(std::make_pair(tag_index[k], r[k]));
+      std::sort(row.begin(), row.end());
+      for (int64_t k = ld_index_from; k < ld_index_to; k++) { tag_index[k] = row[k - ld_index_from].first; r[k] = row[k - ld_index_from].second; }
+    }
+  });
+}
+
 void find_hvec(TagToSnpMapping& mapping, std::vector<float>* hvec) {
   const std::vector<float>& mafvec = mapping.mafvec();
   hvec->resize(mafvec.size(), 0.0f);
@@ -65,11 +133,18 @@ int64_t LdMatrixCsr::set_ld_r2_coo_version0(int chr_label_data, const std::strin
 }
 
 int64_t LdMatrixCsr::set_ld_r2_coo(int chr_label, const std::string& filename, float r2_min) {
+  if (is_ld_matrix_mapped(filename)) return set_ld_r2_csr_from_file(chr_label, filename, r2_min);
+
   LdMatrixCsrChunk chunk;
   std::vector<float> ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec;  // these are ignored for now
   std::vector<float> ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec;  // TBD: append to this->ld_tag_sum_ and this->ld_tag_sum_adjust_for_hvec_)
   load_ld_matrix(filename, &chunk, &ld_tag_r2_sum, &ld_tag_r2_sum_adjust_for_hvec, &ld_tag_r4_sum, &ld_tag_r4_sum_adjust_for_hvec);
 
+  init_chunks();
+  if (chr_label < 0 || chr_label >= chunks_.size()) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid value for chr_label argument"));
+  if ((chunk.snp_index_from_inclusive_ == 0) && (chunk.num_snps_in_chunk() == chunks_[chr_label].num_snps_in_chunk()) && has_only_diagonal(chunks_[chr_label]))
+    return set_ld_r2_csr_from_chunk(chr_label, chunk, r2_min);
+
   LOG << " set_ld_r2_coo(filename=" << filename << ")...";
   int64_t numel = chunk.csr_ld_r_.size();
 
@@ -129,6 +204,15 @@ void LdMatrixCsr::init_chunks() {
     snp_count_on_previous_chromosomes += chunk_snp_count[chr_label];
   }
 
+  // Tag ranges assume that tag indices are increasing with snp indices, as they normally are (make_tag_major validates this)
+  std::vector<int> chunk_tag_count(max_chr_label + 1, 0);
+  for (int i = 0; i < mapping_.tag_to_snp().size(); i++) chunk_tag_count[mapping_.chrnumvec()[mapping_.tag_to_snp()[i]]]++;
+  for (int chr_label = 0, tag_count_on_previous_chromosomes = 0; chr_label <= max_chr_label; chr_label++) {
+    chunks_[chr_label].tag_index_from_inclusive_ = tag_count_on_previous_chromosomes;
+    chunks_[chr_label].tag_index_to_exclusive_ = tag_count_on_previous_chromosomes + chunk_tag_count[chr_label];
+    tag_count_on_previous_chromosomes += chunk_tag_count[chr_label];
+  }
+
   LOG << " set_ld_r2_coo adds " << mapping_.tag_to_snp().size() << " elements with r2=1.0 to the diagonal of LD r2 matrix";
   for (int i = 0; i < mapping_.tag_to_snp().size(); i++) {
     int snp_index = mapping_.tag_to_snp()[i];
@@ -190,152 +274,458 @@ int64_t LdMatrixCsr::set_ld_r2_coo(int chr_label_data, int64_t length, int* snp_
   return 0;
 }
 
-int64_t LdMatrixCsrChunk::set_ld_r2_csr(TagToSnpMapping* mapping) {
-  if (!csr_ld_snp_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call set_ld_r2_csr twice"));
+int64_t LdMatrixCsrChunk::set_ld_r2_csr(TagToSnpMapping* mapping, bool symmetric, bool tag_major) {
+  if (!csr_ld_snp_index_.empty()) {
+    if (coo_ld_.empty()) return 0;  // already finalized, for example by LdMatrixCsr::set_ld_r2_csr_from_file
+    BGMG_THROW_EXCEPTION(::std::runtime_error("can't add LD r2 elements after set_ld_r2_csr"));
+  }
   csr_ld_snp_index_.resize(num_snps_in_chunk() + 1, 0);
   if (coo_ld_.empty()) {
     return 0;
   }
 
+#pragma omp critical(bgmg_log)
   LOG << ">set_ld_r2_csr(chr_label=" << chr_label_ << "); ";
 
   SimpleTimer timer(-1);
 
-  LOG << " sorting ld r2 elements... ";
-  // Use parallel sort? https://software.intel.com/en-us/articles/a-parallel-stable-sort-using-c11-for-tbb-cilk-plus-and-openmp
-#if _OPENMP >= 200805
-  {
-    SimpleTimer timer2(-1);
-    pss::parallel_stable_sort(coo_ld_.begin(), coo_ld_.end(), std::less<std::tuple<int, int, packed_r_value>>());
-    LOG << " pss::parallel_stable_sort took " << timer2.elapsed_ms() << "ms.";
+  // Counting sort by snp_index: a histogram of row sizes gives csr_ld_snp_index_, then the elements are scattered into their rows,
+  // and finally each (short) row is sorted by tag index.
+  SimpleTimer timer2(-1);
+  const int64_t numel = coo_ld_.size();
+  for (int64_t ld_index = 0; ld_index < numel; ld_index++) {
+    const int snp_index = std::get<0>(coo_ld_[ld_index]);
+    if (snp_index < snp_index_from_inclusive_ || snp_index >= snp_index_to_exclusive_) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: snp_index < snp_index_from_inclusive_ || snp_index >= snp_index_to_exclusive_"));
+    csr_ld_snp_index_[snp_index - snp_index_from_inclusive_ + 1]++;
   }
-#else
+  std::partial_sum(csr_ld_snp_index_.begin(), csr_ld_snp_index_.end(), csr_ld_snp_index_.begin());
+
+  std::vector<uint32_t> csr_ld_tag_index_(numel);
+  csr_ld_r_.resize(numel);
   {
-    SimpleTimer timer2(-1);
-    std::sort(coo_ld_.begin(), coo_ld_.end());
-    LOG << " std::sort took " << timer2.elapsed_ms() << "ms.";
+    std::vector<int64_t> row_pos(csr_ld_snp_index_.begin(), csr_ld_snp_index_.end() - 1);
+    for (int64_t ld_index = 0; ld_index < numel; ld_index++) {
+      const int64_t pos = row_pos[std::get<0>(coo_ld_[ld_index]) - snp_index_from_inclusive_]++;
+      csr_ld_tag_index_[pos] = std::get<1>(coo_ld_[ld_index]);
+      csr_ld_r_[pos] = std::get<2>(coo_ld_[ld_index]);
+    }
   }
-  static bool first_call = true;
-  if (first_call) { first_call = false; LOG << " To enable parallel sort within each chr label build bgmglib with compiler that supports OpenMP 3.0";}
-#endif
+  std::vector<std::tuple<int, int, packed_r_value>>().swap(coo_ld_);  // release memory before validation and packing
 
-  std::vector<uint32_t> csr_ld_tag_index_;
-  csr_ld_tag_index_.reserve(coo_ld_.size());
-  csr_ld_r_.reserve(coo_ld_.size());
+  sort_csr_rows(csr_ld_snp_index_, &csr_ld_tag_index_, &csr_ld_r_);
+#pragma omp critical(bgmg_log)
+  LOG << " counting sort of " << numel << " ld r2 elements took " << timer2.elapsed_ms() << "ms.";
 
-  for (int64_t i = 0; i < coo_ld_.size(); i++) {
-    csr_ld_tag_index_.push_back(std::get<1>(coo_ld_[i]));
-    csr_ld_r_.push_back(std::get<2>(coo_ld_[i]));
+  if (mapping != nullptr) validate_ld_r2_csr(csr_ld_tag_index_, *mapping);
+
+  if (symmetric) {
+    if (mapping == nullptr) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: symmetric storage requires mapping"));
+    make_symmetric(&csr_ld_tag_index_, *mapping);
+  }
+  if (tag_major) {
+    if (mapping == nullptr) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: tag-major index requires mapping"));
+    make_tag_major(csr_ld_tag_index_, *mapping);
   }
 
-  // find starting position for each snp
-  std::fill(csr_ld_snp_index_.begin(), csr_ld_snp_index_.end(), coo_ld_.size());
-  for (int64_t ld_index = coo_ld_.size() - 1; ld_index >= 0; ld_index--) {
-    int snp_index = std::get<0>(coo_ld_[ld_index]);
-    if (snp_index < snp_index_from_inclusive_ || snp_index >= snp_index_to_exclusive_) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: snp_index < snp_index_from_inclusive_ || snp_index >= snp_index_to_exclusive_"));
-    csr_ld_snp_index_[snp_index - snp_index_from_inclusive_] = ld_index;
+  pack_ld_r2_csr(&csr_ld_tag_index_);
+
+#pragma omp critical(bgmg_log)
+  LOG << "<set_ld_r2_csr(chr_label=" << chr_label_ << "); elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
+// Fast path for set_ld_r2_coo(filename) where the file covers exactly the snps of the chunk.
+// Builds the final (symmetric, tag-indexed) CSR structure straight from the upper-triangular CSR structure stored in the file,
+// with one counting pass and one filling pass, avoiding coo_ld_ and the global sort in set_ld_r2_csr.
+// The result (including ld_tag_sum) is the same as set_ld_r2_coo followed by set_ld_r2_csr.
+int64_t LdMatrixCsr::set_ld_r2_csr_from_chunk(int chr_label, LdMatrixCsrChunk& file_chunk, float r2_min) {
+  LOG << ">set_ld_r2_csr_from_chunk(chr_label=" << chr_label << "); ";
+  SimpleTimer timer(-1);
+
+  std::vector<float> hvec;
+  find_hvec(mapping_, &hvec);
+
+  LdMatrixCsrChunk& chunk = chunks_[chr_label];
+  const int index0 = chunk.snp_index_from_inclusive_;
+  const int num_snps = chunk.num_snps_in_chunk();
+  const std::vector<char>& is_tag = mapping_.is_tag();
+  const std::vector<int>& snp_to_tag = mapping_.snp_to_tag();
+  LdMatrixRow file_row;
+
+  // first pass: ld_tag_sum, and the number of elements in each row of the resulting CSR structure
+  std::vector<int64_t> row_size(num_snps, 0);
+  for (int i = 0; i < num_snps; i++) if (is_tag[i + index0]) row_size[i]++;  // diagonal
+  for (int i = 0; i < num_snps; i++) {
+    file_chunk.extract_row(i, &file_row);
+    auto iter_end = file_row.end();
+    for (auto iter = file_row.begin(); iter < iter_end; iter++) {
+      const int j = iter.tag_index();
+      if (j < 0 || j >= num_snps || j == i) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid tag index in LD file"));
+      const int snp_index = i + index0;
+      const int tag_index = j + index0;
+      const float r = iter.r();
+      if (!std::isfinite(r) || r < -1.0f || r > 1.0f) BGMG_THROW_EXCEPTION(::std::runtime_error("encounter undefined, below -1.0 or above 1.0 values"));
+
+      const float r2 = r * r;
+      int ld_component = (r2 < r2_min) ? LD_TAG_COMPONENT_BELOW_R2MIN : LD_TAG_COMPONENT_ABOVE_R2MIN;
+      if (is_tag[tag_index]) ld_tag_sum_adjust_for_hvec_->store(ld_component, snp_to_tag[tag_index], r2 * hvec[snp_index]);
+      if (is_tag[snp_index]) ld_tag_sum_adjust_for_hvec_->store(ld_component, snp_to_tag[snp_index], r2 * hvec[tag_index]);
+
+      if (is_tag[tag_index]) ld_tag_sum_->store(ld_component, snp_to_tag[tag_index], r2);
+      if (is_tag[snp_index]) ld_tag_sum_->store(ld_component, snp_to_tag[snp_index], r2);
+
+      if (r2 < r2_min) continue;
+      if (is_tag[tag_index]) row_size[i]++;
+      if (is_tag[snp_index]) row_size[j]++;
+    }
   }
 
-  for (int i = (csr_ld_snp_index_.size() - 2); i >= 0; i--)
-    if (csr_ld_snp_index_[i] > csr_ld_snp_index_[i + 1])
-      csr_ld_snp_index_[i] = csr_ld_snp_index_[i + 1];
+  chunk.csr_ld_snp_index_.resize(num_snps + 1, 0);
+  for (int i = 0; i < num_snps; i++) chunk.csr_ld_snp_index_[i + 1] = chunk.csr_ld_snp_index_[i] + row_size[i];
+  const int64_t numel = chunk.csr_ld_snp_index_[num_snps];
+
+  // second pass: fill in the elements. Row i receives elements from rows j < i, then the diagonal, then its own elements (j > i),
+  // so rows end up sorted as long as tag indices are increasing with snp indices; otherwise we sort them below.
+  std::vector<uint32_t> csr_ld_tag_index(numel, 0);
+  chunk.csr_ld_r_.resize(numel);
+  std::vector<int64_t> row_pos(chunk.csr_ld_snp_index_.begin(), chunk.csr_ld_snp_index_.end() - 1);
+  for (int i = 0; i < num_snps; i++) {
+    if (is_tag[i + index0]) {
+      csr_ld_tag_index[row_pos[i]] = snp_to_tag[i + index0];
+      chunk.csr_ld_r_[row_pos[i]] = packed_r_value(1.0f);
+      row_pos[i]++;
+    }
 
-  coo_ld_.clear();
+    file_chunk.extract_row(i, &file_row);
+    auto iter_end = file_row.end();
+    for (auto iter = file_row.begin(); iter < iter_end; iter++) {
+      const float r = iter.r();
+      if ((r * r) < r2_min) continue;
+      const int j = iter.tag_index();
+      if (is_tag[j + index0]) { csr_ld_tag_index[row_pos[i]] = snp_to_tag[j + index0]; chunk.csr_ld_r_[row_pos[i]] = packed_r_value(r); row_pos[i]++; }
+      if (is_tag[i + index0]) { csr_ld_tag_index[row_pos[j]] = snp_to_tag[i + index0]; chunk.csr_ld_r_[row_pos[j]] = packed_r_value(r); row_pos[j]++; }
+    }
+  }
 
-  if (mapping != nullptr) validate_ld_r2_csr(csr_ld_tag_index_, *mapping);
+  sort_csr_rows(chunk.csr_ld_snp_index_, &csr_ld_tag_index, &chunk.csr_ld_r_);
 
-  {
-    LOG << ">pack_ld_r2_csr(); ";
-    SimpleTimer timer3(-1);
-    // pack LD structure
-    csr_ld_tag_index_offset_.reserve(csr_ld_snp_index_.size()); csr_ld_tag_index_offset_.push_back(0);
-    int64_t buffer_size = 0;
-    for (int snp_index_in_chunk = 0; snp_index_in_chunk < num_snps_in_chunk(); snp_index_in_chunk++) {
-      int64_t ld_index_from = csr_ld_snp_index_[snp_index_in_chunk];
-      int64_t ld_index_to = csr_ld_snp_index_[snp_index_in_chunk + 1];
-      int64_t num_ld_indices = ld_index_to - ld_index_from;
+  chunk.coo_ld_.clear();  // the diagonal is already included
+  chunk.coo_ld_.shrink_to_fit();
+  chunk.validate_ld_r2_csr(csr_ld_tag_index, mapping_);
+  if (symmetric_) chunk.make_symmetric(&csr_ld_tag_index, mapping_);
+  if (tag_major_) chunk.make_tag_major(csr_ld_tag_index, mapping_);
+  chunk.pack_ld_r2_csr(&csr_ld_tag_index);
+  chunk.encode_ld_r(ld_r_codec_);
 
-      if (num_ld_indices > 0) {
-        compute_deltas_inplace(&csr_ld_tag_index_[ld_index_from], num_ld_indices, 0);
+  LOG << "<set_ld_r2_csr_from_chunk(chr_label=" << chr_label << "); nnz=" << numel << ", elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
 
+// Compress each row of values with TurboPFor vsenc32 algorithm; offset[i] points to i-th row in packed.
+// Each block of rows is packed into its own buffer, with offsets relative to the start of the block, then the buffers are concatenated.
+static void vsenc_rows(const LdVector<int64_t>& row_index, std::vector<uint32_t>* values, LdVector<uint64_t>* offset, LdVector<unsigned char>* packed) {
+  const int num_rows = row_index.size() - 1;
+  const int num_blocks = (num_rows + FINALIZE_ROWS_PER_TASK - 1) / FINALIZE_ROWS_PER_TASK;
+  std::vector<std::vector<unsigned char>> block_packed(num_blocks);
+  offset->resize(num_rows + 1); (*offset)[0] = 0;
+  parallel_for_blocks(num_blocks, 1, [num_rows, &row_index, values, offset, &block_packed](int64_t block_index, int64_t) {
+    std::vector<unsigned char>& packed = block_packed[block_index];
+    int64_t buffer_size = 0;
+    const int row_to = std::min<int>(num_rows, (block_index + 1) * FINALIZE_ROWS_PER_TASK);
+    for (int row = block_index * FINALIZE_ROWS_PER_TASK; row < row_to; row++) {
+      const int64_t num_values = row_index[row + 1] - row_index[row];
+      if (num_values > 0) {
         const int growth_factor = 2;
-        csr_ld_tag_index_packed_.resize(growth_factor * buffer_size + VSENC_BOUND(num_ld_indices, sizeof(uint32_t)));
-        unsigned char *inptr = &csr_ld_tag_index_packed_[buffer_size];
-        unsigned char *outptr = vsenc32(&csr_ld_tag_index_[ld_index_from], num_ld_indices, inptr);
+        packed.resize(growth_factor * buffer_size + VSENC_BOUND(num_values, sizeof(uint32_t)));
+        unsigned char *inptr = &packed[buffer_size];
+        unsigned char *outptr = vsenc32(&(*values)[row_index[row]], num_values, inptr);
         buffer_size += (outptr - inptr);
       }
+      (*offset)[row + 1] = buffer_size;
+    }
+    packed.resize(buffer_size);
+  });
+
+  std::vector<uint64_t> block_offset(num_blocks + 1, 0);
+  for (int block_index = 0; block_index < num_blocks; block_index++) block_offset[block_index + 1] = block_offset[block_index] + block_packed[block_index].size();
+  packed->resize(block_offset.back());
+  parallel_for_blocks(num_blocks, 1, [num_rows, offset, packed, &block_packed, &block_offset](int64_t block_index, int64_t) {
+    const int row_to = std::min<int>(num_rows, (block_index + 1) * FINALIZE_ROWS_PER_TASK);
+    for (int row = block_index * FINALIZE_ROWS_PER_TASK; row < row_to; row++) (*offset)[row + 1] += block_offset[block_index];
+    if (!block_packed[block_index].empty()) std::memcpy(&(*packed)[block_offset[block_index]], block_packed[block_index].data(), block_packed[block_index].size());
+    std::vector<unsigned char>().swap(block_packed[block_index]);
+  });
+}
 
-      csr_ld_tag_index_offset_.push_back(buffer_size);
+void LdMatrixCsrChunk::pack_ld_r2_csr(std::vector<uint32_t>* csr_ld_tag_index) {
+#pragma omp critical(bgmg_log)
+  LOG << ">pack_ld_r2_csr(); ";
+  SimpleTimer timer(-1);
+  // pack LD structure
+  parallel_for_blocks(num_snps_in_chunk(), FINALIZE_ROWS_PER_TASK, [this, csr_ld_tag_index](int64_t from, int64_t to) {
+    for (int64_t snp_index_in_chunk = from; snp_index_in_chunk < to; snp_index_in_chunk++) {
+      const int64_t ld_index_from = csr_ld_snp_index_[snp_index_in_chunk];
+      const int64_t num_ld_indices = csr_ld_snp_index_[snp_index_in_chunk + 1] - ld_index_from;
+      if (num_ld_indices > 0) compute_deltas_inplace(&(*csr_ld_tag_index)[ld_index_from], num_ld_indices, 0);
     }
-    csr_ld_tag_index_packed_.resize(buffer_size);
-    csr_ld_tag_index_packed_.shrink_to_fit();
-    LOG << "<pack_ld_r2_csr(); elapsed time " << timer3.elapsed_ms() << " ms";
+  });
+  vsenc_rows(csr_ld_snp_index_, csr_ld_tag_index, &csr_ld_tag_index_offset_, &csr_ld_tag_index_packed_);
+#pragma omp critical(bgmg_log)
+  LOG << "<pack_ld_r2_csr(); elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+void LdMatrixCsrChunk::make_symmetric(std::vector<uint32_t>* csr_ld_tag_index, TagToSnpMapping& mapping) {
+#pragma omp critical(bgmg_log)
+  LOG << ">make_symmetric(); ";
+  SimpleTimer timer(-1);
+
+  for (int snp_index = snp_index_from_inclusive_; snp_index < snp_index_to_exclusive_; snp_index++)
+    if (!mapping.is_tag()[snp_index] || (mapping.snp_to_tag()[snp_index] != snp_index))
+      BGMG_THROW_EXCEPTION(std::runtime_error("ld_symmetric requires all snps to be tag snps with tag_index == snp_index (see use_complete_tag_indices)"));
+
+  // drop the lower triangle of each row (rows are sorted by tag index); remember how many elements were dropped
+  const int num_snps = num_snps_in_chunk();
+  std::vector<int64_t> num_lower(num_snps, 0);
+  uint32_t* tag_index = csr_ld_tag_index->data();
+  int64_t numel = 0, ld_index_from = 0;
+  for (int i = 0; i < num_snps; i++) {
+    const int64_t ld_index_to = csr_ld_snp_index_[i + 1];
+    const int64_t ld_index_diag = std::lower_bound(tag_index + ld_index_from, tag_index + ld_index_to, static_cast<uint32_t>(i + snp_index_from_inclusive_)) - tag_index;
+    num_lower[i] = ld_index_diag - ld_index_from;
+    for (int64_t k = ld_index_diag; k < ld_index_to; k++, numel++) { tag_index[numel] = tag_index[k]; csr_ld_r_[numel] = csr_ld_r_[k]; }
+    csr_ld_snp_index_[i + 1] = numel;
+    ld_index_from = ld_index_to;
   }
+  csr_ld_tag_index->resize(numel); csr_ld_tag_index->shrink_to_fit();
+  csr_ld_r_.resize(numel); csr_ld_r_.shrink_to_fit();
+  tag_index = csr_ld_tag_index->data();
+
+  // transposed index: counting sort of the upper triangle (without the diagonal) by column
+  csr_ld_lower_index_.resize(num_snps + 1, 0);
+  for (int i = 0; i < num_snps; i++) {
+    for (int64_t ld_index = csr_ld_snp_index_[i]; ld_index < csr_ld_snp_index_[i + 1]; ld_index++) {
+      const int64_t column = static_cast<int64_t>(tag_index[ld_index]) - snp_index_from_inclusive_;
+      if (column >= num_snps) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: tag_index outside of the chunk in symmetric storage"));
+      if (column != i) csr_ld_lower_index_[column + 1]++;
+    }
+  }
+  for (int i = 0; i < num_snps; i++)
+    if (csr_ld_lower_index_[i + 1] != num_lower[i]) BGMG_THROW_EXCEPTION(std::runtime_error("ld_symmetric requires symmetric LD matrix"));
+  std::partial_sum(csr_ld_lower_index_.begin(), csr_ld_lower_index_.end(), csr_ld_lower_index_.begin());
 
-  LOG << "<set_ld_r2_csr(chr_label=" << chr_label_ << "); elapsed time " << timer.elapsed_ms() << " ms";
-  return 0;
+  std::vector<int64_t> lower_ld_index(csr_ld_lower_index_.back());
+  {
+    std::vector<int64_t> column_pos(csr_ld_lower_index_.begin(), csr_ld_lower_index_.end() - 1);
+    for (int i = 0; i < num_snps; i++) {
+      for (int64_t ld_index = csr_ld_snp_index_[i]; ld_index < csr_ld_snp_index_[i + 1]; ld_index++) {
+        const int column = tag_index[ld_index] - snp_index_from_inclusive_;
+        if (column != i) lower_ld_index[column_pos[column]++] = ld_index;
+      }
+    }
+  }
+
+  // delta-encode positions within each column: the first one as a distance back from the start of the row, then increments
+  std::vector<uint32_t> lower_ld_index_delta(lower_ld_index.size());
+  for (int i = 0; i < num_snps; i++) {
+    int64_t prev = csr_ld_snp_index_[i];
+    for (int64_t k = csr_ld_lower_index_[i]; k < csr_ld_lower_index_[i + 1]; k++) {
+      const int64_t delta = (k == csr_ld_lower_index_[i]) ? (prev - lower_ld_index[k]) : (lower_ld_index[k] - prev);
+      if (delta <= 0 || delta > std::numeric_limits<uint32_t>::max()) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: invalid delta in symmetric storage"));
+      lower_ld_index_delta[k] = static_cast<uint32_t>(delta);
+      prev = lower_ld_index[k];
+    }
+  }
+  std::vector<int64_t>().swap(lower_ld_index);
+  vsenc_rows(csr_ld_lower_index_, &lower_ld_index_delta, &csr_ld_lower_offset_, &csr_ld_lower_packed_);
+
+#pragma omp critical(bgmg_log)
+  LOG << "<make_symmetric(); nnz=" << numel << ", nnz below the diagonal=" << csr_ld_lower_index_.back() << ", elapsed time " << timer.elapsed_ms() << " ms";
+}
+
+void LdMatrixCsrChunk::make_tag_major(const std::vector<uint32_t>& csr_ld_tag_index, TagToSnpMapping& mapping) {
+#pragma omp critical(bgmg_log)
+  LOG << ">make_tag_major(); ";
+  SimpleTimer timer(-1);
+
+  if (is_symmetric()) BGMG_THROW_EXCEPTION(std::runtime_error("ld_tag_major can not be combined with ld_symmetric"));
+  const int num_tags = num_tags_in_chunk();
+  tag_major_snp_index_.resize(num_tags);
+  for (int t = 0; t < num_tags; t++) {
+    const int snp_index = mapping.tag_to_snp()[t + tag_index_from_inclusive_];
+    if (snp_index < snp_index_from_inclusive_ || snp_index >= snp_index_to_exclusive_)
+      BGMG_THROW_EXCEPTION(std::runtime_error("ld_tag_major requires tag indices to be increasing with snp indices"));
+    tag_major_snp_index_[t] = snp_index;
+  }
+
+  // counting sort of positions (ld_index) by tag index; within each tag positions come in increasing order
+  const int num_snps = num_snps_in_chunk();
+  const int64_t numel = csr_ld_snp_index_[num_snps];
+  csr_ld_tag_major_index_.resize(num_tags + 1, 0);
+  for (int64_t ld_index = 0; ld_index < numel; ld_index++) {
+    const int64_t t = static_cast<int64_t>(csr_ld_tag_index[ld_index]) - tag_index_from_inclusive_;
+    if (t < 0 || t >= num_tags) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: tag_index outside of the chunk in tag-major index"));
+    csr_ld_tag_major_index_[t + 1]++;
+  }
+  std::partial_sum(csr_ld_tag_major_index_.begin(), csr_ld_tag_major_index_.end(), csr_ld_tag_major_index_.begin());
+
+  // delta-encode positions straight away: the first one as a distance back from the end of the tag's own row (which contains the diagonal), then increments
+  std::vector<uint32_t> ld_index_delta(numel);
+  {
+    std::vector<int64_t> tag_pos(csr_ld_tag_major_index_.begin(), csr_ld_tag_major_index_.end() - 1);
+    std::vector<int64_t> prev(num_tags);
+    for (int t = 0; t < num_tags; t++) prev[t] = ld_index_end(tag_major_snp_index_[t]);
+    for (int i = 0; i < num_snps; i++) {
+      for (int64_t ld_index = csr_ld_snp_index_[i]; ld_index < csr_ld_snp_index_[i + 1]; ld_index++) {
+        const int t = csr_ld_tag_index[ld_index] - tag_index_from_inclusive_;
+        const bool first = (tag_pos[t] == csr_ld_tag_major_index_[t]);
+        const int64_t delta = first ? (prev[t] - ld_index) : (ld_index - prev[t]);
+        if (delta <= 0 || delta > std::numeric_limits<uint32_t>::max()) BGMG_THROW_EXCEPTION(std::runtime_error("bgmglib internal error: invalid delta in tag-major index"));
+        ld_index_delta[tag_pos[t]++] = static_cast<uint32_t>(delta);
+        prev[t] = ld_index;
+      }
+    }
+  }
+  vsenc_rows(csr_ld_tag_major_index_, &ld_index_delta, &csr_ld_tag_major_offset_, &csr_ld_tag_major_packed_);
+
+#pragma omp critical(bgmg_log)
+  LOG << "<make_tag_major(); num_tags=" << num_tags << ", nnz=" << numel << ", elapsed time " << timer.elapsed_ms() << " ms";
 }
 
 int64_t LdMatrixCsr::set_ld_r2_csr(float r2_min, int chr_label) {
   if (chr_label < 0) {
-    for (int i = 0; i < chunks_.size(); i++) set_ld_r2_csr(r2_min, i);
+    LOG << ">set_ld_r2_csr(r2_min=" << r2_min << ", chr_label=" << chr_label << "); ";
+    SimpleTimer timer(-1);
+
+    // one task per chromosome, largest first so that the long tasks start early; the work within each chromosome runs as nested tasks
+    std::vector<int> order(chunks_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return chunks_[a].coo_ld_.size() > chunks_[b].coo_ld_.size(); });
+    parallel_for_blocks(order.size(), 1, [this, r2_min, &order](int64_t from, int64_t) { set_ld_r2_csr(r2_min, order[from]); });
+
+    LOG << "<set_ld_r2_csr(r2_min=" << r2_min << ", chr_label=" << chr_label << "); elapsed time " << timer.elapsed_ms() << " ms";
   } else {  
-    chunks_[chr_label].set_ld_r2_csr(&mapping_);
+    chunks_[chr_label].set_ld_r2_csr(&mapping_, symmetric_, tag_major_);
+    if (!is_on_demand(chr_label)) chunks_[chr_label].encode_ld_r(ld_r_codec_);
+  }
+  return 0;
+}
+
+// init_chunks() populates coo_ld_ with the diagonal; anything beyond that comes from set_ld_r2_coo
+bool LdMatrixCsr::has_only_diagonal(const LdMatrixCsrChunk& chunk) {
+  const int64_t num_tags_in_chunk = std::count_if(mapping_.tag_to_snp().begin(), mapping_.tag_to_snp().end(),
+    [&chunk](int snp_index) { return snp_index >= chunk.snp_index_from_inclusive_ && snp_index < chunk.snp_index_to_exclusive_; });
+  return chunk.csr_ld_snp_index_.empty() && (chunk.coo_ld_.size() == num_tags_in_chunk);
+}
+
+int64_t LdMatrixCsr::set_ld_r2_csr_from_file(int chr_label, const std::string& filename, float r2_min) {
+  LOG << ">set_ld_r2_csr_from_file(chr_label=" << chr_label << ", filename=" << filename << "); ";
+  SimpleTimer timer(-1);
+
+  init_chunks();
+  if (chr_label < 0 || chr_label >= chunks_.size()) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid value for chr_label argument"));
+  LdMatrixCsrChunk& chunk = chunks_[chr_label];
+  if (!chunk.csr_ld_snp_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("LD structure for this chr_label is already finalized"));
+
+  if (!has_only_diagonal(chunk)) BGMG_THROW_EXCEPTION(::std::runtime_error("can't combine set_ld_r2_coo with a memory-mapped LD file for the same chr_label"));
+  if (symmetric_) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_symmetric is not supported with memory-mapped LD files"));
+  if (tag_major_) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_tag_major is not supported with memory-mapped LD files"));
+
+  load_ld_matrix_mapped(filename, mapping_, r2_min, &chunk, ld_tag_sum_.get(), ld_tag_sum_adjust_for_hvec_.get());
+  chunk.coo_ld_.clear();
+  chunk.coo_ld_.shrink_to_fit();
+
+  if (memory_budget_bytes_ > 0) {
+    // keep a private copy of csr_ld_snp_index_, and release the file; the rest is loaded on first access
+    chunk.csr_ld_snp_index_.detach();
+    chunk.csr_ld_tag_index_offset_.clear();
+    chunk.csr_ld_tag_index_packed_.clear();
+    chunk.csr_ld_r_.clear();
+    chunk.csr_ld_r_packed_.clear();
+
+    if (on_demand_chunks_.size() < chunks_.size()) on_demand_chunks_.resize(chunks_.size());
+    on_demand_chunks_[chr_label].reset(new OnDemandChunk());
+    on_demand_chunks_[chr_label]->filename = filename;
+    on_demand_chunks_[chr_label]->resident_ptr = nullptr;
+    on_demand_chunks_[chr_label]->last_access = 0;
+    on_demand_chunks_[chr_label]->resident_bytes = 0;
+    LOG << " chunk will be loaded on demand (memory budget " << memory_budget_bytes_ << " bytes)";
   }
+
+  LOG << "<set_ld_r2_csr_from_file(chr_label=" << chr_label << "); elapsed time " << timer.elapsed_ms() << " ms";
+  return 0;
+}
+
+int64_t LdMatrixCsr::save_ld_r2_csr(int chr_label, const std::string& filename, float r2_min, TagToSnpMapping& mapping) {
+  if (chr_label < 0 || chr_label >= chunks_.size()) BGMG_THROW_EXCEPTION(::std::runtime_error("invalid value for chr_label argument"));
+  const LdMatrixCsrChunk& chunk = chunks_[chr_label];
+  if (!chunk.coo_ld_.empty() || chunk.csr_ld_snp_index_.empty()) BGMG_THROW_EXCEPTION(::std::runtime_error("can't call save_ld_r2_csr before set_ld_r2_csr"));
+  if (chunk.is_symmetric()) BGMG_THROW_EXCEPTION(::std::runtime_error("ld_symmetric is not supported with memory-mapped LD files"));
+  if (is_on_demand(chr_label)) {
+    save_ld_matrix_mapped(*acquire_chunk(chr_label), mapping, r2_min, *ld_tag_sum_, *ld_tag_sum_adjust_for_hvec_, filename);
+    return 0;
+  }
+  save_ld_matrix_mapped(chunk, mapping, r2_min, *ld_tag_sum_, *ld_tag_sum_adjust_for_hvec_, filename);
   return 0;
 }
 
 int64_t LdMatrixCsrChunk::validate_ld_r2_csr(const std::vector<uint32_t>& csr_ld_tag_index_, TagToSnpMapping& mapping_) {
+  if (csr_ld_r_.empty()) return 0;  // allow empty chunks
+
+#pragma omp critical(bgmg_log)
   LOG << ">validate_ld_r2_csr(); ";
   SimpleTimer timer(-1);
 
-  if (csr_ld_r_.empty()) return 0;  // allow empty chunks
-  
   // Test correctness of sparse representation
   if (csr_ld_snp_index_.size() != (num_snps_in_chunk() + 1)) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_snp_index_.size() != (num_snp_ + 1))"));
   for (int i = 0; i < csr_ld_snp_index_.size(); i++) if (csr_ld_snp_index_[i] < 0 || csr_ld_snp_index_[i] > csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_snp_index_[i] < 0 || csr_ld_snp_index_[i] > csr_ld_r_.size()"));
   for (int i = 1; i < csr_ld_snp_index_.size(); i++) if (csr_ld_snp_index_[i - 1] > csr_ld_snp_index_[i]) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_snp_index_[i-1] > csr_ld_snp_index_[i]"));
   if (csr_ld_snp_index_.back() != csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_snp_index_.back() != csr_ld_r_.size()"));
   if (csr_ld_tag_index_.size() != csr_ld_r_.size()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_tag_index_.size() != csr_ld_r_.size()"));
-  for (int64_t i = 0; i < csr_ld_tag_index_.size(); i++) if (csr_ld_tag_index_[i] < 0 || csr_ld_tag_index_[i] >= mapping_.num_tag()) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_tag_index_ < 0 || csr_ld_tag_index_ >= num_tag_"));
-
-  // Test that LDr2 does not have duplicates
-  for (int snp_index_in_chunk = 0; snp_index_in_chunk < num_snps_in_chunk(); snp_index_in_chunk++) {
-    const int64_t r2_index_from = csr_ld_snp_index_[snp_index_in_chunk];
-    const int64_t r2_index_to = csr_ld_snp_index_[snp_index_in_chunk + 1];
-    for (int64_t r2_index = r2_index_from; r2_index < (r2_index_to - 1); r2_index++) {
-      if (csr_ld_tag_index_[r2_index] == csr_ld_tag_index_[r2_index + 1])
-        BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_tag_index_[r2_index] == csr_ld_tag_index_[r2_index + 1]"));
-    }
-  }
 
-  // Test that LDr2 is symmetric (as long as both SNPs are tag)
-  // Test that LDr2 contains the diagonal (as long as we looking at correct chr_label; remember that this validation is for a given LD chunk, e.i. for a given LD chromosome)
-  for (int causal_index = snp_index_from_inclusive_; causal_index < snp_index_to_exclusive_; causal_index++) {
-    if (!mapping_.is_tag()[causal_index]) continue;
-    if (mapping_.chrnumvec()[causal_index] != chr_label_) continue;
-    const int tag_index_of_the_snp = mapping_.snp_to_tag()[causal_index];
-
-    const int64_t r2_index_from = csr_ld_snp_index_[causal_index - snp_index_from_inclusive_];
-    const int64_t r2_index_to = csr_ld_snp_index_[causal_index - snp_index_from_inclusive_ + 1];
-    bool ld_r2_contains_diagonal = false;
-    for (int64_t r2_index = r2_index_from; r2_index < r2_index_to; r2_index++) {
-      const int tag_index = csr_ld_tag_index_[r2_index];
-      const float r2 = csr_ld_r_[r2_index].get();  // here we are interested in r2 (hvec is irrelevant)
-
-      if (tag_index == tag_index_of_the_snp) ld_r2_contains_diagonal = true;
-      
-      // disable symmetry check for performance reasons
-      if (0) {
-        float r2symm = find_and_retrieve_ld_r2(mapping_.tag_to_snp()[tag_index], tag_index_of_the_snp, csr_ld_tag_index_);
-        if (!std::isfinite(r2symm)) BGMG_THROW_EXCEPTION(std::runtime_error("!std::isfinite(r2symm)"));
-        if (r2symm != r2) BGMG_THROW_EXCEPTION(std::runtime_error("r2symm != r2"));
+  // The remaining tests are independent for each snp, so they run in blocks of rows
+  parallel_for_blocks(num_snps_in_chunk(), FINALIZE_ROWS_PER_TASK, [this, &csr_ld_tag_index_, &mapping_](int64_t snp_index_in_chunk_from, int64_t snp_index_in_chunk_to) {
+    const int num_tag = mapping_.num_tag();
+    for (int64_t i = csr_ld_snp_index_[snp_index_in_chunk_from]; i < csr_ld_snp_index_[snp_index_in_chunk_to]; i++) if (csr_ld_tag_index_[i] < 0 || csr_ld_tag_index_[i] >= num_tag) BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_tag_index_ < 0 || csr_ld_tag_index_ >= num_tag_"));
+
+    // Test that LDr2 does not have duplicates
+    for (int snp_index_in_chunk = snp_index_in_chunk_from; snp_index_in_chunk < snp_index_in_chunk_to; snp_index_in_chunk++) {
+      const int64_t r2_index_from = csr_ld_snp_index_[snp_index_in_chunk];
+      const int64_t r2_index_to = csr_ld_snp_index_[snp_index_in_chunk + 1];
+      for (int64_t r2_index = r2_index_from; r2_index < (r2_index_to - 1); r2_index++) {
+        if (csr_ld_tag_index_[r2_index] == csr_ld_tag_index_[r2_index + 1])
+          BGMG_THROW_EXCEPTION(std::runtime_error("csr_ld_tag_index_[r2_index] == csr_ld_tag_index_[r2_index + 1]"));
       }
     }
 
-    if (!ld_r2_contains_diagonal) BGMG_THROW_EXCEPTION(std::runtime_error("!ld_r2_contains_diagonal"));
-  }
+    // Test that LDr2 is symmetric (as long as both SNPs are tag)
+    // Test that LDr2 contains the diagonal (as long as we looking at correct chr_label; remember that this validation is for a given LD chunk, e.i. for a given LD chromosome)
+    for (int causal_index = snp_index_from_inclusive_ + snp_index_in_chunk_from; causal_index < snp_index_from_inclusive_ + snp_index_in_chunk_to; causal_index++) {
+      if (!mapping_.is_tag()[causal_index]) continue;
+      if (mapping_.chrnumvec()[causal_index] != chr_label_) continue;
+      const int tag_index_of_the_snp = mapping_.snp_to_tag()[causal_index];
+
+      const int64_t r2_index_from = csr_ld_snp_index_[causal_index - snp_index_from_inclusive_];
+      const int64_t r2_index_to = csr_ld_snp_index_[causal_index - snp_index_from_inclusive_ + 1];
+      bool ld_r2_contains_diagonal = false;
+      for (int64_t r2_index = r2_index_from; r2_index < r2_index_to; r2_index++) {
+        const int tag_index = csr_ld_tag_index_[r2_index];
+
+        if (tag_index == tag_index_of_the_snp) ld_r2_contains_diagonal = true;
+
+        // disable symmetry check for performance reasons
+        if (0) {
+          const float r2 = csr_ld_r_[r2_index].get();  // here we are interested in r2 (hvec is irrelevant)
+          float r2symm = find_and_retrieve_ld_r2(mapping_.tag_to_snp()[tag_index], tag_index_of_the_snp, csr_ld_tag_index_);
+          if (!std::isfinite(r2symm)) BGMG_THROW_EXCEPTION(std::runtime_error("!std::isfinite(r2symm)"));
+          if (r2symm != r2) BGMG_THROW_EXCEPTION(std::runtime_error("r2symm != r2"));
+        }
+      }
 
+      if (!ld_r2_contains_diagonal) BGMG_THROW_EXCEPTION(std::runtime_error("!ld_r2_contains_diagonal"));
+    }
+  });
+
+#pragma omp critical(bgmg_log)
   LOG << "<validate_ld_r2_csr (); elapsed time " << timer.elapsed_ms() << " ms";
   return 0;
 }
@@ -352,8 +742,20 @@ size_t LdMatrixCsr::log_diagnostics() {
   for (int i = 0; i < chunks_.size(); i++) {
     if (chunks_[i].is_empty()) continue;
     LOG << " diag: LdMatrixCsr chunk " << i << ", snp_index in ["<< chunks_[i].snp_index_from_inclusive_ << ", " << chunks_[i].snp_index_to_exclusive_ << ")";
+    if (is_on_demand(i)) {
+      std::shared_ptr<LdMatrixCsrChunk> resident;
+      {
+        std::lock_guard<std::mutex> lock(on_demand_mutex_);
+        resident = on_demand_chunks_[i]->resident;
+      }
+      LOG << " diag: loaded on demand from " << on_demand_chunks_[i]->filename << ", " << ((resident != nullptr) ? "resident" : "evicted");
+      if (resident != nullptr) mem_bytes_total += resident->log_diagnostics();
+      continue;
+    }
     mem_bytes_total += chunks_[i].log_diagnostics();
   }
+  if (memory_budget_bytes_ > 0)
+    LOG << " diag: on-demand chunks use " << resident_bytes_ << " bytes out of " << memory_budget_bytes_ << " bytes budget, " << on_demand_loads_ << " loads so far";
 
   return mem_bytes_total;
 }
@@ -368,11 +770,24 @@ size_t LdMatrixCsrChunk::log_diagnostics() {
   LOG << " diag: csr_ld_tag_index_packed_.size()=" << csr_ld_tag_index_packed_.size() << " (mem usage = " << mem_bytes << " bytes)";
   mem_bytes = csr_ld_r_.size() * sizeof(packed_r_value); mem_bytes_total += mem_bytes;
   LOG << " diag: csr_ld_r_.size()=" << csr_ld_r_.size() << " (mem usage = " << mem_bytes << " bytes)";
+  mem_bytes = csr_ld_r_packed_.size(); mem_bytes_total += mem_bytes;
+  LOG << " diag: csr_ld_r_packed_.size()=" << csr_ld_r_packed_.size() << " (mem usage = " << mem_bytes << " bytes, ld_r_codec=" << ld_r_codec_ << ")";
+  if (is_mapped()) LOG << " diag: csr_ld_* structures are memory-mapped (read-only, shared through page cache)";
+  if (is_symmetric()) {
+    mem_bytes = csr_ld_lower_index_.size() * sizeof(int64_t) + csr_ld_lower_offset_.size() * sizeof(uint64_t) + csr_ld_lower_packed_.size(); mem_bytes_total += mem_bytes;
+    LOG << " diag: symmetric storage, " << csr_ld_lower_index_.back() << " elements below the diagonal, csr_ld_lower_packed_.size()=" << csr_ld_lower_packed_.size() << " (mem usage of csr_ld_lower_* = " << mem_bytes << " bytes)";
+  }
+  if (has_tag_major()) {
+    mem_bytes = csr_ld_tag_major_index_.size() * sizeof(int64_t) + csr_ld_tag_major_offset_.size() * sizeof(uint64_t) + csr_ld_tag_major_packed_.size() + tag_major_snp_index_.size() * sizeof(int); mem_bytes_total += mem_bytes;
+    LOG << " diag: tag-major index for " << num_tags_in_chunk() << " tags, csr_ld_tag_major_packed_.size()=" << csr_ld_tag_major_packed_.size() << " (mem usage of csr_ld_tag_major_* = " << mem_bytes << " bytes)";
+  }
   return mem_bytes_total;
 }
 
 void LdMatrixCsr::clear() {
   chunks_.clear();
+  on_demand_chunks_.clear();
+  resident_bytes_ = 0;
   if (ld_tag_sum_adjust_for_hvec_ != nullptr) ld_tag_sum_adjust_for_hvec_->clear();
   if (ld_tag_sum_ != nullptr) ld_tag_sum_->clear();
 }
@@ -381,39 +796,322 @@ void LdMatrixCsrChunk::clear() {
   coo_ld_.clear();
 }
 
+// IEEE 754 half precision conversions, with round-to-nearest-even (same as F16C instructions)
+static uint16_t float_to_half(float value) {
+  uint32_t x; memcpy(&x, &value, sizeof(x));
+  const uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000u);
+  x &= 0x7fffffffu;
+  if (x >= 0x47800000u) return sign | ((x > 0x7f800000u) ? 0x7e00u : 0x7c00u);  // overflow to infinity, or NaN
+  if (x < 0x38800000u) {  // half precision subnormal (or zero)
+    if (x < 0x33000000u) return sign;
+    const uint32_t mant = (x & 0x7fffffu) | 0x800000u;
+    const int shift = 126 - static_cast<int>(x >> 23);  // between 14 and 24
+    const uint32_t half_mant = mant >> shift, remainder = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+    return sign | static_cast<uint16_t>(half_mant + (((remainder > halfway) || ((remainder == halfway) && (half_mant & 1))) ? 1 : 0));
+  }
+  x -= (112u << 23);  // rebias exponent from 127 to 15
+  x += 0xfffu + ((x >> 13) & 1);
+  return sign | static_cast<uint16_t>(x >> 13);
+}
+
+static float half_to_float(uint16_t value) {
+  const uint32_t sign = static_cast<uint32_t>(value & 0x8000u) << 16;
+  uint32_t exponent = (value >> 10) & 0x1fu, mant = value & 0x3ffu, x;
+  if (exponent == 0x1fu) {
+    x = sign | 0x7f800000u | (mant << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112u) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    x = sign;
+  } else {  // subnormal half is a normal float
+    exponent = 113;
+    while ((mant & 0x400u) == 0) { mant <<= 1; exponent--; }
+    x = sign | (exponent << 23) | ((mant & 0x3ffu) << 13);
+  }
+  float result; memcpy(&result, &x, sizeof(result));
+  return result;
+}
+
+// LdRCodec_Uint8_R2 stores round(r2 * 255); decoding table gives r = sqrt(r2)
+static const float* uint8_r2_table() {
+  static const std::vector<float> table = []() {
+    std::vector<float> values(256);
+    for (int i = 0; i < 256; i++) values[i] = sqrtf(static_cast<float>(i) / 255.0f);
+    return values;
+  }();
+  return &table[0];
+}
+
+void LdMatrixCsrChunk::encode_ld_r(LdRCodec codec) {
+  if ((codec == ld_r_codec_) || is_mapped()) return;
+  if (ld_r_codec_ != LdRCodec_Uint16_R) BGMG_THROW_EXCEPTION(::std::runtime_error("LD r values are already encoded"));
+
+  const int64_t numel = csr_ld_r_.size();
+  csr_ld_r_packed_.resize(numel * ld_r_codec_bytes(codec));
+  if (codec == LdRCodec_Uint8_R2) {
+    for (int64_t i = 0; i < numel; i++) {
+      const float r = csr_ld_r_[i].get();
+      csr_ld_r_packed_[i] = static_cast<unsigned char>(roundf(r * r * 255.0f));
+    }
+  } else if (codec == LdRCodec_Fp16_R) {
+    uint16_t* packed = reinterpret_cast<uint16_t*>(csr_ld_r_packed_.data());
+    for (int64_t i = 0; i < numel; i++) packed[i] = float_to_half(csr_ld_r_[i].get());
+  } else {
+    BGMG_THROW_EXCEPTION(::std::runtime_error("unknown ld_r_codec"));
+  }
+
+  csr_ld_r_.clear();
+  csr_ld_r_.shrink_to_fit();
+  ld_r_codec_ = codec;
+}
+
+// Conversion of LD r values into float, 8 values at a time (AVX2) or one value at a time.
+// The AVX2 and scalar versions must give bit-identical results.
+template<LdRCodec codec> struct LdRDecoder;
+
+template<> struct LdRDecoder<LdRCodec_Uint16_R> {
+  static float decode(const unsigned char* packed, int64_t i) { return packed_r_value::unpack(reinterpret_cast<const uint16_t*>(packed)[i]); }
+#ifdef __AVX2__
+  static __m256 decode8(const unsigned char* packed, int64_t i) {
+    // same operations as in packed_r_value::unpack, to get identical rounding
+    const __m256 value = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + 2 * i))));
+    return _mm256_add_ps(_mm256_set1_ps(-1.0f), _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(2.0f), value), _mm256_set1_ps(65535.0f)));
+  }
+#endif
+};
+
+template<> struct LdRDecoder<LdRCodec_Uint8_R2> {
+  static float decode(const unsigned char* packed, int64_t i) { return uint8_r2_table()[packed[i]]; }
+#ifdef __AVX2__
+  static __m256 decode8(const unsigned char* packed, int64_t i) {
+    const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(packed + i)));
+    return _mm256_i32gather_ps(uint8_r2_table(), index, sizeof(float));
+  }
+#endif
+};
+
+template<> struct LdRDecoder<LdRCodec_Fp16_R> {
+  static float decode(const unsigned char* packed, int64_t i) { return half_to_float(reinterpret_cast<const uint16_t*>(packed)[i]); }
+#ifdef __AVX2__
+  static __m256 decode8(const unsigned char* packed, int64_t i) {
+#ifdef __F16C__
+    return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + 2 * i)));
+#else
+    float values[8];
+    for (int k = 0; k < 8; k++) values[k] = decode(packed, i + k);
+    return _mm256_loadu_ps(values);
+#endif
+  }
+#endif
+};
+
+// Single pass over a row that has just been decoded by vsdec32 (so it's still in L1 cache):
+// - prefix sum over delta-encoded tag indices (in place)
+// - conversion of packed r values into float
+// Both buffers must be aligned at 32 bytes. The scalar loop handles the tail, and is the fallback on CPUs without AVX2.
+template<LdRCodec codec>
+static void decode_ld_row(int64_t numel, uint32_t* tag_index, const unsigned char* packed_r, float* r) {
+  int64_t i = 0;
+  uint32_t prev = 0;
+#ifdef __AVX2__
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i last_of_low_lane = _mm256_set1_epi32(3);
+  const __m256i last = _mm256_set1_epi32(7);
+  __m256i carry = zero;
+  for (; (i + 8) <= numel; i += 8) {
+    __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(tag_index + i));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));  // prefix sum within each 128-bit lane
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    x = _mm256_add_epi32(x, _mm256_blend_epi32(zero, _mm256_permutevar8x32_epi32(x, last_of_low_lane), 0xF0));  // add low lane total to the high lane
+    x = _mm256_add_epi32(x, carry);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tag_index + i), x);
+    carry = _mm256_permutevar8x32_epi32(x, last);
+
+    _mm256_store_ps(r + i, LdRDecoder<codec>::decode8(packed_r, i));
+  }
+  prev = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_castsi256_si128(carry)));
+#endif
+  for (; i < numel; i++) {
+    prev += tag_index[i];
+    tag_index[i] = prev;
+    r[i] = LdRDecoder<codec>::decode(packed_r, i);
+  }
+}
+
+// Decodes a column of the CSR structure from a transposed index (lower triangle in symmetric storage, or tag-major index):
+// positions of the elements in csr_ld_r_ are decoded from deltas, the first one relative to ld_index_reference,
+// and the rows they belong to (i.e. snp indices) are found by walking csr_ld_snp_index_.
+template<LdRCodec codec>
+static void decode_ld_column(int64_t numel, const uint32_t* ld_index_delta, int64_t ld_index_reference, const LdVector<int64_t>& csr_ld_snp_index,
+                             int snp_index_from_inclusive, const unsigned char* packed_r, int* snp_index, float* r) {
+  int64_t ld_index = ld_index_reference - ld_index_delta[0];
+  int row = std::upper_bound(csr_ld_snp_index.begin(), csr_ld_snp_index.end(), ld_index) - csr_ld_snp_index.begin() - 1;
+  for (int64_t i = 0; i < numel; i++) {
+    if (i > 0) ld_index += ld_index_delta[i];
+    while (csr_ld_snp_index[row + 1] <= ld_index) row++;
+    snp_index[i] = row + snp_index_from_inclusive;
+    r[i] = LdRDecoder<codec>::decode(packed_r, ld_index);
+  }
+}
+
+static void decode_ld_column(LdRCodec codec, int64_t numel, const uint32_t* ld_index_delta, int64_t ld_index_reference, const LdVector<int64_t>& csr_ld_snp_index,
+                             int snp_index_from_inclusive, const unsigned char* packed_r, int* snp_index, float* r) {
+  switch (codec) {
+    case LdRCodec_Uint16_R:
+      decode_ld_column<LdRCodec_Uint16_R>(numel, ld_index_delta, ld_index_reference, csr_ld_snp_index, snp_index_from_inclusive, packed_r, snp_index, r);
+      break;
+    case LdRCodec_Uint8_R2:
+      decode_ld_column<LdRCodec_Uint8_R2>(numel, ld_index_delta, ld_index_reference, csr_ld_snp_index, snp_index_from_inclusive, packed_r, snp_index, r);
+      break;
+    case LdRCodec_Fp16_R:
+      decode_ld_column<LdRCodec_Fp16_R>(numel, ld_index_delta, ld_index_reference, csr_ld_snp_index, snp_index_from_inclusive, packed_r, snp_index, r);
+      break;
+  }
+}
+
 void LdMatrixCsrChunk::extract_row(int snp_index, LdMatrixRow* row) {
+  static_assert(sizeof(packed_r_value) == sizeof(uint16_t), "packed_r_value is expected to be a plain uint16_t");
   const int64_t num_ld_r2 = this->num_ld_r2(snp_index);
-  row->tag_index_.reserve(VSDEC_NUMEL(num_ld_r2));
-  row->tag_index_.resize(num_ld_r2);  // std::vector.resize() never reduce capacity
+  const int64_t num_ld_r2_upper = ld_index_end(snp_index) - ld_index_begin(snp_index);
+  row->tag_index_.resize(num_ld_r2, VSDEC_NUMEL(num_ld_r2));
   row->r_.resize(num_ld_r2);
 
   // empty LD entry
   if (num_ld_r2 == 0) return;
 
-  vsdec32(this->csr_ld_tag_index_packed(snp_index), num_ld_r2, reinterpret_cast<unsigned int*>(&row->tag_index_[0]));
+  const unsigned char* packed_r = (ld_r_codec_ == LdRCodec_Uint16_R) ? reinterpret_cast<const unsigned char*>(csr_ld_r_.data()) : csr_ld_r_packed_.data();
+  if (num_ld_r2_upper > 0) {
+    vsdec32(const_cast<unsigned char*>(this->csr_ld_tag_index_packed(snp_index)), num_ld_r2_upper, reinterpret_cast<unsigned int*>(row->tag_index_.data()));
+
+    uint32_t* tag_index = reinterpret_cast<uint32_t*>(row->tag_index_.data());
+    const int64_t ld_index_begin = this->ld_index_begin(snp_index);
+    switch (ld_r_codec_) {
+      case LdRCodec_Uint16_R:
+        decode_ld_row<LdRCodec_Uint16_R>(num_ld_r2_upper, tag_index, packed_r + 2 * ld_index_begin, row->r_.data());
+        break;
+      case LdRCodec_Uint8_R2:
+        decode_ld_row<LdRCodec_Uint8_R2>(num_ld_r2_upper, tag_index, packed_r + ld_index_begin, row->r_.data());
+        break;
+      case LdRCodec_Fp16_R:
+        decode_ld_row<LdRCodec_Fp16_R>(num_ld_r2_upper, tag_index, packed_r + 2 * ld_index_begin, row->r_.data());
+        break;
+    }
+  }
 
-  compute_prefix_sum_inplace(reinterpret_cast<uint32_t*>(&row->tag_index_[0]), num_ld_r2, 0);
+  // in symmetric storage the lower triangle goes first, so that tag indices remain sorted
+  const int64_t num_ld_r2_lower = num_ld_r2 - num_ld_r2_upper;
+  if (num_ld_r2_lower == 0) return;
+  std::memmove(row->tag_index_.data() + num_ld_r2_lower, row->tag_index_.data(), num_ld_r2_upper * sizeof(int));
+  std::memmove(row->r_.data() + num_ld_r2_lower, row->r_.data(), num_ld_r2_upper * sizeof(float));
+
+  const int64_t column = snp_index - snp_index_from_inclusive_;
+  row->ld_index_delta_.resize(num_ld_r2_lower, VSDEC_NUMEL(num_ld_r2_lower));
+  vsdec32(const_cast<unsigned char*>(&csr_ld_lower_packed_[csr_ld_lower_offset_[column]]), num_ld_r2_lower, reinterpret_cast<unsigned int*>(row->ld_index_delta_.data()));
+  decode_ld_column(ld_r_codec_, num_ld_r2_lower, row->ld_index_delta_.data(), ld_index_begin(snp_index), csr_ld_snp_index_, snp_index_from_inclusive_,
+                   packed_r, row->tag_index_.data(), row->r_.data());
+}
 
-  const int64_t ld_index_begin = this->ld_index_begin(snp_index);
-  const int64_t ld_index_end = this->ld_index_end(snp_index);
-  for (int64_t ld_index = ld_index_begin; ld_index < ld_index_end; ld_index++) {
-    row->r_.at(ld_index - ld_index_begin) = this->csr_ld_r_[ld_index];
-  }
+void LdMatrixCsrChunk::extract_tag_row(int tag_index, LdMatrixRow* row) {
+  const int t = tag_index - tag_index_from_inclusive_;
+  const int64_t numel = has_tag_major() ? (csr_ld_tag_major_index_[t + 1] - csr_ld_tag_major_index_[t]) : 0;
+  row->tag_index_.resize(numel, VSDEC_NUMEL(numel));
+  row->r_.resize(numel);
+  if (numel == 0) return;
+
+  row->ld_index_delta_.resize(numel, VSDEC_NUMEL(numel));
+  vsdec32(const_cast<unsigned char*>(&csr_ld_tag_major_packed_[csr_ld_tag_major_offset_[t]]), numel, reinterpret_cast<unsigned int*>(row->ld_index_delta_.data()));
+  const unsigned char* packed_r = (ld_r_codec_ == LdRCodec_Uint16_R) ? reinterpret_cast<const unsigned char*>(csr_ld_r_.data()) : csr_ld_r_packed_.data();
+  decode_ld_column(ld_r_codec_, numel, row->ld_index_delta_.data(), ld_index_end(tag_major_snp_index_[t]), csr_ld_snp_index_, snp_index_from_inclusive_,
+                   packed_r, row->tag_index_.data(), row->r_.data());
 }
 
-void LdMatrixCsr::extract_row(int snp_index, LdMatrixRow* row) {
-  const int chr_label = mapping_.chrnumvec()[snp_index];
-  LdMatrixCsrChunk& chunk = chunks_[chr_label];
-  chunk.extract_row(snp_index, row);
+// Chunks are ordered by snp index, and cover all snps without gaps.
+// The lookup does not use mapping_ because LD structure may outlive the context it was created by (see BgmgCalculator::share_ld).
+LdMatrixCsrChunk& LdMatrixCsr::find_chunk(int snp_index) {
+  auto iter = std::upper_bound(chunks_.begin(), chunks_.end(), snp_index,
+                               [](int snp_index, const LdMatrixCsrChunk& chunk) { return snp_index < chunk.snp_index_to_exclusive_; });
+  return *iter;
 }
 
-int LdMatrixCsr::num_ld_r2(int snp_index) {
-  const int chr_label = mapping_.chrnumvec()[snp_index];
+// Same as find_chunk, but by tag index; tag ranges of the chunks are ordered in the same way as snp ranges (see init_chunks).
+LdMatrixCsrChunk& LdMatrixCsr::find_tag_chunk(int tag_index) {
+  auto iter = std::upper_bound(chunks_.begin(), chunks_.end(), tag_index,
+                               [](int tag_index, const LdMatrixCsrChunk& chunk) { return tag_index < chunk.tag_index_to_exclusive_; });
+  return *iter;
+}
+
+// Returns a resident copy of an on-demand chunk, loading it if needed.
+// Eviction only drops the reference held by on_demand_chunks_, so the returned pointer stays valid
+// for the caller even if another thread evicts the chunk in the meantime.
+std::shared_ptr<LdMatrixCsrChunk> LdMatrixCsr::acquire_chunk(int chr_label) {
+  OnDemandChunk& on_demand = *on_demand_chunks_[chr_label];
+  std::lock_guard<std::mutex> lock(on_demand_mutex_);
+  if (on_demand.resident != nullptr) return on_demand.resident;
+
   const LdMatrixCsrChunk& chunk = chunks_[chr_label];
-  return chunk.num_ld_r2(snp_index);
+  std::shared_ptr<LdMatrixCsrChunk> resident = std::make_shared<LdMatrixCsrChunk>();
+  resident->snp_index_from_inclusive_ = chunk.snp_index_from_inclusive_;
+  resident->snp_index_to_exclusive_ = chunk.snp_index_to_exclusive_;
+  resident->chr_label_ = chunk.chr_label_;
+  load_ld_matrix_mapped_csr(on_demand.filename, resident.get());
+  if (resident->num_ld_r() != chunk.num_ld_r()) BGMG_THROW_EXCEPTION(::std::runtime_error(on_demand.filename + " has changed since it was loaded"));
+  on_demand.resident_bytes = resident->csr_ld_tag_index_offset_.size() * sizeof(uint64_t) + resident->csr_ld_tag_index_packed_.size() +
+                             resident->csr_ld_r_.size() * sizeof(packed_r_value) + resident->csr_ld_r_packed_.size();
+
+  // evict least recently used chunks; the chunk being loaded is always allowed, even if it alone exceeds the budget
+  while ((resident_bytes_ + on_demand.resident_bytes) > memory_budget_bytes_) {
+    OnDemandChunk* victim = nullptr;
+    for (auto& candidate : on_demand_chunks_) {
+      if ((candidate == nullptr) || (candidate.get() == &on_demand) || (candidate->resident == nullptr)) continue;
+      if ((victim == nullptr) || (candidate->last_access.load(std::memory_order_relaxed) < victim->last_access.load(std::memory_order_relaxed))) victim = candidate.get();
+    }
+    if (victim == nullptr) break;
+    victim->resident_ptr.store(nullptr, std::memory_order_release);
+    victim->resident.reset();
+    resident_bytes_ -= victim->resident_bytes;
+  }
+
+  resident_bytes_ += on_demand.resident_bytes;
+  on_demand_loads_++;
+  on_demand.last_access.store(on_demand_clock_.fetch_add(1) + 1, std::memory_order_relaxed);
+  on_demand.resident = resident;
+  on_demand.resident_ptr.store(resident.get(), std::memory_order_release);
+  return resident;
+}
+
+// Returns an on-demand chunk for extract_row, pinned by the row (i.e. by the calling thread) until it is evicted.
+// While the pinned chunk is still resident, this takes no locks and does not touch reference counts.
+// After eviction the row keeps the chunk mapped until its next miss (when all stale pins are dropped) or until the row is destroyed;
+// cost calculators create rows per parallel region, so evicted chunks are released by the end of the region at the latest.
+LdMatrixCsrChunk* LdMatrixCsr::pin_chunk(int chr_label, LdMatrixRow* row) {
+  OnDemandChunk& on_demand = *on_demand_chunks_[chr_label];
+  const uint64_t now = on_demand_clock_.load(std::memory_order_relaxed);
+  if (on_demand.last_access.load(std::memory_order_relaxed) != now) on_demand.last_access.store(now, std::memory_order_relaxed);
+
+  std::vector<std::shared_ptr<LdMatrixCsrChunk>>& pinned = row->pinned_chunks_;
+  if ((chr_label < pinned.size()) && (pinned[chr_label] != nullptr) && (pinned[chr_label].get() == on_demand.resident_ptr.load(std::memory_order_acquire)))
+    return pinned[chr_label].get();
+
+  if (pinned.size() < on_demand_chunks_.size()) pinned.resize(on_demand_chunks_.size());
+  for (int i = 0; i < pinned.size(); i++) {
+    if (pinned[i] == nullptr) continue;
+    const bool stale = (i >= on_demand_chunks_.size()) || (on_demand_chunks_[i] == nullptr) || (pinned[i].get() != on_demand_chunks_[i]->resident_ptr.load(std::memory_order_acquire));
+    if (stale) pinned[i].reset();
+  }
+  pinned[chr_label] = acquire_chunk(chr_label);
+  return pinned[chr_label].get();
+}
+
+void LdMatrixCsr::extract_row(int snp_index, LdMatrixRow* row) {
+  LdMatrixCsrChunk& chunk = find_chunk(snp_index);
+  if (is_on_demand(chunk.chr_label_)) pin_chunk(chunk.chr_label_, row)->extract_row(snp_index, row);
+  else chunk.extract_row(snp_index, row);
 }
 
-int LdMatrixIterator::tag_index() const { return parent_->tag_index_[ld_index_]; }
-float LdMatrixIterator::r() const { return parent_->r_[ld_index_].get(); }
-float LdMatrixIterator::r2() const { float r = parent_->r_[ld_index_].get(); return r*r; }
+void LdMatrixCsr::extract_tag_row(int tag_index, LdMatrixRow* row) {
+  find_tag_chunk(tag_index).extract_tag_row(tag_index, row);
+}
 
+int LdMatrixCsr::num_ld_r2(int snp_index) {
+  return find_chunk(snp_index).num_ld_r2(snp_index);
+}
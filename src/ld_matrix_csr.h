@@ -24,12 +24,15 @@
 #include <vector>
 #include <tuple>
 #include <numeric>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <mutex>
 
-#include "bgmg_log.h"
+#include <immintrin.h>  // _mm_malloc, _mm_free
 
-#if _OPENMP >= 200805
-#include "parallel_stable_sort.h"
-#endif
+#include "bgmg_log.h"
 
 #define LD_TAG_COMPONENT_COUNT 2
 #define LD_TAG_COMPONENT_BELOW_R2MIN 0
@@ -49,12 +52,15 @@ class packed_r_value {
     static bool initialized;
     if (!initialized) {
       initialized = true;
-      for (int i = 0; i < 65536; i++) data_[i] = -1.0f + 2.0f * static_cast<float>(i) / 65535.0f;
+      for (int i = 0; i < 65536; i++) data_[i] = unpack(i);
     }
 
     return data_[value_];
   }
 
+  // must give bit-identical results with the vectorized conversion in LdMatrixCsrChunk::extract_row
+  static float unpack(uint16_t value) { return -1.0f + 2.0f * static_cast<float>(value) / 65535.0f; }
+
  private:
   uint16_t value_;
   friend inline bool operator <(const packed_r_value& lhs, const packed_r_value& rhs);
@@ -65,6 +71,70 @@ inline bool operator <(const packed_r_value& lhs, const packed_r_value& rhs)
   return lhs.value_ < rhs.value_;
 }
 
+// Encoding of LD r values in a finalized CSR structure (set_option("ld_r_codec", ...)).
+// While CSR is being built the values are always kept as packed_r_value (LdRCodec_Uint16_R);
+// other codecs are applied at the end of set_ld_r2_csr, see LdMatrixCsrChunk::encode_ld_r.
+enum LdRCodec {
+  LdRCodec_Uint16_R = 0,   // 16-bit fixed point r, same as packed_r_value
+  LdRCodec_Uint8_R2 = 1,   // 8-bit fixed point r2; the sign of r is lost, and r is reported as sqrt(r2)
+  LdRCodec_Fp16_R = 2,     // IEEE 754 half precision r
+};
+
+inline bool ld_r_codec_has_sign(LdRCodec codec) { return codec != LdRCodec_Uint8_R2; }
+inline size_t ld_r_codec_bytes(LdRCodec codec) { return (codec == LdRCodec_Uint8_R2) ? 1 : 2; }
+
+// A vector that either owns its data (std::vector), or is a read-only view into external memory,
+// typically a memory-mapped LD file (see load_ld_matrix_mapped). In the later case owner_ keeps the mapping alive.
+// Any modification detaches the view by making a private copy of the data.
+template<typename T>
+class LdVector {
+ public:
+  LdVector() : view_(nullptr), view_size_(0) {}
+
+  size_t size() const { return (owner_ != nullptr) ? view_size_ : vec_.size(); }
+  bool empty() const { return size() == 0; }
+  bool is_view() const { return owner_ != nullptr; }
+
+  // writing through a view is not allowed (pages are mapped read-only)
+  T* data() { return (owner_ != nullptr) ? const_cast<T*>(view_) : vec_.data(); }
+  const T* data() const { return (owner_ != nullptr) ? view_ : vec_.data(); }
+  T& operator[](size_t index) { return data()[index]; }
+  const T& operator[](size_t index) const { return data()[index]; }
+  T* begin() { return data(); }
+  T* end() { return data() + size(); }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + size(); }
+  T& back() { return data()[size() - 1]; }
+  const T& back() const { return data()[size() - 1]; }
+
+  void resize(size_t numel) { detach(); vec_.resize(numel); }
+  void resize(size_t numel, const T& value) { detach(); vec_.resize(numel, value); }
+  void reserve(size_t numel) { detach(); vec_.reserve(numel); }
+  void push_back(const T& value) { detach(); vec_.push_back(value); }
+  void shrink_to_fit() { detach(); vec_.shrink_to_fit(); }
+  void clear() { reset_view(); vec_.clear(); }
+
+  void assign_view(const T* data, size_t numel, std::shared_ptr<const void> owner) {
+    vec_.clear(); vec_.shrink_to_fit();
+    view_ = data; view_size_ = numel; owner_ = owner;
+  }
+
+  // make a private copy of the data, and release the view
+  void detach() {
+    if (owner_ == nullptr) return;
+    vec_.assign(view_, view_ + view_size_);
+    reset_view();
+  }
+
+ private:
+  void reset_view() { view_ = nullptr; view_size_ = 0; owner_.reset(); }
+
+  std::vector<T> vec_;
+  const T* view_;
+  size_t view_size_;
+  std::shared_ptr<const void> owner_;
+};
+
 // An interface to provide the following information:
 // - how many snps are there in the reference, and which of them are available in GWAS ("tag snps")
 // - chromosome label for each snp
@@ -110,6 +180,12 @@ public:
     ld_tag_sum_r4_[total_ld_component][tag_index] += (r2_times_hval * r2_times_hval);
   }
 
+  // overwrite r2 and r4 sums of a given component (0 to num_ld_components, the later being the total)
+  void assign(int ld_component, int tag_index, float r2_sum, float r4_sum) {
+    ld_tag_sum_r2_[ld_component][tag_index] = r2_sum;
+    ld_tag_sum_r4_[ld_component][tag_index] = r4_sum;
+  }
+
   const std::vector<float>& ld_tag_sum_r2() const { return ld_tag_sum_r2_[total_ld_component]; }
   const std::vector<float>& ld_tag_sum_r4() const { return ld_tag_sum_r4_[total_ld_component]; }
   const std::vector<float>& ld_tag_sum_r2(int ld_component) const { return ld_tag_sum_r2_[ld_component]; }
@@ -125,11 +201,50 @@ private:
   const int total_ld_component;
 };
 
+// Growable buffer, aligned for SIMD loads and stores.
+// Capacity never shrinks, so a buffer can be re-used across many calls without re-allocating memory.
+// The content is not preserved when the buffer grows.
+template<typename T>
+class AlignedBuffer {
+ public:
+  static const size_t alignment = 64;
+  AlignedBuffer() : data_(nullptr), size_(0), capacity_(0) {}
+  ~AlignedBuffer() { if (data_ != nullptr) _mm_free(data_); }
+
+  // capacity might be larger than size (for example, vsdec32 writes a few elements past the end)
+  void resize(size_t numel) { resize(numel, numel); }
+  void resize(size_t numel, size_t capacity) {
+    if (capacity > capacity_) {
+      if (data_ != nullptr) _mm_free(data_);
+      data_ = static_cast<T*>(_mm_malloc(capacity * sizeof(T), alignment));
+      if (data_ == nullptr) throw std::bad_alloc();
+      capacity_ = capacity;
+    }
+    size_ = numel;
+  }
+
+  size_t size() const { return size_; }
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  T& operator[](size_t index) { return data_[index]; }
+  const T& operator[](size_t index) const { return data_[index]; }
+
+ private:
+  AlignedBuffer(const AlignedBuffer&);
+  AlignedBuffer& operator=(const AlignedBuffer&);
+
+  T* data_;
+  size_t size_;
+  size_t capacity_;
+};
+
 class LdMatrixRow; 
 
 // Class to store LD matrix for a given chromosome (or chunk) in CSR format
 class LdMatrixCsrChunk {
  public:
+  LdMatrixCsrChunk() : ld_r_codec_(LdRCodec_Uint16_R), tag_index_from_inclusive_(0), tag_index_to_exclusive_(0) {}
+
   std::vector<std::tuple<int, int, packed_r_value>> coo_ld_; // snp, tag, r
 
   // csr_ld_snp_index_.size() == num_snps_in_chunk() + 1; 
@@ -137,19 +252,60 @@ class LdMatrixCsrChunk {
   // csr_ld_tag_index_.size() == csr_ld_r_.size() == number of non-zero LD r values
   // csr_ld_tag_index_ contains values from 0 to num_tag_-1
   // csr_ld_r_ contains values from -1 to 1, indicating LD allelic correlation (r) between snp and tag variants
-  std::vector<int64_t> csr_ld_snp_index_;
-  std::vector<uint64_t> csr_ld_tag_index_offset_;      // pointers to csr_ld_tag_index_packed_ (location where to decompress)
-                                                       // number of elements to decompress can be deduced from csr_ld_snp_index_
-  std::vector<unsigned char> csr_ld_tag_index_packed_;  // packed csr_ld_tag_index (delta-encoded, then compressed with TurboPFor vsenc32 algorithm).
-                                                        // The buffer has some extra capacity (as required by TurboPFor vsenc32/vdec32 algorithms).
-  std::vector<packed_r_value> csr_ld_r_;
-  
-  unsigned char* csr_ld_tag_index_packed(int snp_index) {
+  // All four vectors are either owned by the chunk, or are views onto a memory-mapped file (see is_mapped()).
+  LdVector<int64_t> csr_ld_snp_index_;
+  LdVector<uint64_t> csr_ld_tag_index_offset_;      // pointers to csr_ld_tag_index_packed_ (location where to decompress)
+                                                    // number of elements to decompress can be deduced from csr_ld_snp_index_
+  LdVector<unsigned char> csr_ld_tag_index_packed_;  // packed csr_ld_tag_index (delta-encoded, then compressed with TurboPFor vsenc32 algorithm).
+                                                     // The buffer has some extra capacity (as required by TurboPFor vsenc32/vdec32 algorithms).
+  LdVector<packed_r_value> csr_ld_r_;
+
+  // with ld_r_codec_ other than LdRCodec_Uint16_R csr_ld_r_ is empty, and r values are stored in csr_ld_r_packed_
+  // (ld_r_codec_bytes(ld_r_codec_) bytes per value)
+  LdRCodec ld_r_codec_;
+  LdVector<unsigned char> csr_ld_r_packed_;
+
+  // Symmetric storage (set_option("ld_symmetric", 1), requires tag_index == snp_index for all snps, see make_symmetric).
+  // Rows of the CSR structure keep only the upper triangle (tag_index >= snp_index, including the diagonal);
+  // the lower triangle of j-th row is read from the rows above it through a transposed index:
+  // csr_ld_lower_index_[j]..csr_ld_lower_index_[j+1] is a range of entries in j-th column below the diagonal,
+  // and csr_ld_lower_packed_ holds their positions in csr_ld_r_ (ld_index) in increasing order. Positions are delta-encoded,
+  // the first one as a distance back from ld_index_begin of j-th row, then compressed with TurboPFor vsenc32 algorithm.
+  // All three vectors are empty if the storage is not symmetric.
+  LdVector<int64_t> csr_ld_lower_index_;
+  LdVector<uint64_t> csr_ld_lower_offset_;           // pointers to csr_ld_lower_packed_
+  LdVector<unsigned char> csr_ld_lower_packed_;
+  bool is_symmetric() const { return !csr_ld_lower_index_.empty(); }
+
+  // Tag-major index (set_option("ld_tag_major", 1), see make_tag_major) - a transposed view of the CSR structure, mapping each tag
+  // to all snps in LD with it, without requiring tag_index == snp_index. Tags of the chunk are [tag_index_from_inclusive_, tag_index_to_exclusive_);
+  // csr_ld_tag_major_index_[t]..csr_ld_tag_major_index_[t+1] is a range of entries for t-th tag of the chunk, and csr_ld_tag_major_packed_ holds
+  // their positions in csr_ld_r_ (ld_index) in increasing order. Positions are delta-encoded, the first one as a distance back from
+  // ld_index_end of the tag's own row (tag_major_snp_index_[t]), then compressed with TurboPFor vsenc32 algorithm.
+  // All four vectors are empty if the index is not built.
+  LdVector<int64_t> csr_ld_tag_major_index_;
+  LdVector<uint64_t> csr_ld_tag_major_offset_;       // pointers to csr_ld_tag_major_packed_
+  LdVector<unsigned char> csr_ld_tag_major_packed_;
+  LdVector<int> tag_major_snp_index_;
+  bool has_tag_major() const { return !csr_ld_tag_major_index_.empty(); }
+
+  const unsigned char* csr_ld_tag_index_packed(int snp_index) const {
     return &csr_ld_tag_index_packed_[csr_ld_tag_index_offset_[snp_index - snp_index_from_inclusive_]];
   }
 
+  // true if CSR structure is finalized and shared with other processes through a read-only memory-mapped file
+  bool is_mapped() const { return csr_ld_snp_index_.is_view(); }
+
+  // total number of non-zero LD r values in the chunk
+  int64_t num_ld_r() const { return csr_ld_snp_index_.empty() ? 0 : csr_ld_snp_index_.back(); }
+
+  // number of LD r values in a row, including the lower triangle in symmetric storage
   int64_t num_ld_r2(int snp_index) const {
-    return ld_index_end(snp_index) - ld_index_begin(snp_index);
+    return ld_index_end(snp_index) - ld_index_begin(snp_index) + (is_symmetric() ? num_ld_r2_lower(snp_index) : 0);
+  }
+
+  int64_t num_ld_r2_lower(int snp_index) const {
+    return csr_ld_lower_index_[snp_index - snp_index_from_inclusive_ + 1] - csr_ld_lower_index_[snp_index - snp_index_from_inclusive_];
   }
 
   int64_t ld_index_begin(int snp_index) const {
@@ -168,10 +324,20 @@ class LdMatrixCsrChunk {
   int num_snps_in_chunk() const { return snp_index_to_exclusive_ - snp_index_from_inclusive_; }
   bool is_empty() const { return snp_index_to_exclusive_ == snp_index_from_inclusive_; }
 
-  int64_t set_ld_r2_csr(TagToSnpMapping* mapping);
+  // tag indices of the snps in the chunk, [tag_index_from_inclusive_, tag_index_to_exclusive_) (see LdMatrixCsr::init_chunks)
+  int tag_index_from_inclusive_;
+  int tag_index_to_exclusive_;
+  int num_tags_in_chunk() const { return tag_index_to_exclusive_ - tag_index_from_inclusive_; }
+
+  int64_t set_ld_r2_csr(TagToSnpMapping* mapping, bool symmetric = false, bool tag_major = false);
   int64_t validate_ld_r2_csr(const std::vector<uint32_t>& csr_ld_tag_index, TagToSnpMapping& mapping);  // validate
   float find_and_retrieve_ld_r2(int snp_index, int tag_index, const std::vector<uint32_t>& csr_ld_tag_index);  // nan if doesn't exist.
   void extract_row(int snp_index, LdMatrixRow* row);
+  void extract_tag_row(int tag_index, LdMatrixRow* row);  // all snps in LD with the tag, requires has_tag_major()
+  void pack_ld_r2_csr(std::vector<uint32_t>* csr_ld_tag_index);  // populate csr_ld_tag_index_offset_ and csr_ld_tag_index_packed_ (modifies csr_ld_tag_index)
+  void make_symmetric(std::vector<uint32_t>* csr_ld_tag_index, TagToSnpMapping& mapping);  // drop the lower triangle and populate csr_ld_lower_* (call before pack_ld_r2_csr)
+  void make_tag_major(const std::vector<uint32_t>& csr_ld_tag_index, TagToSnpMapping& mapping);  // populate csr_ld_tag_major_* (call before pack_ld_r2_csr, after make_symmetric)
+  void encode_ld_r(LdRCodec codec);  // move csr_ld_r_ into csr_ld_r_packed_ (no-op for LdRCodec_Uint16_R and memory-mapped chunks)
 
   size_t log_diagnostics();
   void clear();
@@ -212,34 +378,55 @@ inline int operator -(const LdMatrixIterator& lhs, const LdMatrixIterator& rhs)
   return lhs.ld_index_ - rhs.ld_index_;
 }
 
+// Decoded row of the LD matrix. Tag indices and r values are unpacked into reusable aligned buffers,
+// so it's best to keep one LdMatrixRow per thread and pass it to many extract_row calls.
 class LdMatrixRow {
 public:
   LdMatrixIterator begin() { return LdMatrixIterator(0, this); }
   LdMatrixIterator end() { return LdMatrixIterator(tag_index_.size(), this); }
 private:
-  std::vector<int> tag_index_;
-  std::vector<packed_r_value> r_;
+  AlignedBuffer<int> tag_index_;
+  AlignedBuffer<float> r_;
+  AlignedBuffer<uint32_t> ld_index_delta_;  // scratch buffer for transposed indices (symmetric storage, tag-major index)
+  std::vector<std::shared_ptr<LdMatrixCsrChunk>> pinned_chunks_;  // on-demand chunks used by this row, indexed by chr_label (see LdMatrixCsr::pin_chunk)
   friend class LdMatrixIterator;
   friend class LdMatrixCsr;
   friend class LdMatrixCsrChunk;
 };
 
+// defined inline because these are called in the innermost loops of all cost calculators
+inline int LdMatrixIterator::tag_index() const { return parent_->tag_index_[ld_index_]; }
+inline float LdMatrixIterator::r() const { return parent_->r_[ld_index_]; }
+inline float LdMatrixIterator::r2() const { float r = parent_->r_[ld_index_]; return r*r; }
+
 // Class for sparse LD matrix stored in CSR format (Compressed Sparse Row Format)
 class LdMatrixCsr {
  public:
-   LdMatrixCsr(TagToSnpMapping& mapping) : mapping_(mapping) {}
+   // memory_budget_bytes > 0 enables on-demand loading of chunks from memory-mapped LD files (see acquire_chunk).
+   // The budget applies to the bytes mapped for resident chunks (resident_bytes_), not to the resident set size of the process:
+   // the OS pages mapped files in and out on its own. Chunks stay mapped after eviction while some LdMatrixRow still pins them.
+   // symmetric enables symmetric storage (see LdMatrixCsrChunk::make_symmetric)
+   // tag_major builds the tag-major index (see LdMatrixCsrChunk::make_tag_major)
+   LdMatrixCsr(TagToSnpMapping& mapping, LdRCodec ld_r_codec = LdRCodec_Uint16_R, size_t memory_budget_bytes = 0, bool symmetric = false, bool tag_major = false)
+     : mapping_(mapping), ld_r_codec_(ld_r_codec), symmetric_(symmetric), tag_major_(tag_major), memory_budget_bytes_(memory_budget_bytes), resident_bytes_(0), on_demand_clock_(0), on_demand_loads_(0) {}
 
    int64_t set_ld_r2_coo(int chr_label, int64_t length, int* snp_index, int* tag_index, float* r, float r2_min);
    int64_t set_ld_r2_coo(int chr_label, const std::string& filename, float r2_min);
    int64_t set_ld_r2_coo_version0(int chr_label, const std::string& filename, float r2_min);
    int64_t set_ld_r2_csr(float r2_min, int chr_label);  // finalize
+   int64_t set_ld_r2_csr_from_file(int chr_label, const std::string& filename, float r2_min);  // load finalized chunk from a memory-mapped file
+   int64_t save_ld_r2_csr(int chr_label, const std::string& filename, float r2_min, TagToSnpMapping& mapping);  // save finalized chunk for set_ld_r2_csr_from_file
 
    bool is_ready() { return !empty() && std::all_of(chunks_.begin(), chunks_.end(), [](LdMatrixCsrChunk& chunk) { return chunk.coo_ld_.empty(); }); }
-   int64_t size() { return std::accumulate(chunks_.begin(), chunks_.end(), 0, [](int64_t sum, LdMatrixCsrChunk& chunk) {return sum + chunk.csr_ld_r_.size(); }); }
+   int64_t size() { return std::accumulate(chunks_.begin(), chunks_.end(), 0, [](int64_t sum, LdMatrixCsrChunk& chunk) {return sum + chunk.num_ld_r(); }); }
+   bool has_r_sign() { return std::all_of(chunks_.begin(), chunks_.end(), [](LdMatrixCsrChunk& chunk) { return ld_r_codec_has_sign(chunk.ld_r_codec_); }); }
    bool empty() { return (size() == 0); }
 
    void extract_row(int snp_index, LdMatrixRow* row);  // retrieve all LD r2 entries for given snp_index
    int num_ld_r2(int snp_index);  // how many LD r2 entries is there for snp_index
+   void extract_tag_row(int tag_index, LdMatrixRow* row);  // retrieve all LD r2 entries for given tag_index; row's tag_index() are snp indices
+   bool is_tag_major() const { return tag_major_; }
+   int64_t on_demand_loads() const { return on_demand_loads_; }  // how many times chunks were loaded on demand, including re-loads after eviction
 
    const LdTagSum* ld_tag_sum_adjust_for_hvec() { return ld_tag_sum_adjust_for_hvec_.get(); }
    const LdTagSum* ld_tag_sum() { return ld_tag_sum_.get(); }
@@ -248,10 +435,39 @@ class LdMatrixCsr {
    void clear();
    void init_chunks();
 private:
+  int64_t set_ld_r2_csr_from_chunk(int chr_label, LdMatrixCsrChunk& file_chunk, float r2_min);
+  bool has_only_diagonal(const LdMatrixCsrChunk& chunk);
+  LdMatrixCsrChunk& find_chunk(int snp_index);
+  LdMatrixCsrChunk& find_tag_chunk(int tag_index);
+  std::shared_ptr<LdMatrixCsrChunk> acquire_chunk(int chr_label);
+  LdMatrixCsrChunk* pin_chunk(int chr_label, LdMatrixRow* row);
+  bool is_on_demand(int chr_label) const { return (chr_label < on_demand_chunks_.size()) && (on_demand_chunks_[chr_label] != nullptr); }
 
   TagToSnpMapping& mapping_;
+  LdRCodec ld_r_codec_;
+  bool symmetric_;
+  bool tag_major_;
   std::vector<LdMatrixCsrChunk> chunks_;  // split per chromosomes (before aggregation)
   
   std::shared_ptr<LdTagSum> ld_tag_sum_adjust_for_hvec_;
   std::shared_ptr<LdTagSum> ld_tag_sum_;
+
+  // Chunks loaded on demand from memory-mapped LD files, and evicted in approximately least-recently-used order
+  // when the total size of resident chunks exceeds memory_budget_bytes_.
+  // The clock advances only when a chunk is loaded, so accesses between two loads get the same stamp,
+  // and eviction can't tell which of the chunks used since the last load was used most recently.
+  // For such chunks chunks_[chr_label] keeps only csr_ld_snp_index_ (enough for num_ld_r2 and size()).
+  struct OnDemandChunk {
+    std::string filename;
+    std::shared_ptr<LdMatrixCsrChunk> resident;      // nullptr if evicted; guarded by on_demand_mutex_
+    std::atomic<LdMatrixCsrChunk*> resident_ptr;     // resident.get(), for lock-free checks in pin_chunk
+    std::atomic<uint64_t> last_access;               // value of on_demand_clock_ at the last access
+    size_t resident_bytes;
+  };
+  std::vector<std::unique_ptr<OnDemandChunk>> on_demand_chunks_;  // indexed by chr_label, nullptr for chunks that always stay in memory
+  std::mutex on_demand_mutex_;                                    // serializes loading and eviction
+  size_t memory_budget_bytes_;
+  size_t resident_bytes_;                                         // bytes mapped for resident chunks (not RSS)
+  std::atomic<uint64_t> on_demand_clock_;                         // advances with every load
+  int64_t on_demand_loads_;
 };
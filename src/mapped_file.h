@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+#include "bgmg_log.h"
+
+// Helpers for binary files that are read through a read-only memory mapping
+// (memory-mapped LD matrix files, see save_ld_matrix_mapped, and init snapshots, see BgmgCalculator::save_init_snapshot).
+// A file is a sequence of plain values (save_value) and vectors (save_aligned_vector).
+// Vector data is aligned at MAPPED_FILE_ALIGNMENT, so that it can be used in place from the mapping.
+
+#define MAPPED_FILE_ALIGNMENT 64  // part of the file formats - do not change
+
+template<typename T> class LdVector;
+
+template<typename T>
+void save_value(std::ofstream& os, T value) {
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// save numel, followed by the data aligned at MAPPED_FILE_ALIGNMENT boundary
+template<typename T>
+void save_aligned_vector(std::ofstream& os, const T* data, size_t numel) {
+  save_value(os, static_cast<uint64_t>(numel));
+  const size_t padding = (MAPPED_FILE_ALIGNMENT - (static_cast<size_t>(os.tellp()) % MAPPED_FILE_ALIGNMENT)) % MAPPED_FILE_ALIGNMENT;
+  const char zeros[MAPPED_FILE_ALIGNMENT] = { 0 };
+  os.write(zeros, padding);
+  if (numel > 0) os.write(reinterpret_cast<const char*>(data), numel * sizeof(T));
+}
+
+// sequential reader of a memory-mapped file, produced by save_value and save_aligned_vector
+class MappedReader {
+public:
+  MappedReader(const std::string& filename) : filename_(filename) {
+    try {
+      boost::interprocess::file_mapping file(filename.c_str(), boost::interprocess::read_only);
+      region_ = std::make_shared<boost::interprocess::mapped_region>(file, boost::interprocess::read_only);
+    } catch (const boost::interprocess::interprocess_exception& e) {
+      BGMG_THROW_EXCEPTION(::std::runtime_error("can't map " + filename + ": " + e.what()));
+    }
+    begin_ = static_cast<const char*>(region_->get_address());
+    end_ = begin_ + region_->get_size();
+    pos_ = begin_;
+  }
+
+  template<typename T>
+  T value() {
+    check_available(sizeof(T));
+    T value; memcpy(&value, pos_, sizeof(T)); pos_ += sizeof(T);
+    return value;
+  }
+
+  template<typename T>
+  void vector(LdVector<T>* vec) {
+    size_t numel; const T* data = aligned_vector<T>(&numel);
+    vec->assign_view(data, numel, region_);
+  }
+
+  template<typename T>
+  void vector(std::vector<T>* vec) {
+    size_t numel; const T* data = aligned_vector<T>(&numel);
+    vec->assign(data, data + numel);
+  }
+
+  template<typename T>
+  void skip_vector() {
+    size_t numel; aligned_vector<T>(&numel);
+  }
+
+  const std::string& filename() const { return filename_; }
+
+private:
+  template<typename T>
+  const T* aligned_vector(size_t* numel) {
+    *numel = static_cast<size_t>(value<uint64_t>());
+    const size_t offset = pos_ - begin_;
+    check_available((MAPPED_FILE_ALIGNMENT - (offset % MAPPED_FILE_ALIGNMENT)) % MAPPED_FILE_ALIGNMENT);
+    pos_ += (MAPPED_FILE_ALIGNMENT - (offset % MAPPED_FILE_ALIGNMENT)) % MAPPED_FILE_ALIGNMENT;
+    if (*numel > static_cast<size_t>(end_ - pos_) / sizeof(T)) BGMG_THROW_EXCEPTION(::std::runtime_error("unexpected end of file " + filename_));
+    const T* data = reinterpret_cast<const T*>(pos_);
+    pos_ += (*numel) * sizeof(T);
+    return data;
+  }
+
+  void check_available(size_t bytes) {
+    if (bytes > static_cast<size_t>(end_ - pos_)) BGMG_THROW_EXCEPTION(::std::runtime_error("unexpected end of file " + filename_));
+  }
+
+  std::string filename_;
+  std::shared_ptr<boost::interprocess::mapped_region> region_;
+  const char* begin_;
+  const char* end_;
+  const char* pos_;
+};
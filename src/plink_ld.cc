@@ -18,6 +18,16 @@
 
 #include "plink_ld.h"
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "bgmg_log.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 
 #define MULTIPLEX_LD 1920
 
@@ -636,13 +646,61 @@ uint32_t PlinkLdBedFileChunk::init(int num_subjects, int snp_start_index, int nu
   return 0;
 }
 
-double PlinkLdBedFileChunk::calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int snp_fixed_index, int snp_var_index) {
-  // The following routine is combined from plink's ld_block_thread() and ld_report_regular() in plink_ld.c
-  const SampleCountInfo sc(fixed_chunk.num_subj());
+uint32_t PlinkLdBedFileChunk::init(int num_subjects, int snp_start_index, int num_snps_in_chunk, const BedFileInMemory& bedfile) {
+  num_subj_ = num_subjects;
+  num_snps_in_chunk_ = num_snps_in_chunk;
+
+  const SampleCountInfo sc(num_subjects);
+  const bool is_x = false;  // no special processing for X chromosome
+  uintptr_t* founder_male_include2 = nullptr;  // not used when is_x == false
+
+  geno_vec.resize(num_snps_in_chunk * sc.founder_ct_192_long, 0);
+  geno_masks_vec.resize(num_snps_in_chunk * sc.founder_ct_192_long, 0);
+  ld_missing_cts_vec.resize(num_snps_in_chunk, 0);
+
+  if ((num_subjects != bedfile.num_subjects()) || (snp_start_index < 0) || (snp_start_index + num_snps_in_chunk > bedfile.num_snps())) {
+    return RET_READ_FAIL;
+  }
 
+  for (int snp_index = 0; snp_index < num_snps_in_chunk; snp_index++) {
+    // equivalent of load_and_collapse_incl, given that all samples are included (founder_ct == unfiltered_sample_ct)
+    uintptr_t* mainbuf = &(geno_vec[snp_index * sc.founder_ct_192_long]);
+    memcpy(mainbuf, bedfile.geno(snp_start_index + snp_index), sc.unfiltered_sample_ct4);
+    mainbuf[(sc.unfiltered_sample_ct - 1) / BITCT2] &= sc.final_mask;
+
+    ld_process_load2(mainbuf,
+                     &(geno_masks_vec[snp_index * sc.founder_ct_192_long]),
+                     &(ld_missing_cts_vec[snp_index]),
+                     sc.founder_ct, is_x, founder_male_include2);
+  }
+
+  return 0;
+}
+
+static inline double ld_corr_from_dot_prod(const int32_t* dp_result, uint32_t non_missing_ct) {
   const bool is_r2 = false;
   const bool keep_sign = false;
 
+  double non_missing_ctd = (double)((int32_t)non_missing_ct);
+  double dxx = dp_result[1];
+  double dyy = dp_result[2];
+  double cov12 = dp_result[0] * non_missing_ctd - dxx * dyy;
+  dxx = (dp_result[3] * non_missing_ctd + dxx * dxx) * (dp_result[4] * non_missing_ctd + dyy * dyy);
+  if (!is_r2) {
+    dxx = cov12 / sqrt(dxx);
+  } else if (!keep_sign) {
+    dxx = (cov12 * cov12) / dxx;
+  } else {
+    dxx = (fabs(cov12) * cov12) / dxx;
+  }
+
+  return dxx;
+}
+
+double PlinkLdBedFileChunk::calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int snp_fixed_index, int snp_var_index) {
+  // The following routine is combined from plink's ld_block_thread() and ld_report_regular() in plink_ld.c
+  const SampleCountInfo sc(fixed_chunk.num_subj());
+
   uintptr_t* mask_fixed_vec_ptr = &(fixed_chunk.geno_masks()[snp_fixed_index * sc.founder_ct_192_long]);
   uintptr_t* mask_var_vec_ptr = &(var_chunk.geno_masks()[snp_var_index * sc.founder_ct_192_long]);
   uintptr_t* geno_fixed_vec_ptr = &(fixed_chunk.geno()[snp_fixed_index * sc.founder_ct_192_long]);
@@ -665,18 +723,160 @@ double PlinkLdBedFileChunk::calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk,
   dp_result[4] = dp_result[2];
   ld_dot_prod(geno_var_vec_ptr, geno_fixed_vec_ptr, mask_var_vec_ptr, mask_fixed_vec_ptr, dp_result, sc.founder_ct_mld_m1, sc.founder_ct_mld_rem);
 
-  double non_missing_ctd = (double)((int32_t)non_missing_ct);
-  double dxx = dp_result[1];
-  double dyy = dp_result[2];
-  double cov12 = dp_result[0] * non_missing_ctd - dxx * dyy;
-  dxx = (dp_result[3] * non_missing_ctd + dxx * dxx) * (dp_result[4] * non_missing_ctd + dyy * dyy);
-  if (!is_r2) {
-    dxx = cov12 / sqrt(dxx);
-  } else if (!keep_sign) {
-    dxx = (cov12 * cov12) / dxx;
-  } else {
-    dxx = (fabs(cov12) * cov12) / dxx;
+  return ld_corr_from_dot_prod(dp_result, non_missing_ct);
+}
+
+// Popcounts that define ld_dot_prod() terms for a pair of SNPs, with var SNP as vec1 and fixed SNP as vec2.
+// "lo" and "hi" count low and high bits of 2-bit fields, so that popcount2(x) = lo + 2 * hi.
+struct LdPairCounts {
+  uint64_t dot_lo, dot_hi;      // zcheck | ((vec1 ^ vec2) & ~(m1 + zcheck)), see ld_dot_prod_batch()
+  uint64_t var_lo, var_hi;      // vec1 & mask2
+  uint64_t fixed_lo, fixed_hi;  // vec2 & mask1
+  uint64_t non_missing;         // mask1 & mask2, i.e. samples non-missing in both SNPs
+};
+
+static inline void ld_pair_counts_word(uintptr_t var_geno, uintptr_t fixed_geno, uintptr_t var_mask, uintptr_t fixed_mask, LdPairCounts* counts) {
+  const uintptr_t zcheck = (var_geno | fixed_geno) & FIVEMASK;
+  const uintptr_t dot = zcheck | ((var_geno ^ fixed_geno) & ~(FIVEMASK + zcheck));
+  const uintptr_t var_masked = var_geno & fixed_mask;
+  const uintptr_t fixed_masked = fixed_geno & var_mask;
+  counts->dot_lo += __builtin_popcountll(dot & FIVEMASK);
+  counts->dot_hi += __builtin_popcountll(dot & AAAAMASK);
+  counts->var_lo += __builtin_popcountll(var_masked & FIVEMASK);
+  counts->var_hi += __builtin_popcountll(var_masked & AAAAMASK);
+  counts->fixed_lo += __builtin_popcountll(fixed_masked & FIVEMASK);
+  counts->fixed_hi += __builtin_popcountll(fixed_masked & AAAAMASK);
+  counts->non_missing += __builtin_popcountll(var_mask & fixed_mask & FIVEMASK);
+}
+
+#if defined(__AVX2__) && !(defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__))
+// popcount of each 64-bit lane, via 4-bit lookup table (AVX2 has no popcount instruction)
+static inline __m256i popcount_epi64(__m256i val) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i m4 = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(val, m4));
+  const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi64(val, 4), m4));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static inline uint64_t reduce_add_epi64(__m256i val) {
+  const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(val), _mm256_extracti128_si256(val, 1));
+  return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+#endif
+
+static void ld_pair_counts(const uintptr_t* var_geno, const uintptr_t* fixed_geno, const uintptr_t* var_mask, const uintptr_t* fixed_mask,
+                           uintptr_t word_ct, LdPairCounts* counts) {
+  *counts = LdPairCounts();
+  uintptr_t word_idx = 0;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  const __m512i m1 = _mm512_set1_epi64(FIVEMASK);
+  const __m512i m2 = _mm512_set1_epi64(AAAAMASK);
+  __m512i dot_lo = _mm512_setzero_si512(), dot_hi = dot_lo, var_lo = dot_lo, var_hi = dot_lo, fixed_lo = dot_lo, fixed_hi = dot_lo, non_missing = dot_lo;
+  for (; (word_idx + 8) <= word_ct; word_idx += 8) {
+    const __m512i vgeno = _mm512_loadu_si512(var_geno + word_idx);
+    const __m512i fgeno = _mm512_loadu_si512(fixed_geno + word_idx);
+    const __m512i vmask = _mm512_loadu_si512(var_mask + word_idx);
+    const __m512i fmask = _mm512_loadu_si512(fixed_mask + word_idx);
+    const __m512i zcheck = _mm512_and_si512(_mm512_or_si512(vgeno, fgeno), m1);
+    const __m512i dot = _mm512_or_si512(zcheck, _mm512_andnot_si512(_mm512_add_epi64(m1, zcheck), _mm512_xor_si512(vgeno, fgeno)));
+    const __m512i var_masked = _mm512_and_si512(vgeno, fmask);
+    const __m512i fixed_masked = _mm512_and_si512(fgeno, vmask);
+    dot_lo = _mm512_add_epi64(dot_lo, _mm512_popcnt_epi64(_mm512_and_si512(dot, m1)));
+    dot_hi = _mm512_add_epi64(dot_hi, _mm512_popcnt_epi64(_mm512_and_si512(dot, m2)));
+    var_lo = _mm512_add_epi64(var_lo, _mm512_popcnt_epi64(_mm512_and_si512(var_masked, m1)));
+    var_hi = _mm512_add_epi64(var_hi, _mm512_popcnt_epi64(_mm512_and_si512(var_masked, m2)));
+    fixed_lo = _mm512_add_epi64(fixed_lo, _mm512_popcnt_epi64(_mm512_and_si512(fixed_masked, m1)));
+    fixed_hi = _mm512_add_epi64(fixed_hi, _mm512_popcnt_epi64(_mm512_and_si512(fixed_masked, m2)));
+    non_missing = _mm512_add_epi64(non_missing, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_and_si512(vmask, fmask), m1)));
+  }
+  counts->dot_lo = _mm512_reduce_add_epi64(dot_lo);
+  counts->dot_hi = _mm512_reduce_add_epi64(dot_hi);
+  counts->var_lo = _mm512_reduce_add_epi64(var_lo);
+  counts->var_hi = _mm512_reduce_add_epi64(var_hi);
+  counts->fixed_lo = _mm512_reduce_add_epi64(fixed_lo);
+  counts->fixed_hi = _mm512_reduce_add_epi64(fixed_hi);
+  counts->non_missing = _mm512_reduce_add_epi64(non_missing);
+#elif defined(__AVX2__)
+  const __m256i m1 = _mm256_set1_epi64x(FIVEMASK);
+  const __m256i m2 = _mm256_set1_epi64x(AAAAMASK);
+  __m256i dot_lo = _mm256_setzero_si256(), dot_hi = dot_lo, var_lo = dot_lo, var_hi = dot_lo, fixed_lo = dot_lo, fixed_hi = dot_lo, non_missing = dot_lo;
+  for (; (word_idx + 4) <= word_ct; word_idx += 4) {
+    const __m256i vgeno = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(var_geno + word_idx));
+    const __m256i fgeno = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fixed_geno + word_idx));
+    const __m256i vmask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(var_mask + word_idx));
+    const __m256i fmask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fixed_mask + word_idx));
+    const __m256i zcheck = _mm256_and_si256(_mm256_or_si256(vgeno, fgeno), m1);
+    const __m256i dot = _mm256_or_si256(zcheck, _mm256_andnot_si256(_mm256_add_epi64(m1, zcheck), _mm256_xor_si256(vgeno, fgeno)));
+    const __m256i var_masked = _mm256_and_si256(vgeno, fmask);
+    const __m256i fixed_masked = _mm256_and_si256(fgeno, vmask);
+    dot_lo = _mm256_add_epi64(dot_lo, popcount_epi64(_mm256_and_si256(dot, m1)));
+    dot_hi = _mm256_add_epi64(dot_hi, popcount_epi64(_mm256_and_si256(dot, m2)));
+    var_lo = _mm256_add_epi64(var_lo, popcount_epi64(_mm256_and_si256(var_masked, m1)));
+    var_hi = _mm256_add_epi64(var_hi, popcount_epi64(_mm256_and_si256(var_masked, m2)));
+    fixed_lo = _mm256_add_epi64(fixed_lo, popcount_epi64(_mm256_and_si256(fixed_masked, m1)));
+    fixed_hi = _mm256_add_epi64(fixed_hi, popcount_epi64(_mm256_and_si256(fixed_masked, m2)));
+    non_missing = _mm256_add_epi64(non_missing, popcount_epi64(_mm256_and_si256(_mm256_and_si256(vmask, fmask), m1)));
   }
+  counts->dot_lo = reduce_add_epi64(dot_lo);
+  counts->dot_hi = reduce_add_epi64(dot_hi);
+  counts->var_lo = reduce_add_epi64(var_lo);
+  counts->var_hi = reduce_add_epi64(var_hi);
+  counts->fixed_lo = reduce_add_epi64(fixed_lo);
+  counts->fixed_hi = reduce_add_epi64(fixed_hi);
+  counts->non_missing = reduce_add_epi64(non_missing);
+#endif
+  for (; word_idx < word_ct; word_idx++)
+    ld_pair_counts_word(var_geno[word_idx], fixed_geno[word_idx], var_mask[word_idx], fixed_mask[word_idx], counts);
+}
 
-  return dxx;
+void PlinkLdBedFileChunk::calculate_ld_corr_tile(const SampleCountInfo& sc, PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk,
+                                                 int snp_fixed_index, int snp_var_from, int snp_var_to, double* ld_corr) {
+  // Padding at the end of each SNP is zero in both genotypes and masks, and does not contribute to the popcounts.
+  const uintptr_t word_ct = QUATERCT_TO_WORDCT(sc.founder_ct);
+  const uintptr_t* mask_fixed_vec_ptr = &(fixed_chunk.geno_masks()[snp_fixed_index * sc.founder_ct_192_long]);
+  const uintptr_t* geno_fixed_vec_ptr = &(fixed_chunk.geno()[snp_fixed_index * sc.founder_ct_192_long]);
+  const int32_t fixed_non_missing_ct = sc.founder_ct - fixed_chunk.ld_missing_cts()[snp_fixed_index];
+
+  LdPairCounts counts;
+  for (int snp_var_index = snp_var_from; snp_var_index < snp_var_to; snp_var_index++) {
+    const uintptr_t* mask_var_vec_ptr = &(var_chunk.geno_masks()[snp_var_index * sc.founder_ct_192_long]);
+    const uintptr_t* geno_var_vec_ptr = &(var_chunk.geno()[snp_var_index * sc.founder_ct_192_long]);
+    const int32_t var_non_missing_ct = sc.founder_ct - var_chunk.ld_missing_cts()[snp_var_index];
+    ld_pair_counts(geno_var_vec_ptr, geno_fixed_vec_ptr, mask_var_vec_ptr, mask_fixed_vec_ptr, word_ct, &counts);
+
+    // same values as ld_dot_prod() accumulates in calculate_ld_corr
+    int32_t dp_result[5];
+    dp_result[0] = (int32_t)sc.founder_ct - (int32_t)(counts.dot_lo + 2 * counts.dot_hi);
+    dp_result[1] = (int32_t)(counts.var_lo + 2 * counts.var_hi) - fixed_non_missing_ct;
+    dp_result[2] = (int32_t)(counts.fixed_lo + 2 * counts.fixed_hi) - var_non_missing_ct;
+    dp_result[3] = (int32_t)counts.var_lo - fixed_non_missing_ct;
+    dp_result[4] = (int32_t)counts.fixed_lo - var_non_missing_ct;
+    ld_corr[snp_var_index - snp_var_from] = ld_corr_from_dot_prod(dp_result, (uint32_t)counts.non_missing);
+  }
+}
+
+PlinkLdBedBlockReader::PlinkLdBedBlockReader(std::string bedfile, int num_subj, int num_snps_in_file, int snp_offset, int num_snps, int block_size, const std::vector<int>& block_sequence)
+  : bedfile_(num_subj, num_snps_in_file, bedfile), num_subj_(num_subj), snp_offset_(snp_offset), num_snps_(num_snps), block_size_(block_size), block_sequence_(block_sequence), sequence_pos_(0) {
+  prefetch();
+}
+
+std::shared_ptr<PlinkLdBedFileChunk> PlinkLdBedBlockReader::next() {
+  std::shared_ptr<PlinkLdBedFileChunk> chunk = next_chunk_.get();
+  prefetch();
+  return chunk;
+}
+
+void PlinkLdBedBlockReader::prefetch() {
+  if (sequence_pos_ >= block_sequence_.size()) return;
+  const int block_start = block_sequence_[sequence_pos_++] * block_size_;
+  const int block_size = std::min(block_start + block_size_, num_snps_) - block_start;
+  bedfile_.willneed(snp_offset_ + block_start, block_size);
+  next_chunk_ = std::async(std::launch::async, [this, block_start, block_size]() {
+    std::shared_ptr<PlinkLdBedFileChunk> chunk = std::make_shared<PlinkLdBedFileChunk>();
+    if (0 != chunk->init(num_subj_, snp_offset_ + block_start, block_size, bedfile_))
+      BGMG_THROW_EXCEPTION(::std::runtime_error("error while reading .bed file"));
+    return chunk;
+  });
 }
@@ -23,8 +23,13 @@
 
 #include "plink_common.h"
 
+#include <future>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "bgmg_parse.h"
+
 // Calculates several derived measures from the number of subjects.
 // Has several simplifications compared to what is typically handled in plink:
 // * Assumes that all individuals are founders.
@@ -59,6 +64,8 @@ class PlinkLdBedFileChunk {
  PlinkLdBedFileChunk() {}
   explicit PlinkLdBedFileChunk(int num_subjects, int snp_start_index, int num_snps_in_chunk, FILE* bedfile) { init(num_subjects, snp_start_index, num_snps_in_chunk, bedfile); }
   uint32_t init(int num_subjects, int snp_start_index, int num_snps_in_chunk, FILE* bedfile);
+  // same as above, but takes genotypes from a memory-mapped .bed file instead of reading them with fread
+  uint32_t init(int num_subjects, int snp_start_index, int num_snps_in_chunk, const BedFileInMemory& bedfile);
 
   uintptr_t* geno() {return &geno_vec[0];}
   uintptr_t* geno_masks() {return &geno_masks_vec[0];}
@@ -67,6 +74,12 @@ class PlinkLdBedFileChunk {
 
   static double calculate_ld_corr(PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk, int snp_fixed_index, int snp_var_index);
 
+  // Allelic correlation between one SNP of fixed_chunk and a tile of SNPs [snp_var_from, snp_var_to) of var_chunk.
+  // Gives the same results as calculate_ld_corr, but is much faster: sample count info is computed once by the caller,
+  // and the 2-bit dot products use hardware popcount (AVX-512 VPOPCNTDQ or AVX2, when available at compile time).
+  static void calculate_ld_corr_tile(const SampleCountInfo& sc, PlinkLdBedFileChunk& fixed_chunk, PlinkLdBedFileChunk& var_chunk,
+                                     int snp_fixed_index, int snp_var_from, int snp_var_to, double* ld_corr);
+
  private:
   int num_subj_;
   int num_snps_in_chunk_;
@@ -74,3 +87,29 @@ class PlinkLdBedFileChunk {
   std::vector<uintptr_t> geno_masks_vec;
   std::vector<uint32_t> ld_missing_cts_vec;
 };
+
+// Reads a sequence of .bed file blocks, decoding the next block in a background thread
+// while the caller computes LD on the blocks it already holds.
+// Each block is a new PlinkLdBedFileChunk, released when the caller drops its pointer;
+// so at most one more block than the caller holds is kept in memory.
+class PlinkLdBedBlockReader {
+ public:
+  // blocks cover SNPs [snp_offset, snp_offset + num_snps) of the .bed file, which has num_snps_in_file SNPs in total
+  PlinkLdBedBlockReader(std::string bedfile, int num_subj, int num_snps_in_file, int snp_offset, int num_snps, int block_size, const std::vector<int>& block_sequence);
+
+  // returns next block of the sequence, and starts reading the one after it;
+  // re-throws errors from the background thread
+  std::shared_ptr<PlinkLdBedFileChunk> next();
+
+ private:
+  void prefetch();
+
+  const BedFileInMemory bedfile_;  // memory-mapped, decoded by the background thread one block at a time
+  const int num_subj_;
+  const int snp_offset_;
+  const int num_snps_;
+  const int block_size_;
+  const std::vector<int> block_sequence_;
+  size_t sequence_pos_;
+  std::future<std::shared_ptr<PlinkLdBedFileChunk>> next_chunk_;  // declared last, so destructor waits for pending read before unmapping the file
+};
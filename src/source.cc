@@ -196,6 +196,23 @@ int64_t bgmg_set_ld_r2_csr(int context_id, int chr_label) {
   } CATCH_EXCEPTIONS;
 }
 
+int64_t bgmg_save_ld_r2_csr(int context_id, int chr_label, const char* filename) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(filename);
+    return BgmgCalculatorManager::singleton().Get(context_id)->save_ld_r2_csr(chr_label, filename);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_share_ld(int src_context_id, int dst_context_id) {
+  try {
+    set_last_error(std::string());
+    if (src_context_id == dst_context_id) BGMG_THROW_EXCEPTION(::std::runtime_error("src_context_id == dst_context_id"));
+    std::shared_ptr<BgmgCalculator> src = BgmgCalculatorManager::singleton().Get(src_context_id);
+    return BgmgCalculatorManager::singleton().Get(dst_context_id)->share_ld(*src);
+  } CATCH_EXCEPTIONS;
+}
+
 int64_t bgmg_num_ld_r2_snp(int context_id, int snp_index) {
   try {
     set_last_error(std::string());
@@ -514,12 +531,47 @@ int64_t bgmg_convert_plink_ld(int context_id, const char* plink_ld_gz, const cha
   } CATCH_EXCEPTIONS;
 }
 
-int64_t bgmg_calc_ld_matrix(const char* bfile, const char* frqfile, const char* outfile, double r2min) {
+int64_t bgmg_convert_plink_ld_csr(int context_id, const char* plink_ld_gz, const char* out_file) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(plink_ld_gz);
+    check_is_not_null(out_file);
+    return BgmgCalculatorManager::singleton().Get(context_id)->convert_plink_ld_csr(plink_ld_gz, out_file);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_save_init_snapshot(int context_id, const char* filename) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(filename);
+    return BgmgCalculatorManager::singleton().Get(context_id)->save_init_snapshot(filename);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_load_init_snapshot(int context_id, const char* filename) {
+  try {
+    set_last_error(std::string());
+    check_is_not_null(filename);
+    return BgmgCalculatorManager::singleton().Get(context_id)->load_init_snapshot(filename);
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_calc_ld_matrix(const char* bfile, const char* frqfile, const char* outfile, double r2min, int ld_window, double ld_window_kb, double ld_window_cm) {
   try {
     if (!LoggerImpl::singleton().is_initialized()) LoggerImpl::singleton().init("bgmg.log");
     set_last_error(std::string());
     check_is_not_null(bfile); check_is_not_null(frqfile); check_is_not_null(outfile);
-    generate_ld_matrix_from_bed_file(bfile, frqfile, r2min, outfile);
+    generate_ld_matrix_from_bed_file(bfile, frqfile, r2min, outfile, ld_window, ld_window_kb, ld_window_cm);
+    return 0;
+  } CATCH_EXCEPTIONS;
+}
+
+int64_t bgmg_calc_ld_matrix_per_chr(const char* bfile, const char* frqfile, const char* chr_labels, const char* outfile, double r2min, int ld_window, double ld_window_kb, double ld_window_cm) {
+  try {
+    if (!LoggerImpl::singleton().is_initialized()) LoggerImpl::singleton().init("bgmg.log");
+    set_last_error(std::string());
+    check_is_not_null(bfile); check_is_not_null(frqfile); check_is_not_null(chr_labels); check_is_not_null(outfile);
+    generate_ld_matrix_from_bed_file_per_chr(bfile, frqfile, chr_labels, r2min, outfile, ld_window, ld_window_kb, ld_window_cm);
     return 0;
   } CATCH_EXCEPTIONS;
 }
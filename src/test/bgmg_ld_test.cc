@@ -7,12 +7,18 @@
 #include <random>
 #include <algorithm>
 #include <string>
+#include <fstream>
+#include <tuple>
+#include <map>
+#include <sstream>
 
 #include "bgmg_parse.h"
 #include "plink_ld.h"
 #include "snp_lookup.h"
 #include "ld_matrix.h"
 
+#include "boost/filesystem.hpp"
+
 const std::string DataFolder = "/home/oleksanf/github/mixer/src/testdata";
 
 // interesting detail: in LD r2 calculation plink calculates the mean across
@@ -135,6 +141,73 @@ TEST(TestLd, DifferentChunks) {
   fclose(bedfile);
 }
 
+void test_ld_tile(int num_subj, int num_snps, double missing_rate) {
+  std::vector<std::string> unpacked_snps;
+  std::string buffer;
+  generate_genotypes(num_subj, num_snps, missing_rate, &unpacked_snps, &buffer);
+
+  FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+  PlinkLdBedFileChunk plink_ld(num_subj, 0, num_snps, bedfile);
+  const SampleCountInfo sc(num_subj);
+  std::vector<double> ld_corr(num_snps);
+  for (int i = 0; i < num_snps; i++) {
+    PlinkLdBedFileChunk::calculate_ld_corr_tile(sc, plink_ld, plink_ld, i, i, num_snps, &ld_corr[0]);
+    for (int j = i; j < num_snps; j++) {
+      const double rIJ = PlinkLdBedFileChunk::calculate_ld_corr(plink_ld, plink_ld, i, j);
+      if (std::isfinite(rIJ) || std::isfinite(ld_corr[j - i])) {
+        ASSERT_EQ(rIJ, ld_corr[j - i]);
+      }
+    }
+  }
+  fclose(bedfile);
+}
+
+// --gtest_filter=TestLd.TileKernel
+TEST(TestLd, TileKernel) {
+  for (int num_subj = 1; num_subj < 300; num_subj++) test_ld_tile(num_subj, 10, 0.0);
+  for (int num_subj = 1; num_subj < 300; num_subj++) test_ld_tile(num_subj, 10, 0.2);
+  for (int num_subj = 10001; num_subj < 10010; num_subj++) test_ld_tile(num_subj, 10, 0.1);
+  test_ld_tile(100, 10, 1.001);
+}
+
+// --gtest_filter=TestLd.MappedBedFile
+TEST(TestLd, MappedBedFile) {
+  for (int num_subj : { 1, 7, 64, 789, 10003 }) {
+    std::vector<std::string> unpacked_snps;
+    std::string buffer;
+    const int num_snps = 20;
+    generate_genotypes(num_subj, num_snps, 0.1, &unpacked_snps, &buffer);
+    const std::string bedfile_name = boost::filesystem::unique_path().string() + ".bed";
+    { std::ofstream os(bedfile_name, std::ios::binary); os.write(buffer.data(), buffer.size()); }
+
+    FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+    PlinkLdBedFileChunk chunk_fread(num_subj, 5, 10, bedfile);
+    fclose(bedfile);
+
+    {
+      const BedFileInMemory bed(num_subj, num_snps, bedfile_name);
+      ASSERT_EQ(memcmp(bed.geno(3), &buffer[BED_HEADER_SIZE + 3 * bed.row_byte_size()], bed.row_byte_size()), 0);
+
+      PlinkLdBedFileChunk chunk_mapped;
+      ASSERT_EQ(chunk_mapped.init(num_subj, 5, 10, bed), 0);
+      ASSERT_NE(chunk_mapped.init(num_subj, 15, 10, bed), 0);  // past the end of the file
+      ASSERT_EQ(chunk_mapped.init(num_subj, 5, 10, bed), 0);
+      for (int i = 0; i < 10; i++) {
+        for (int j = 0; j < 10; j++) {
+          const double r_fread = PlinkLdBedFileChunk::calculate_ld_corr(chunk_fread, chunk_fread, i, j);
+          const double r_mapped = PlinkLdBedFileChunk::calculate_ld_corr(chunk_mapped, chunk_mapped, i, j);
+          if (std::isfinite(r_fread) || std::isfinite(r_mapped)) {
+            ASSERT_EQ(r_fread, r_mapped);
+          }
+        }
+      }
+
+      ASSERT_ANY_THROW(BedFileInMemory(num_subj, num_snps + 1, bedfile_name));
+    }
+    boost::filesystem::remove(bedfile_name);
+  }
+}
+
 // --gtest_filter=TestLd.GatherLdMatrix
 TEST(TestLd, GatherLdMatrix) {
   std::string fname = DataFolder + "/test.ld.bin2";
@@ -159,4 +232,302 @@ TEST(TestLd, GatherLdMatrix) {
 
   ASSERT_FLOAT_EQ(ld_tag_r2_sum[2010], 8.81037998);
   ASSERT_FLOAT_EQ(ld_tag_r2_sum_adjust_for_hvec[2010], 1.8912569);
-}
\ No newline at end of file
+}
+// --gtest_filter=TestLd.BlockFileFormat
+TEST(TestLd, BlockFileFormat) {
+  const int num_snp = 10000;  // three blocks, the last one incomplete
+  std::mt19937 random_engine(0);
+  std::uniform_int_distribution<int> tag_distribution(0, num_snp - 1);
+  std::uniform_real_distribution<float> r_distribution(-1.0f, 1.0f);
+
+  LdMatrixCsrChunk chunk;
+  chunk.snp_index_from_inclusive_ = 0;
+  chunk.snp_index_to_exclusive_ = num_snp;
+  chunk.chr_label_ = 0;
+  std::set<std::pair<int, int>> pairs;
+  for (int snp_index = 0; snp_index < num_snp; snp_index++) {
+    if (snp_index % 7 == 0) continue;  // empty rows
+    for (int k = 0; k < (snp_index % 5); k++) {
+      const int tag_index = tag_distribution(random_engine);
+      if ((tag_index == snp_index) || !pairs.insert(std::make_pair(snp_index, tag_index)).second) continue;
+      chunk.coo_ld_.push_back(std::make_tuple(snp_index, tag_index, packed_r_value(r_distribution(random_engine))));
+    }
+  }
+  chunk.set_ld_r2_csr(nullptr);
+
+  std::vector<float> sum1(num_snp, 1.0f), sum2(num_snp, 2.0f), sum3(num_snp, 3.0f), sum4(num_snp, 4.0f);
+  const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  save_ld_matrix(chunk, sum1, sum2, sum3, sum4, filename);
+
+  LdMatrixCsrChunk loaded;
+  std::vector<float> ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec, ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec;
+  load_ld_matrix(filename, &loaded, &ld_tag_r2_sum, &ld_tag_r2_sum_adjust_for_hvec, &ld_tag_r4_sum, &ld_tag_r4_sum_adjust_for_hvec);
+  ASSERT_EQ(loaded.snp_index_from_inclusive_, 0);
+  ASSERT_EQ(loaded.snp_index_to_exclusive_, num_snp);
+  ASSERT_TRUE(std::equal(chunk.csr_ld_snp_index_.begin(), chunk.csr_ld_snp_index_.end(), loaded.csr_ld_snp_index_.begin()));
+  ASSERT_TRUE(std::equal(chunk.csr_ld_tag_index_offset_.begin(), chunk.csr_ld_tag_index_offset_.end(), loaded.csr_ld_tag_index_offset_.begin()));
+  ASSERT_EQ(chunk.csr_ld_tag_index_packed_.size(), loaded.csr_ld_tag_index_packed_.size());
+  ASSERT_EQ(0, memcmp(chunk.csr_ld_tag_index_packed_.data(), loaded.csr_ld_tag_index_packed_.data(), chunk.csr_ld_tag_index_packed_.size()));
+  ASSERT_EQ(chunk.csr_ld_r_.size(), loaded.csr_ld_r_.size());
+  ASSERT_EQ(0, memcmp(chunk.csr_ld_r_.data(), loaded.csr_ld_r_.data(), chunk.csr_ld_r_.size() * sizeof(packed_r_value)));
+  ASSERT_EQ(ld_tag_r2_sum, sum1);
+  ASSERT_EQ(ld_tag_r4_sum_adjust_for_hvec, sum4);
+
+  // ranges within one block, across blocks, and empty
+  LdMatrixRow expected_row, row;
+  for (auto range : std::vector<std::pair<int, int>>({ {0, 1}, {100, 200}, {3000, 9000}, {4096, 8192}, {9999, 10000}, {5000, 5000}, {0, num_snp} })) {
+    LdMatrixCsrChunk range_chunk;
+    load_ld_matrix_snp_range(filename, range.first, range.second, &range_chunk);
+    ASSERT_EQ(range_chunk.snp_index_from_inclusive_, range.first);
+    ASSERT_EQ(range_chunk.snp_index_to_exclusive_, range.second);
+    ASSERT_EQ(range_chunk.num_ld_r(), chunk.csr_ld_snp_index_[range.second] - chunk.csr_ld_snp_index_[range.first]);
+    for (int snp_index = range.first; snp_index < range.second; snp_index++) {
+      chunk.extract_row(snp_index, &expected_row);
+      range_chunk.extract_row(snp_index, &row);
+      ASSERT_EQ(expected_row.end() - expected_row.begin(), row.end() - row.begin());
+      for (auto iter = row.begin(), expected_iter = expected_row.begin(); iter < row.end(); iter++, expected_iter++) {
+        ASSERT_EQ(iter.tag_index(), expected_iter.tag_index());
+        ASSERT_EQ(iter.r(), expected_iter.r());
+      }
+    }
+  }
+  ASSERT_ANY_THROW(load_ld_matrix_snp_range(filename, 0, num_snp + 1, &loaded));
+
+  // corrupted block is detected by its checksum
+  {
+    std::fstream fs(filename, std::ios::in | std::ios::out | std::ios::binary);
+    fs.seekp(sizeof(size_t) + 2 * sizeof(int) + 10);
+    char byte; fs.read(&byte, 1); byte = ~byte;
+    fs.seekp(sizeof(size_t) + 2 * sizeof(int) + 10);
+    fs.write(&byte, 1);
+  }
+  ASSERT_ANY_THROW(load_ld_matrix_snp_range(filename, 0, 100, &loaded));
+  load_ld_matrix_snp_range(filename, 8192, num_snp, &loaded);  // other blocks are still readable
+  boost::filesystem::remove(filename);
+}
+
+// write .bed/.bim/.fam/.frq files with random genotypes; SNPs are 1kb apart (0.001 cM), split between two chromosomes
+void write_test_bfile(std::string prefix, int num_subj, int num_snps, int num_snps_chr1, std::string* buffer) {
+  std::vector<std::string> unpacked_snps;
+  generate_genotypes(num_subj, num_snps, 0.0, &unpacked_snps, buffer);
+  buffer->assign("\x6c\x1b\x01", 3);  // plink magic, snp-major mode
+  std::string packed_snp((num_subj + 3) / 4, (char)0);
+  for (int i = 0; i < num_snps; i++) {
+    pack_snps((const snp_t*)unpacked_snps[i].c_str(), (unsigned char*)&packed_snp[0], num_subj);
+    buffer->append(packed_snp);
+  }
+  std::ofstream(prefix + ".bed", std::ios::binary).write(buffer->data(), buffer->size());
+
+  std::ofstream bim(prefix + ".bim"), frq(prefix + ".frq"), fam(prefix + ".fam");
+  frq << "CHR SNP A1 A2 MAF NCHROBS\n";
+  for (int i = 0; i < num_snps; i++) {
+    const int chr_label = (i < num_snps_chr1) ? 1 : 2;
+    const int pos = (i < num_snps_chr1) ? i : (i - num_snps_chr1);
+    bim << chr_label << "\trs" << i << "\t" << (0.001 * pos) << "\t" << (1000 * pos + 1) << "\tA\tG\n";
+    frq << chr_label << " rs" << i << " A G 0.3 " << 2 * num_subj << "\n";
+  }
+  for (int j = 0; j < num_subj; j++) fam << "fid" << j << " iid" << j << " 0 0 1 -9\n";
+}
+
+// --gtest_filter=TestLd.WindowedLdMatrix
+TEST(TestLd, WindowedLdMatrix) {
+  const int num_subj = 50, num_snps = 9000, num_snps_chr1 = 6000;  // two 8K blocks, the second tile straddles the chromosome boundary
+  const float r2_min = 0.05f;
+  const std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  std::string buffer;
+  write_test_bfile(prefix, num_subj, num_snps, num_snps_chr1, &buffer);
+
+  FILE* bedfile = fmemopen(&buffer[0], buffer.size(), "rb");
+  PlinkLdBedFileChunk plink_ld(num_subj, 0, num_snps, bedfile);
+
+  // each window keeps pairs up to 15 SNPs apart (the tightest limit wins), and drops pairs across chromosomes
+  const int max_distance = 15;
+  for (auto window : std::vector<std::tuple<int, float, float>>({ std::make_tuple(15, 0.0f, 0.0f), std::make_tuple(20, 15.5f, 0.0f), std::make_tuple(0, 0.0f, 0.0155f) })) {
+    generate_ld_matrix_from_bed_file(prefix, prefix + ".frq", r2_min, prefix + ".ld", std::get<0>(window), std::get<1>(window), std::get<2>(window));
+
+    LdMatrixCsrChunk chunk;
+    std::vector<float> ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec, ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec;
+    load_ld_matrix(prefix + ".ld", &chunk, &ld_tag_r2_sum, &ld_tag_r2_sum_adjust_for_hvec, &ld_tag_r4_sum, &ld_tag_r4_sum_adjust_for_hvec);
+
+    std::set<std::pair<int, int>> actual_pairs, expected_pairs;
+    LdMatrixRow row;
+    for (int snp_index = 0; snp_index < num_snps; snp_index++) {
+      chunk.extract_row(snp_index, &row);
+      for (auto iter = row.begin(); iter < row.end(); iter++)
+        actual_pairs.insert(std::make_pair(std::min(snp_index, iter.tag_index()), std::max(snp_index, iter.tag_index())));
+    }
+
+    std::vector<double> expected_r2_sum(num_snps, 0.0);
+    for (int i = 0; i < num_snps; i++) {
+      for (int j = i + 1; (j < num_snps) && (j - i <= max_distance); j++) {
+        if ((i < num_snps_chr1) != (j < num_snps_chr1)) break;
+        const float ld_corr = (float)PlinkLdBedFileChunk::calculate_ld_corr(plink_ld, plink_ld, i, j);
+        const float ld_r2 = ld_corr * ld_corr;
+        if (ld_r2 < r2_min) { expected_r2_sum[i] += ld_r2; expected_r2_sum[j] += ld_r2; }
+        else expected_pairs.insert(std::make_pair(i, j));
+      }
+    }
+
+    ASSERT_FALSE(expected_pairs.empty());
+    ASSERT_TRUE(actual_pairs == expected_pairs);
+    for (int i = 0; i < num_snps; i++) ASSERT_NEAR(ld_tag_r2_sum[i], expected_r2_sum[i], 1e-4);
+  }
+
+  fclose(bedfile);
+
+  // read errors in the background thread reach the caller of next(); here the second block lies past the end of the file
+  {
+    PlinkLdBedBlockReader bed_reader(prefix + ".bed", num_subj, num_snps, 0, 2 * num_snps, num_snps, std::vector<int>({ 0, 1 }));
+    ASSERT_TRUE(bed_reader.next() != nullptr);
+    ASSERT_ANY_THROW(bed_reader.next());
+  }
+
+  // a truncated .bed file is rejected before LD computation starts
+  boost::filesystem::resize_file(prefix + ".bed", buffer.size() / 2);
+  ASSERT_ANY_THROW(generate_ld_matrix_from_bed_file(prefix, prefix + ".frq", r2_min, prefix + ".ld", 15, 0.0f, 0.0f));
+
+  for (auto ext : { ".bed", ".bim", ".fam", ".frq", ".ld" }) boost::filesystem::remove(prefix + ext);
+}
+
+void expect_same_ld_matrix(std::string filename, std::string expected_filename, int expected_snp_offset, int num_snps) {
+  LdMatrixCsrChunk chunk, expected_chunk;
+  std::vector<float> ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec, ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec;
+  std::vector<float> expected_ld_tag_r2_sum, expected_ld_tag_r2_sum_adjust_for_hvec, expected_ld_tag_r4_sum, expected_ld_tag_r4_sum_adjust_for_hvec;
+  load_ld_matrix(filename, &chunk, &ld_tag_r2_sum, &ld_tag_r2_sum_adjust_for_hvec, &ld_tag_r4_sum, &ld_tag_r4_sum_adjust_for_hvec);
+  load_ld_matrix(expected_filename, &expected_chunk, &expected_ld_tag_r2_sum, &expected_ld_tag_r2_sum_adjust_for_hvec, &expected_ld_tag_r4_sum, &expected_ld_tag_r4_sum_adjust_for_hvec);
+  ASSERT_EQ(chunk.num_snps_in_chunk(), num_snps);
+  ASSERT_EQ(ld_tag_r2_sum.size(), num_snps);
+
+  LdMatrixRow row, expected_row;
+  for (int snp_index = 0; snp_index < num_snps; snp_index++) {
+    chunk.extract_row(snp_index, &row);
+    expected_chunk.extract_row(expected_snp_offset + snp_index, &expected_row);
+    ASSERT_EQ(row.end() - row.begin(), expected_row.end() - expected_row.begin());
+    for (auto iter = row.begin(), expected_iter = expected_row.begin(); iter < row.end(); iter++, expected_iter++) {
+      ASSERT_EQ(iter.tag_index() + expected_snp_offset, expected_iter.tag_index());
+      ASSERT_EQ(iter.r(), expected_iter.r());
+    }
+    ASSERT_NEAR(ld_tag_r2_sum[snp_index], expected_ld_tag_r2_sum[expected_snp_offset + snp_index], 1e-4);
+    ASSERT_NEAR(ld_tag_r4_sum_adjust_for_hvec[snp_index], expected_ld_tag_r4_sum_adjust_for_hvec[expected_snp_offset + snp_index], 1e-4);
+  }
+}
+
+// --gtest_filter=TestLd.LdMatrixPerChr
+TEST(TestLd, LdMatrixPerChr) {
+  const int num_subj = 50, num_snps = 9000, num_snps_chr1 = 6000;
+  const std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  std::string buffer;
+  write_test_bfile(prefix, num_subj, num_snps, num_snps_chr1, &buffer);
+
+  // genome-wide .bed file; the window excludes pairs across chromosomes, so the genome-wide matrix is block-diagonal
+  generate_ld_matrix_from_bed_file(prefix, prefix + ".frq", 0.05f, prefix + ".ld", 20, 0.0f, 0.0f);
+  generate_ld_matrix_from_bed_file_per_chr(prefix, prefix + ".frq", "1,2,3", 0.05f, prefix + ".chr@.ld", 20, 0.0f, 0.0f);
+  expect_same_ld_matrix(prefix + ".chr1.ld", prefix + ".ld", 0, num_snps_chr1);
+  expect_same_ld_matrix(prefix + ".chr2.ld", prefix + ".ld", num_snps_chr1, num_snps - num_snps_chr1);
+  ASSERT_FALSE(boost::filesystem::exists(prefix + ".chr3.ld"));  // no SNPs on chromosome 3
+
+  // per-chromosome .bed files
+  for (auto ext : { ".bed", ".bim", ".fam", ".frq" }) boost::filesystem::copy_file(prefix + ext, prefix + ".chr7" + ext);
+  generate_ld_matrix_from_bed_file_per_chr(prefix + ".chr@", prefix + ".chr@.frq", "7", 0.05f, prefix + ".chr@.ld", 20, 0.0f, 0.0f);
+  expect_same_ld_matrix(prefix + ".chr7.ld", prefix + ".ld", 0, num_snps);
+
+  ASSERT_ANY_THROW(generate_ld_matrix_from_bed_file_per_chr(prefix, prefix + ".frq", "1", 0.05f, prefix + ".ld", 20, 0.0f, 0.0f));  // no @ in output file
+
+  for (auto ext : { ".bed", ".bim", ".fam", ".frq" }) { boost::filesystem::remove(prefix + ext); boost::filesystem::remove(prefix + ".chr7" + ext); }
+  for (auto ext : { ".ld", ".chr1.ld", ".chr2.ld", ".chr7.ld" }) boost::filesystem::remove(prefix + ext);
+}
+
+// --gtest_filter=TestLd.ConvertPlinkLd
+TEST(TestLd, ConvertPlinkLd) {
+  const int num_snps = 1500, num_snps_chr1 = 1200, window = 300;  // enough pairs on chr1 to fill PLINK_LD_BUFFER_SIZE
+  const float r2_min = 0.05f, maf = 0.3f;
+  const std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  {
+    std::ofstream bim(prefix + ".bim");
+    for (int i = 0; i < num_snps; i++) bim << ((i < num_snps_chr1) ? 1 : 2) << "\trs" << i << "\t0\t" << (i + 1) << "\tA\tG\n";
+  }
+  BimFile bim_file(prefix + ".bim");
+  bim_file.find_snp_to_index_map();
+  const std::vector<float> mafvec(num_snps, maf);
+  const float hvec = 2.0f * maf * (1.0f - maf);
+
+  // pairs in plink order, except that every 1000th pair is moved to the end of its chromosome, and some pairs have SNP_A and SNP_B swapped
+  std::map<std::pair<int, int>, float> expected_r2;  // above r2_min
+  std::vector<float> r2_sum(num_snps, 0.0f), r4_sum_adjust_for_hvec(num_snps, 0.0f);
+  std::stringstream lines, moved_lines;
+  int pair_count = 0;
+  for (int i = 0; i < num_snps; i++) {
+    const int chr_end = (i < num_snps_chr1) ? num_snps_chr1 : num_snps;
+    if (i == num_snps_chr1) { lines << moved_lines.str(); moved_lines.str(""); }
+    for (int j = i + 1; j < std::min(i + window, chr_end); j++, pair_count++) {
+      const std::string r2_text = std::to_string(((i * 7 + j * 13) % 100) / 100.0);
+      const float r2 = std::stof(r2_text);
+      if (r2 >= r2_min) expected_r2[std::make_pair(i, j)] = r2;
+      else for (int k : { i, j }) { r2_sum[k] += r2; r4_sum_adjust_for_hvec[k] += r2 * r2 * hvec * hvec; }
+      const int a = (pair_count % 77 == 0) ? j : i, b = (pair_count % 77 == 0) ? i : j;
+      ((pair_count % 1000 == 0) ? moved_lines : lines) << "1 0 rs" << a << " 1 0 rs" << b << " " << r2_text << "\n";
+    }
+  }
+  lines << moved_lines.str();
+  const std::string ignored_lines = "1 0 rs1 2 0 rs1300 0.5\n1 0 rs1 1 0 rs_unknown 0.5\n1 0 rs2 1 0 rs3 nan\n";
+  {
+    std::ofstream ld(prefix + ".ld");
+    ld << " CHR_A BP_A SNP_A CHR_B BP_B SNP_B R2\n" << lines.str() << ignored_lines;
+  }
+  {
+    // chromosome 1 appears again after chromosome 2 has started
+    std::ofstream ld(prefix + ".unsorted.ld");
+    ld << " CHR_A BP_A SNP_A CHR_B BP_B SNP_B R2\n" << lines.str() << "1 0 rs0 1 0 rs5 0.5\n";
+  }
+
+  // chromosome 1 is saved once chromosome 2 starts, i.e. before the misplaced line at the end of the file is parsed
+  ASSERT_ANY_THROW(convert_plink_ld_to_ld_matrix(prefix + ".unsorted.ld", bim_file, mafvec, r2_min, prefix + ".unsorted.chr@.ld.bin"));
+  ASSERT_TRUE(boost::filesystem::exists(prefix + ".unsorted.chr1.ld.bin"));
+  ASSERT_FALSE(boost::filesystem::exists(prefix + ".unsorted.chr2.ld.bin"));
+
+  convert_plink_ld_to_ld_matrix(prefix + ".ld", bim_file, mafvec, r2_min, prefix + ".chr@.ld.bin");
+  ASSERT_ANY_THROW(convert_plink_ld_to_ld_matrix(prefix + ".ld", bim_file, mafvec, r2_min, prefix + ".ld.bin"));  // no @, two chromosomes
+
+  std::map<std::pair<int, int>, float> actual_r2;
+  for (int chr_label : { 1, 2 }) {
+    const int chr_from = (chr_label == 1) ? 0 : num_snps_chr1, chr_size = (chr_label == 1) ? num_snps_chr1 : (num_snps - num_snps_chr1);
+    LdMatrixCsrChunk chunk;
+    std::vector<float> ld_tag_r2_sum, ld_tag_r2_sum_adjust_for_hvec, ld_tag_r4_sum, ld_tag_r4_sum_adjust_for_hvec;
+    load_ld_matrix(prefix + ".chr" + std::to_string(chr_label) + ".ld.bin", &chunk, &ld_tag_r2_sum, &ld_tag_r2_sum_adjust_for_hvec, &ld_tag_r4_sum, &ld_tag_r4_sum_adjust_for_hvec);
+    ASSERT_EQ(chunk.snp_index_from_inclusive_, 0);
+    ASSERT_EQ(chunk.snp_index_to_exclusive_, chr_size);
+    for (int i = 0; i < chr_size; i++) {
+      ASSERT_NEAR(ld_tag_r2_sum[i], r2_sum[chr_from + i], 1e-3);
+      ASSERT_NEAR(ld_tag_r2_sum_adjust_for_hvec[i], r2_sum[chr_from + i] * hvec, 1e-3);
+      ASSERT_NEAR(ld_tag_r4_sum_adjust_for_hvec[i], r4_sum_adjust_for_hvec[chr_from + i], 1e-3);
+
+      LdMatrixRow row;
+      chunk.extract_row(i, &row);
+      int previous_tag_index = -1;
+      for (auto iter = row.begin(); iter < row.end(); iter++) {
+        ASSERT_GT(iter.tag_index(), std::max(i, previous_tag_index));  // upper triangle, sorted
+        previous_tag_index = iter.tag_index();
+        actual_r2[std::make_pair(i + chr_from, iter.tag_index() + chr_from)] = iter.r2();
+      }
+    }
+  }
+
+  ASSERT_EQ(actual_r2.size(), expected_r2.size());
+  for (auto& elem : actual_r2) {
+    auto expected = expected_r2.find(elem.first);
+    ASSERT_TRUE(expected != expected_r2.end());
+    ASSERT_NEAR(elem.second, expected->second, 1e-4);
+  }
+
+  {
+    // the file written for chromosome 1 before the error is complete
+    LdMatrixCsrChunk chunk, unsorted_chunk;
+    std::vector<float> r2_sum, r2_sum_adjust_for_hvec, r4_sum, r4_sum_adjust_for_hvec;
+    load_ld_matrix(prefix + ".chr1.ld.bin", &chunk, &r2_sum, &r2_sum_adjust_for_hvec, &r4_sum, &r4_sum_adjust_for_hvec);
+    load_ld_matrix(prefix + ".unsorted.chr1.ld.bin", &unsorted_chunk, &r2_sum, &r2_sum_adjust_for_hvec, &r4_sum, &r4_sum_adjust_for_hvec);
+    ASSERT_EQ(unsorted_chunk.csr_ld_r_.size(), chunk.csr_ld_r_.size());
+    ASSERT_EQ(unsorted_chunk.csr_ld_snp_index_.size(), chunk.csr_ld_snp_index_.size());
+  }
+
+  for (auto ext : { ".bim", ".ld", ".chr1.ld.bin", ".chr2.ld.bin", ".unsorted.ld", ".unsorted.chr1.ld.bin" }) boost::filesystem::remove(prefix + ext);
+}
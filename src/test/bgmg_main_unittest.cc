@@ -6,7 +6,13 @@
 #include <random>
 #include <algorithm>
 
+#include "boost/filesystem.hpp"
+
+#include "zlib.h"
+
 #include "bgmg_calculator.h"
+#include "bgmg_gzip.h"
+#include "ld_matrix.h"
 
 /*
 #include <fstream>
@@ -31,6 +37,172 @@ TEST(BgmgGzipTest, TestGzip) {
 }
 */
 
+// --gtest_filter=BgmgParseTest.LineTokenizer
+TEST(BgmgParseTest, LineTokenizer) {
+  // a long line that spans several blocks, windows line endings, an empty line, and no newline at the end
+  const std::string long_field(100, 'x');
+  std::stringstream ss;
+  ss << "  CHR\tSNP  A1\r\n" << "1 " << long_field << " -1.5e-3 " << long_field << "\n" << "\n" << " \t \n" << "22\trs1\t+7";
+  LineTokenizer tokenizer(ss, 16);
+
+  ASSERT_TRUE(tokenizer.next_line());
+  ASSERT_EQ(tokenizer.line_no(), 1);
+  ASSERT_EQ(tokenizer.num_fields(), 3);
+  ASSERT_STREQ(tokenizer.field(0), "CHR");
+  ASSERT_STREQ(tokenizer.field(2), "A1");
+  tokenizer.to_lower(1);
+  ASSERT_EQ(tokenizer.line(), "CHR snp A1");
+
+  ASSERT_TRUE(tokenizer.next_line());
+  ASSERT_EQ(tokenizer.num_fields(), 4);
+  ASSERT_EQ(std::string(tokenizer.field(1)), long_field);
+  ASSERT_EQ(std::string(tokenizer.field(3)), long_field);
+  float gp; int chr;
+  ASSERT_TRUE(parse_int(tokenizer.field(0), &chr)); ASSERT_EQ(chr, 1);
+  ASSERT_TRUE(parse_float(tokenizer.field(2), &gp)); ASSERT_FLOAT_EQ(gp, -1.5e-3f);
+  ASSERT_FALSE(parse_int(tokenizer.field(1), &chr));
+
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(tokenizer.next_line());
+    ASSERT_EQ(tokenizer.num_fields(), 0);
+  }
+
+  ASSERT_TRUE(tokenizer.next_line());
+  ASSERT_EQ(tokenizer.line_no(), 5);
+  ASSERT_EQ(tokenizer.num_fields(), 3);
+  ASSERT_STREQ(tokenizer.field(1), "rs1");
+  ASSERT_TRUE(parse_int(tokenizer.field(0), &chr)); ASSERT_EQ(chr, 22);
+  ASSERT_TRUE(parse_int(tokenizer.field(2), &chr)); ASSERT_EQ(chr, 7);
+  ASSERT_FALSE(tokenizer.next_line());
+  ASSERT_FALSE(tokenizer.next_line());
+
+  double pheno;
+  ASSERT_FALSE(parse_int("3000000000", &chr));
+  ASSERT_FALSE(parse_float("1e100", &gp));
+  ASSERT_TRUE(parse_double("-9", &pheno)); ASSERT_EQ(pheno, -9.0);
+  ASSERT_FALSE(parse_double("", &pheno));
+}
+
+// --gtest_filter=BgmgParseTest.SnpIdIndex
+TEST(BgmgParseTest, SnpIdIndex) {
+  std::vector<std::string> ids = { "rs1", "rs01", "RS1", "rs", "1:12345_A_G", "rs123456789012345678", "rs1234567890123456789", "rs12a", "" };
+  for (int i = 0; i < 100000; i++) ids.push_back("rs" + std::to_string(1000000 + 7 * i));
+  for (int i = 0; i < 1000; i++) ids.push_back("chr1:" + std::to_string(i));
+
+  SnpIdIndex index;
+  ASSERT_EQ(index.find("rs1"), -1);
+  ASSERT_EQ(index.build(ids), -1);
+  for (int i = 0; i < ids.size(); i++) ASSERT_EQ(index.find(ids[i]), i);
+  for (std::string id : { "rs2", "rs0", "rs001", "rs1000001", "rs12", "chr1:1000", "chr1:", "1:12345_A_", "RS01" }) ASSERT_EQ(index.find(id), -1);
+  ASSERT_EQ(index.find("rs12a", 4), index.find("rs12"));
+
+  ids.push_back("chr1:500");
+  const int duplicate = index.build(ids);
+  ASSERT_TRUE(duplicate == 100009 + 500 || duplicate == ids.size() - 1);
+  ASSERT_EQ(ids[index.find("chr1:500")], "chr1:500");
+  ids.back() = "rs1000007";
+  ASSERT_EQ(ids[index.build(ids)], "rs1000007");
+}
+
+// --gtest_filter=BgmgParseTest.BimColumns
+TEST(BgmgParseTest, BimColumns) {
+  const std::vector<std::string> ids = { "rs1", "", "1:12345_A_G" };
+  StringColumn snp(ids);
+  snp.append(StringColumn(ids));
+  ASSERT_EQ(snp.size(), 6);
+  for (int i = 0; i < snp.size(); i++) ASSERT_EQ(snp[i], ids[i % 3]);
+  ASSERT_EQ(snp.length(5), 11);
+  ASSERT_STREQ(snp.c_str(3), "rs1");
+
+  AlleleColumn alleles, other;
+  for (const char* allele : { "A", "t", "AT", "0", "G" }) alleles.push_back(allele);
+  for (const char* allele : { "-", "C" }) other.push_back(allele);
+  alleles.append(other);
+  const std::vector<std::string> expected = { "A", "T", "AT", "0", "G", "-", "C" };
+  ASSERT_EQ(alleles.size(), expected.size());
+  for (int i = 0; i < alleles.size(); i++) ASSERT_EQ(alleles[i], expected[i]);
+  ASSERT_EQ(alleles.code(1), AlleleColumn::ALLELE_T);
+  ASSERT_EQ(alleles.code(5), AlleleColumn::ALLELE_OTHER);
+
+  // flip_strand gives the same result for codes and strings
+  const char* nucleotides[] = { "a", "c", "g", "t" };
+  for (int i = 0; i < 256; i++) {
+    const char* a1 = nucleotides[i % 4], *a2 = nucleotides[(i / 4) % 4], *a1ref = nucleotides[(i / 16) % 4], *a2ref = nucleotides[i / 64];
+    ASSERT_EQ(SumstatFile::flip_strand(AlleleColumn::encode(a1), AlleleColumn::encode(a2), AlleleColumn::encode(a1ref), AlleleColumn::encode(a2ref)),
+              SumstatFile::flip_strand(a1, a2, a1ref, a2ref));
+  }
+  ASSERT_EQ(SumstatFile::flip_strand("t", "a", "A", "T"), SumstatFile::FLIP_STATUS_AMBIGUOUS);
+  ASSERT_EQ(SumstatFile::flip_strand(AlleleColumn::ALLELE_A, AlleleColumn::ALLELE_G, AlleleColumn::ALLELE_G, AlleleColumn::ALLELE_A), SumstatFile::FLIP_STATUS_FLIPPED);
+}
+
+// deflate with gzip wrapper (window_bits = MAX_WBITS + 16), or raw deflate (window_bits = -MAX_WBITS)
+std::string deflate_string(const std::string& data, int window_bits) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&strm, data.size()), '\0');
+  strm.next_in = (Bytef*)data.data(); strm.avail_in = data.size();
+  strm.next_out = (Bytef*)&out[0]; strm.avail_out = out.size();
+  deflate(&strm, Z_FINISH);
+  out.resize(strm.total_out);
+  deflateEnd(&strm);
+  return out;
+}
+
+// BGZF block, as written by bgzip
+std::string bgzf_block(const std::string& data) {
+  const std::string deflated = deflate_string(data, -MAX_WBITS);
+  const size_t bsize = 18 + deflated.size() + 8 - 1;
+  const uint32_t crc = crc32(0L, (const Bytef*)data.data(), data.size()), isize = data.size();
+  const unsigned char header[18] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, (unsigned char)(bsize & 0xff), (unsigned char)(bsize >> 8) };
+  std::string block((const char*)header, 18);
+  block += deflated;
+  for (uint32_t value : { crc, isize }) for (int i = 0; i < 4; i++) block += (char)((value >> (8 * i)) & 0xff);
+  return block;
+}
+
+std::string read_gzip_file(const std::string& filename) {
+  std::shared_ptr<std::istream> in = open_gzip_file(filename);
+  std::string result, buffer(100000, '\0');
+  while (in->read(&buffer[0], buffer.size()) || in->gcount() > 0) result.append(buffer, 0, in->gcount());
+  return result;
+}
+
+// --gtest_filter=BgmgParseTest.GzipFile
+TEST(BgmgParseTest, GzipFile) {
+  std::mt19937 random_engine(0);
+  std::string data;
+  while (data.size() < 5 * 1024 * 1024) data += "rs" + std::to_string(random_engine()) + "\t" + std::to_string(random_engine() % 1000) + "\n";
+  const std::string filename = boost::filesystem::unique_path().string() + ".gz";
+
+  // plain gzip, as two concatenated members; spans several chunks of the background reader
+  const size_t half = data.size() / 2;
+  const std::string gzip = deflate_string(data.substr(0, half), MAX_WBITS + 16) + deflate_string(data.substr(half), MAX_WBITS + 16);
+  { std::ofstream os(filename, std::ios::binary); os << gzip; }
+  ASSERT_FALSE(is_bgzf_file(filename));
+  ASSERT_TRUE(read_gzip_file(filename) == data);
+  { std::ofstream os(filename, std::ios::binary); os << gzip.substr(0, gzip.size() - 100); }
+  ASSERT_ANY_THROW(read_gzip_file(filename));
+
+  // BGZF, with several batches of blocks and an empty end-of-file block
+  std::string bgzf;
+  for (size_t offset = 0; offset < data.size(); offset += 1000) bgzf += bgzf_block(data.substr(offset, 1000));
+  bgzf += bgzf_block(std::string());
+  { std::ofstream os(filename, std::ios::binary); os << bgzf; }
+  ASSERT_TRUE(is_bgzf_file(filename));
+  ASSERT_TRUE(read_gzip_file(filename) == data);
+  std::string bgzf_corrupted = bgzf;
+  bgzf_corrupted[bgzf.size() / 2] ^= 0x55;
+  { std::ofstream os(filename, std::ios::binary); os << bgzf_corrupted; }
+  ASSERT_ANY_THROW(read_gzip_file(filename));
+  bgzf_corrupted = bgzf;
+  bgzf_corrupted[bgzf_block(data.substr(0, 1000)).size() - 1] = (char)0xff;  // ISIZE of the first block above 64 KB
+  { std::ofstream os(filename, std::ios::binary); os << bgzf_corrupted; }
+  ASSERT_ANY_THROW(read_gzip_file(filename));
+
+  boost::filesystem::remove(filename);
+}
+
 TEST(BgmgTest, LoadData) {
   // Input data:
   // - LD structure as a set of pairwise LD r2 values
@@ -43,6 +215,57 @@ TEST(BgmgTest, LoadData) {
   // 
 }
 
+// --gtest_filter=BgmgTest.InitSnapshot
+TEST(BgmgTest, InitSnapshot) {
+  const std::string prefix = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  {
+    std::ofstream bim(prefix + ".bim"), frq(prefix + ".frq"), trait1(prefix + ".trait1"), trait2(prefix + ".trait2");
+    frq << "CHR SNP A1 A2 MAF NCHROBS\n";
+    trait1 << "SNP A1 A2 Z N\n";
+    trait2 << "SNP A1 A2 Z N\n";
+    for (int i = 0; i < 100; i++) {
+      const int chr_label = (i < 60) ? 1 : 2;
+      const std::string snp = (i % 10 == 3) ? ("chr" + std::to_string(chr_label) + ":" + std::to_string(i)) : ("rs" + std::to_string(i));
+      bim << chr_label << "\t" << snp << "\t" << 0.01 * i << "\t" << 1000 * i << "\tA\tC\n";
+      frq << chr_label << " " << snp << " A C " << 0.001 * (i + 1) << " 200\n";
+      if (i % 7 != 0) trait1 << snp << ((i % 2) ? " A C " : " C A ") << 0.1 * i << " " << 1000 + i << "\n";
+      if (i % 5 != 0) trait2 << snp << " A C " << -0.1 * i << " " << (i % 11 ? "2000" : "NA") << "\n";
+    }
+  }
+
+  BgmgCalculator calc;
+  calc.init(prefix + ".bim", prefix + ".frq", "", prefix + ".trait1", prefix + ".trait2", "", "");
+  calc.save_init_snapshot(prefix + ".snapshot");
+
+  BgmgCalculator loaded;
+  loaded.load_init_snapshot(prefix + ".snapshot");
+  const int num_snp = 100, num_tag = calc.num_tag();
+  ASSERT_EQ(loaded.num_snp(), num_snp);
+  ASSERT_EQ(loaded.num_tag(), num_tag);
+  ASSERT_TRUE(loaded.tag_to_snp() == calc.tag_to_snp());
+  ASSERT_TRUE(loaded.chrnumvec() == calc.chrnumvec());
+  ASSERT_TRUE(loaded.mafvec() == calc.mafvec());
+  for (int trait = 1; trait <= 2; trait++) {
+    std::vector<float> expected(num_tag), actual(num_tag);
+    calc.retrieve_zvec(trait, num_tag, &expected[0]); loaded.retrieve_zvec(trait, num_tag, &actual[0]);
+    ASSERT_EQ(memcmp(&expected[0], &actual[0], num_tag * sizeof(float)), 0);  // bitwise, as some values are NaN
+    calc.retrieve_nvec(trait, num_tag, &expected[0]); loaded.retrieve_nvec(trait, num_tag, &actual[0]);
+    ASSERT_EQ(memcmp(&expected[0], &actual[0], num_tag * sizeof(float)), 0);
+  }
+
+  // the reference is restored as well: saving the loaded context gives an identical file
+  loaded.save_init_snapshot(prefix + ".snapshot2");
+  std::ifstream snapshot(prefix + ".snapshot", std::ios::binary), snapshot2(prefix + ".snapshot2", std::ios::binary);
+  ASSERT_TRUE(std::string(std::istreambuf_iterator<char>(snapshot), std::istreambuf_iterator<char>()) ==
+              std::string(std::istreambuf_iterator<char>(snapshot2), std::istreambuf_iterator<char>()));
+
+  ASSERT_ANY_THROW(loaded.load_init_snapshot(prefix + ".snapshot"));  // context is already initialized
+  BgmgCalculator not_snapshot;
+  ASSERT_ANY_THROW(not_snapshot.load_init_snapshot(prefix + ".bim"));
+
+  for (auto ext : { ".bim", ".frq", ".trait1", ".trait2", ".snapshot", ".snapshot2" }) boost::filesystem::remove(prefix + ext);
+}
+
 class TestMother {
 public:
   TestMother(int num_snp, int num_tag, int n) : num_snp_(num_snp), num_tag_(num_tag), rd_(), g_(12341234) {
@@ -150,6 +373,428 @@ TEST(LdTest, ValidateMultipleChromosomes) {
   for (int i = 0; i < num_tag*kmax; i++) ASSERT_FLOAT_EQ(tag_r2_sum[i], tag_r2_sum_cached[i]);
 }
 
+void LdTest_MemoryMappedFile(LdRCodec codec) {
+  int num_snp = 60;
+  int num_tag = 40;
+  int kmax = 20;
+  int N = 100;
+  TestMother tm(num_snp, num_tag, N);
+
+  std::vector<int> chrnumvec;
+  for (int i = 0; i < 40; i++) chrnumvec.push_back(1);
+  for (int i = 0; i < 20; i++) chrnumvec.push_back(2);
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r2;
+  tm.make_r2(200, &snp_index, &tag_index, &r2);
+
+  const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  const std::string filename_chr1 = filename + ".chr1.ld", filename_chr2 = filename + ".chr2.ld";
+  std::vector<std::vector<float>> results;
+  for (int pass = 0; pass < 3; pass++) {  // save, load, load on demand
+    BgmgCalculator calc;
+    calc.set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+    calc.set_option("seed", 0);
+    calc.set_option("max_causals", num_snp);
+    calc.set_option("kmax", kmax);
+    calc.set_option("num_components", 1);
+    calc.set_option("r2min", 0.15f);
+    calc.set_option("ld_r_codec", (pass == 0) ? codec : LdRCodec_Uint16_R);  // when loading, the codec is taken from the file
+    if (pass == 2) calc.set_option("ld_memory_budget_mb", 1e-6);  // too small for both chromosomes, so they keep evicting each other
+    calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+    calc.set_chrnumvec(num_snp, &chrnumvec[0]);
+
+    if (pass == 0) {
+      calc.set_ld_r2_coo(1, r2.size(), &snp_index[0], &tag_index[0], &r2[0]);
+      calc.set_ld_r2_csr();
+      calc.save_ld_r2_csr(1, filename_chr1);
+      calc.save_ld_r2_csr(2, filename_chr2);
+    } else {
+      calc.set_ld_r2_coo(1, filename_chr1);
+      calc.set_ld_r2_coo(2, filename_chr2);
+      calc.set_ld_r2_csr();
+    }
+
+    std::vector<float> ld_tag_r2_sum(num_tag, 0.0f);
+    calc.retrieve_ld_tag_r2_sum(num_tag, &ld_tag_r2_sum[0]);
+    std::vector<float> tag_r2_sum(num_tag*kmax, 0.0f);
+    calc.retrieve_tag_r2_sum(0, 1, num_tag*kmax, &tag_r2_sum[0]);
+
+    const int64_t numel = calc.num_ld_r2_chr(1);
+    std::vector<int> snp(numel), tag(numel);
+    std::vector<float> ld_r2(numel);
+    calc.retrieve_ld_r2_chr(1, numel, &snp[0], &tag[0], &ld_r2[0]);
+    if (pass == 2) calc.set_option("diag", 0);
+    if (pass < 2) {
+      ASSERT_EQ(calc.num_ld_on_demand_loads(), 0);
+    } else {
+      ASSERT_GT(calc.num_ld_on_demand_loads(), 2);  // both chromosomes were loaded, and at least one was evicted and loaded again
+    }
+
+    results.push_back(ld_tag_r2_sum);
+    results.push_back(tag_r2_sum);
+    results.push_back(ld_r2);
+    results.push_back(std::vector<float>(tag.begin(), tag.end()));
+  }
+  boost::filesystem::remove(filename_chr1);
+  boost::filesystem::remove(filename_chr2);
+
+  for (int i = 0; i < 8; i++) {
+    ASSERT_EQ(results[i % 4].size(), results[i + 4].size());
+    for (int j = 0; j < results[i % 4].size(); j++) ASSERT_FLOAT_EQ(results[i % 4][j], results[i + 4][j]);
+  }
+
+  // r values of the first pass went through the requested codec:
+  // uint8 r2 drops the sign and rounds r2 to a multiple of 1/255, fp16 keeps 11 significant bits of r
+  const std::vector<float>& ld_r = results[2];
+  int num_negative = 0, num_fp16 = 0, num_uint8 = 0;
+  for (float r : ld_r) {
+    int exponent;
+    const float mantissa = std::ldexp(std::frexp(r, &exponent), 11);
+    num_negative += (r < 0);
+    num_fp16 += (mantissa == std::floor(mantissa));
+    num_uint8 += (std::abs(r * r * 255.0f - std::round(r * r * 255.0f)) < 1e-3f);
+  }
+  ASSERT_GT(ld_r.size(), 0);
+  switch (codec) {
+    case LdRCodec_Uint16_R: ASSERT_GT(num_negative, 0); ASSERT_LT(num_fp16, ld_r.size()); ASSERT_LT(num_uint8, ld_r.size()); break;
+    case LdRCodec_Uint8_R2: ASSERT_EQ(num_negative, 0); ASSERT_EQ(num_uint8, ld_r.size()); break;
+    case LdRCodec_Fp16_R: ASSERT_GT(num_negative, 0); ASSERT_EQ(num_fp16, ld_r.size()); ASSERT_LT(num_uint8, ld_r.size()); break;
+  }
+}
+
+// --gtest_filter=LdTest.MemoryMappedFile
+TEST(LdTest, MemoryMappedFile) {
+  LdTest_MemoryMappedFile(LdRCodec_Uint16_R);
+  LdTest_MemoryMappedFile(LdRCodec_Uint8_R2);
+  LdTest_MemoryMappedFile(LdRCodec_Fp16_R);
+}
+
+TEST(LdTest, ShareLd) {
+  int num_snp = 60;
+  int num_tag = 40;
+  int kmax = 20;
+  int N = 100;
+  TestMother tm(num_snp, num_tag, N);
+
+  std::vector<int> chrnumvec;
+  for (int i = 0; i < 40; i++) chrnumvec.push_back(1);
+  for (int i = 0; i < 20; i++) chrnumvec.push_back(2);
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r2;
+  tm.make_r2(200, &snp_index, &tag_index, &r2);
+
+  auto init_calc = [&](BgmgCalculator* calc) {
+    calc->set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+    calc->set_option("seed", 0);
+    calc->set_option("max_causals", num_snp);
+    calc->set_option("kmax", kmax);
+    calc->set_option("num_components", 1);
+    calc->set_option("r2min", 0.15f);
+    calc->set_mafvec(num_snp, &tm.mafvec()->at(0));
+    calc->set_chrnumvec(num_snp, &chrnumvec[0]);
+  };
+
+  auto retrieve = [&](BgmgCalculator* calc) {
+    std::vector<float> result(num_tag, 0.0f);
+    calc->retrieve_ld_tag_r2_sum(num_tag, &result[0]);
+    std::vector<float> tag_r2_sum(num_tag*kmax, 0.0f);
+    calc->retrieve_tag_r2_sum(0, 1, num_tag*kmax, &tag_r2_sum[0]);
+    result.insert(result.end(), tag_r2_sum.begin(), tag_r2_sum.end());
+    return result;
+  };
+
+  std::shared_ptr<BgmgCalculator> src = std::make_shared<BgmgCalculator>();
+  init_calc(src.get());
+  src->set_ld_r2_coo(1, r2.size(), &snp_index[0], &tag_index[0], &r2[0]);
+
+  BgmgCalculator dst;
+  init_calc(&dst);
+  ASSERT_ANY_THROW(dst.share_ld(*src));  // LD structure is not finalized yet
+
+  src->set_ld_r2_csr();
+  std::vector<float> expected = retrieve(src.get());
+  dst.share_ld(*src);
+  src.reset();  // LD structure must survive disposal of the context it was created by
+
+  ASSERT_ANY_THROW(dst.set_ld_r2_coo(1, r2.size(), &snp_index[0], &tag_index[0], &r2[0]));
+  std::vector<float> actual = retrieve(&dst);
+  ASSERT_EQ(expected.size(), actual.size());
+  for (int i = 0; i < expected.size(); i++) ASSERT_FLOAT_EQ(expected[i], actual[i]);
+
+  BgmgCalculator other;
+  init_calc(&other);
+  other.set_option("r2min", 0.2f);
+  ASSERT_ANY_THROW(other.share_ld(dst));  // options must match
+}
+
+// rows of all lengths from 0 to 40 cover both the vectorized part of extract_row and the tail
+void LdTest_ExtractRow(LdRCodec codec) {
+  const int num_snp = 41, num_tag = 1000;
+  std::mt19937 random_engine(0);
+  std::uniform_real_distribution<float> r_distribution(-1.0f, 1.0f);
+
+  LdMatrixCsrChunk chunk;
+  chunk.snp_index_from_inclusive_ = 0;
+  chunk.snp_index_to_exclusive_ = num_snp;
+  chunk.chr_label_ = 0;
+
+  std::vector<std::vector<int>> expected_tag(num_snp);
+  std::vector<std::vector<float>> expected_r(num_snp);
+  for (int snp_index = 0; snp_index < num_snp; snp_index++) {
+    std::vector<int> tags(num_tag);
+    std::iota(tags.begin(), tags.end(), 0);
+    std::shuffle(tags.begin(), tags.end(), random_engine);
+    tags.resize(snp_index);
+    std::sort(tags.begin(), tags.end());
+    for (auto tag_index: tags) {
+      packed_r_value r(r_distribution(random_engine));
+      chunk.coo_ld_.push_back(std::make_tuple(snp_index, tag_index, r));
+      expected_tag[snp_index].push_back(tag_index);
+      expected_r[snp_index].push_back(r.get());
+    }
+  }
+  chunk.set_ld_r2_csr(nullptr);
+  chunk.encode_ld_r(codec);
+  ASSERT_EQ(chunk.ld_r_codec_, codec);
+  ASSERT_EQ(chunk.csr_ld_r_packed_.size(), (codec == LdRCodec_Uint16_R) ? 0 : (chunk.num_ld_r() * ld_r_codec_bytes(codec)));
+
+  LdMatrixRow row;
+  for (int pass = 0; pass < 2; pass++) {  // second pass re-uses buffers allocated in the first pass
+    for (int snp_index = num_snp - 1; snp_index >= 0; snp_index--) {
+      chunk.extract_row(snp_index, &row);
+      ASSERT_EQ(row.end() - row.begin(), snp_index);
+      int i = 0;
+      for (auto iter = row.begin(); iter < row.end(); iter++, i++) {
+        const float expected = expected_r[snp_index][i];
+        ASSERT_EQ(iter.tag_index(), expected_tag[snp_index][i]);
+        switch (codec) {
+          case LdRCodec_Uint16_R: ASSERT_EQ(iter.r(), expected); break;
+          case LdRCodec_Fp16_R: ASSERT_NEAR(iter.r(), expected, 1e-3 * std::abs(expected) + 1e-7); break;
+          case LdRCodec_Uint8_R2: ASSERT_GE(iter.r(), 0.0f); ASSERT_NEAR(iter.r2(), expected * expected, 0.5f / 255.0f + 1e-6); break;
+        }
+      }
+    }
+  }
+}
+
+TEST(LdTest, ExtractRow) {
+  LdTest_ExtractRow(LdRCodec_Uint16_R);
+  LdTest_ExtractRow(LdRCodec_Uint8_R2);
+  LdTest_ExtractRow(LdRCodec_Fp16_R);
+}
+
+// symmetric storage must reproduce rows of the full LD matrix, in the same order
+void LdTest_SymmetricStorage(LdRCodec codec) {
+  int num_snp = 60;
+  int num_tag = 60;
+  int N = 100;
+  int trait_index = 1;
+  TestMother tm(num_snp, num_tag, N);
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r;
+  tm.make_r2(400, &snp_index, &tag_index, &r);
+
+  std::vector<std::vector<float>> results;
+  for (int pass = 0; pass < 2; pass++) {
+    BgmgCalculator calc;
+    calc.set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+    calc.set_option("seed", 0);
+    calc.set_option("kmax", 200);
+    calc.set_option("max_causals", num_snp);
+    calc.set_option("use_complete_tag_indices", 1);
+    calc.set_option("ld_r_codec", codec);
+    calc.set_option("ld_symmetric", pass);
+    calc.set_zvec(trait_index, num_tag, &tm.zvec()->at(0));
+    calc.set_nvec(trait_index, num_tag, &tm.nvec()->at(0));
+    calc.set_weights(num_tag, &tm.weights()->at(0));
+    calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+    calc.set_chrnumvec(num_snp, &tm.chrnumvec()->at(0));
+    calc.set_ld_r2_coo(1, r.size(), &snp_index[0], &tag_index[0], &r[0]);
+    calc.set_ld_r2_csr();
+
+    std::vector<float> tags, ld_r2;
+    for (int snp = 0; snp < num_snp; snp++) {
+      const int64_t numel = calc.num_ld_r2_snp(snp);
+      std::vector<int> tag(numel);
+      std::vector<float> r2(numel);
+      calc.retrieve_ld_r2_snp(snp, numel, &tag[0], &r2[0]);
+      tags.insert(tags.end(), tag.begin(), tag.end());
+      ld_r2.insert(ld_r2.end(), r2.begin(), r2.end());
+    }
+
+    std::vector<float> costs;
+    for (int cost_calculator = 0; cost_calculator < 3; cost_calculator++) {
+      calc.set_option("cost_calculator", cost_calculator);
+      costs.push_back(calc.calc_univariate_cost(trait_index, 0.2, 1.2, 0.1));
+    }
+
+    results.push_back(tags);
+    results.push_back(ld_r2);
+    results.push_back(costs);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(results[i].size(), results[i + 3].size());
+    for (int j = 0; j < results[i].size(); j++) ASSERT_FLOAT_EQ(results[i][j], results[i + 3][j]);
+  }
+
+  // symmetric storage requires tag_index == snp_index
+  BgmgCalculator calc;
+  TestMother tm_partial(num_snp, num_snp / 2, N);
+  calc.set_tag_indices(num_snp, num_snp / 2, &tm_partial.tag_to_snp()->at(0));
+  calc.set_option("ld_symmetric", 1);
+  calc.set_mafvec(num_snp, &tm_partial.mafvec()->at(0));
+  calc.set_chrnumvec(num_snp, &tm_partial.chrnumvec()->at(0));
+  calc.set_ld_r2_coo(1, r.size(), &snp_index[0], &tag_index[0], &r[0]);
+  ASSERT_ANY_THROW(calc.set_ld_r2_csr());
+}
+
+// --gtest_filter=LdTest.SymmetricStorage
+TEST(LdTest, SymmetricStorage) {
+  LdTest_SymmetricStorage(LdRCodec_Uint16_R);
+  LdTest_SymmetricStorage(LdRCodec_Uint8_R2);
+  LdTest_SymmetricStorage(LdRCodec_Fp16_R);
+}
+
+// convolve calculator with the tag-major index must match the complete LD matrix (use_complete_tag_indices) restricted to tag snps
+TEST(LdTest, TagMajorIndex) {
+  int num_snp = 60;
+  int num_tag = 20;
+  int N = 100;
+  TestMother tm(num_snp, num_tag, N);
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r;
+  tm.make_r2(400, &snp_index, &tag_index, &r);
+
+  std::vector<double> costs;
+  for (int pass = 0; pass < 2; pass++) {
+    const bool complete = (pass == 0);
+    const int num_tag_pass = complete ? num_snp : num_tag;
+    std::vector<int> tag_to_snp(num_tag_pass);
+    std::vector<float> zvec1(num_tag_pass, 0.0f), zvec2(num_tag_pass, 0.0f), nvec(num_tag_pass, N), weights(num_tag_pass, 0.0f);
+    if (complete) std::iota(tag_to_snp.begin(), tag_to_snp.end(), 0);
+    else tag_to_snp = *tm.tag_to_snp();
+    for (int i = 0; i < num_tag; i++) {
+      const int k = complete ? tm.tag_to_snp()->at(i) : i;
+      zvec1[k] = tm.zvec()->at(i);
+      zvec2[k] = -0.5f * tm.zvec()->at(i);
+      weights[k] = 1.0f;
+    }
+
+    BgmgCalculator calc;
+    calc.set_tag_indices(num_snp, num_tag_pass, &tag_to_snp[0]);
+    calc.set_option("r2min", 0.1f);
+    calc.set_option("num_components", 3);
+    if (complete) calc.set_option("use_complete_tag_indices", 1);
+    else calc.set_option("ld_tag_major", 1);
+    calc.set_zvec(1, num_tag_pass, &zvec1[0]);
+    calc.set_nvec(1, num_tag_pass, &nvec[0]);
+    calc.set_zvec(2, num_tag_pass, &zvec2[0]);
+    calc.set_nvec(2, num_tag_pass, &nvec[0]);
+    calc.set_weights(num_tag_pass, &weights[0]);
+    calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+    calc.set_chrnumvec(num_snp, &tm.chrnumvec()->at(0));
+    calc.set_ld_r2_coo(1, r.size(), &snp_index[0], &tag_index[0], &r[0]);
+    calc.set_ld_r2_csr();
+
+    calc.set_option("cost_calculator", 2);
+    float pi_vec[] = { 0.1, 0.2, 0.15 };
+    float sig2_beta[] = { 1.2, 0.9 };
+    float sig2_zero[] = { 1.5, 1.3 };
+    costs.push_back(calc.calc_univariate_cost(1, 0.2, 1.2, 0.1));
+    costs.push_back(calc.calc_bivariate_cost(3, pi_vec, 2, sig2_beta, 0.1, 2, sig2_zero, 0.05));
+  }
+
+  ASSERT_TRUE(std::isfinite(costs[0]));
+  ASSERT_TRUE(std::isfinite(costs[1]));
+  ASSERT_NEAR(costs[0], costs[2], 1e-6 * std::abs(costs[0]));
+  ASSERT_NEAR(costs[1], costs[3], 1e-6 * std::abs(costs[1]));
+
+  // convolve calculator needs either a complete LD matrix, or the tag-major index
+  BgmgCalculator calc;
+  calc.set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+  calc.set_zvec(1, num_tag, &tm.zvec()->at(0));
+  calc.set_nvec(1, num_tag, &tm.nvec()->at(0));
+  calc.set_weights(num_tag, &tm.weights()->at(0));
+  calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+  calc.set_chrnumvec(num_snp, &tm.chrnumvec()->at(0));
+  calc.set_ld_r2_coo(1, r.size(), &snp_index[0], &tag_index[0], &r[0]);
+  calc.set_ld_r2_csr();
+  calc.set_option("cost_calculator", 2);
+  ASSERT_ANY_THROW(calc.calc_univariate_cost(1, 0.2, 1.2, 0.1));
+}
+
+void LdTest_LoadCsrFromFile(bool shuffle_tag_indices) {
+  int num_snp = 60;
+  int num_tag = 40;
+  int N = 100;
+  TestMother tm(num_snp, num_tag, N);
+  if (shuffle_tag_indices) std::shuffle(tm.tag_to_snp()->begin(), tm.tag_to_snp()->end(), tm.random_engine());
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r;
+  tm.make_r2(200, &snp_index, &tag_index, &r);
+
+  // LD file, as produced by generate_ld_matrix_from_bed_file (upper-triangular CSR, indexed by all snps)
+  const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+  LdMatrixCsrChunk file_chunk;
+  file_chunk.snp_index_from_inclusive_ = 0;
+  file_chunk.snp_index_to_exclusive_ = num_snp;
+  file_chunk.chr_label_ = 0;
+  for (int i = 0; i < r.size(); i++) file_chunk.coo_ld_.push_back(std::make_tuple(snp_index[i], tag_index[i], r[i]));
+  file_chunk.set_ld_r2_csr(nullptr);
+  std::vector<float> empty_vec(num_snp, 0.0f);
+  save_ld_matrix(file_chunk, empty_vec, empty_vec, empty_vec, empty_vec, filename);
+
+  std::vector<std::vector<float>> results;
+  for (int pass = 0; pass < 2; pass++) {
+    BgmgCalculator calc;
+    calc.set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+    calc.set_option("r2min", 0.15f);
+    calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+    calc.set_chrnumvec(num_snp, &tm.chrnumvec()->at(0));
+    if (pass == 0) {
+      std::vector<float> r_packed;  // values as they come out of the LD file
+      for (int i = 0; i < r.size(); i++) r_packed.push_back(packed_r_value(r[i]).get());
+      calc.set_ld_r2_coo(1, r.size(), &snp_index[0], &tag_index[0], &r_packed[0]);
+    } else {
+      calc.set_ld_r2_coo(1, filename);
+    }
+    calc.set_ld_r2_csr();
+
+    std::vector<float> ld_tag_r2_sum(num_tag, 0.0f), ld_tag_r4_sum(num_tag, 0.0f);
+    calc.retrieve_ld_tag_r2_sum(num_tag, &ld_tag_r2_sum[0]);
+    calc.retrieve_ld_tag_r4_sum(num_tag, &ld_tag_r4_sum[0]);
+
+    const int64_t numel = calc.num_ld_r2_chr(1);
+    std::vector<int> snp(numel), tag(numel);
+    std::vector<float> ld_r2(numel);
+    calc.retrieve_ld_r2_chr(1, numel, &snp[0], &tag[0], &ld_r2[0]);
+
+    results.push_back(ld_tag_r2_sum);
+    results.push_back(ld_tag_r4_sum);
+    results.push_back(ld_r2);
+    results.push_back(std::vector<float>(snp.begin(), snp.end()));
+    results.push_back(std::vector<float>(tag.begin(), tag.end()));
+  }
+  boost::filesystem::remove(filename);
+
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(results[i].size(), results[i + 5].size());
+    for (int j = 0; j < results[i].size(); j++) ASSERT_FLOAT_EQ(results[i][j], results[i + 5][j]);
+  }
+}
+
+// --gtest_filter=LdTest.LoadCsrFromFile
+TEST(LdTest, LoadCsrFromFile) {
+  LdTest_LoadCsrFromFile(false);
+  LdTest_LoadCsrFromFile(true);
+}
+
 void UgmgTest_CalcLikelihood(float r2min, int trait_index) {
   // Tests calculation of log likelihood, assuming that all data is already set
   int num_snp = 10;
@@ -319,6 +964,78 @@ TEST(UgmgTest, CalcConvolveLikelihood_with_r2min) {
   UgmgTest_CalcLikelihood_testConvolution(r2min, trait_index);
 }
 
+// --gtest_filter=UgmgTest.CalcLikelihoodCacheVsNocache
+TEST(UgmgTest, CalcLikelihoodCacheVsNocache) {
+  // calc_univariate_cost_cache evaluates the mixture 8 samples at a time (if AVX2 is available) with fast exp;
+  // compare it against the scalar code in calc_univariate_cost_nocache
+  int num_snp = 10;
+  int num_tag = 10;
+  int kmax = 1003;  // not a multiple of 8, to cover the remainder loop
+  int N = 100;
+  int chr_label = 1;
+  int trait_index = 1;
+  TestMother tm(num_snp, num_tag, N);
+  BgmgCalculator calc;
+  calc.set_tag_indices(num_snp, num_tag, &tm.tag_to_snp()->at(0));
+  calc.set_option("seed", 0);
+  calc.set_option("max_causals", num_snp);
+  calc.set_option("kmax", kmax);
+  calc.set_option("num_components", 1);
+  calc.set_option("cache_tag_r2sum", 1);
+  calc.set_option("use_complete_tag_indices", 1);
+  calc.set_option("threads", 1);
+
+  calc.set_zvec(trait_index, num_tag, &tm.zvec()->at(0));
+  calc.set_nvec(trait_index, num_tag, &tm.nvec()->at(0));
+  calc.set_weights(num_tag, &tm.weights()->at(0));
+
+  std::vector<int> snp_index, tag_index;
+  std::vector<float> r2;
+  tm.make_r2(20, &snp_index, &tag_index, &r2);
+
+  calc.set_mafvec(num_snp, &tm.mafvec()->at(0));
+  calc.set_chrnumvec(num_snp, &tm.chrnumvec()->at(0));
+  calc.set_ld_r2_coo(chr_label, r2.size(), &snp_index[0], &tag_index[0], &r2[0]);
+  calc.set_ld_r2_csr();
+
+  for (float z1max : {1e10f, 1.0f}) {  // without censoring, and with censoring of some tags
+    calc.set_option("z1max", z1max);
+    for (float sig2_beta : {0.1f, 1e-4f}) {
+      calc.clear_loglike_cache();
+      const double cost = calc.calc_univariate_cost(trait_index, 0.2, 1.2, sig2_beta);
+      const double cost_nocache = calc.calc_univariate_cost_nocache(trait_index, 0.2, 1.2, sig2_beta);
+      ASSERT_TRUE(std::isfinite(cost));
+      EXPECT_NEAR(cost, cost_nocache, 1e-5 * std::abs(cost_nocache));
+    }
+  }
+}
+
+// --gtest_filter=UgmgTest.TiledMatrix
+TEST(UgmgTest, TiledMatrix) {
+  const int no_rows = 37, no_columns = 43;  // neither is a multiple of the tile size
+  TiledMatrix<float> tiled(no_rows, no_columns);
+  tiled.InitializeZeros();
+  for (int i = 0; i < no_rows; i++)
+    for (int j = 0; j < no_columns; j++)
+      tiled(i, j) = i * 1000 + j;
+
+  const int tile_cols = TiledMatrix<float>::tile_cols;
+  ASSERT_EQ(tiled.no_col_tiles(), (no_columns + tile_cols - 1) / tile_cols);
+  for (int i = 0; i < no_rows; i++) {
+    for (int k_tile = 0; k_tile < tiled.no_col_tiles(); k_tile++) {
+      const float* segment = tiled.row_segment(i, k_tile);
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(segment) % 64, 0);
+      for (int j = k_tile * tile_cols; j < std::min(no_columns, (k_tile + 1) * tile_cols); j++)
+        ASSERT_EQ(segment[j - k_tile * tile_cols], i * 1000 + j);
+    }
+  }
+
+  // same column of consecutive rows within a tile are in consecutive cache lines
+  ASSERT_EQ(&tiled(1, 5) - &tiled(0, 5), tile_cols);
+  ASSERT_EQ(tiled.size(), no_rows * no_columns);
+  ASSERT_GE(tiled.mem_bytes(), no_rows * no_columns * sizeof(float));
+}
+
 void BgmgTest_CalcLikelihood_testConvolution(float r2min) {
   // Tests calculation of log likelihood, assuming that all data is already set
   int num_snp = 10;